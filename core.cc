@@ -232,6 +232,8 @@ LUA_EXPORT int Init_core(lua_State* L) {
   unsigned int mode = 0x27F;
   asm("fldcw %0" : : "m" (*&mode));
 #endif
+  // Start the worker pool now, while nobody else could be starting it.
+  GetWorkerCount();
   return 0;
 }
 
@@ -162,6 +162,23 @@ namespace SubCritical {
     pthread_mutex_t mutex;
   };
 #endif
+  /* A pool of worker threads, shared by every package, for splitting big
+     jobs (usually ranges of rows) into bands. func is called on disjoint
+     [first, last) bands, at least grain long where possible, that together
+     cover [first, last); several may run at once on different threads.
+     ParallelBands returns when all of them are done.
+     Only one job uses the pool at a time. A call made while it is busy
+     (including one made from inside func) just runs func(ctx, first, last)
+     on the calling thread, so func may safely call ParallelBands itself.
+     TryParallelBands is the same, except that where ParallelBands would
+     run func on the calling thread it returns false without calling it.
+     The SUBCRITICAL_THREADS environment variable, if set, overrides the
+     number of threads (counting the caller); 1 disables the pool. */
+  typedef void(*BandFunc)(void* ctx, int first, int last);
+  EXPORT void ParallelBands(BandFunc func, void* ctx, int first, int last, int grain = 1) throw();
+  EXPORT bool TryParallelBands(BandFunc func, void* ctx, int first, int last, int grain = 1) throw();
+  /* The number of threads ParallelBands can use, counting the caller. */
+  EXPORT int GetWorkerCount() throw();
   static const bool little_endian = BYTE_ORDER == LITTLE_ENDIAN;
 #if BYTE_ORDER == LITTLE_ENDIAN
   static inline uint64_t Swap64(uint64_t u) { return be64toh(u); }
@@ -0,0 +1,350 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+
+#include "effects.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace SubCritical;
+
+/* Blurs work on a copy of the image with 16 bits per channel: linear red,
+   green, blue (premultiplied by alpha) and alpha for a Drawable, coverage
+   for a Frisket. Each box pass keeps a running sum of the window as it
+   slides along, so its cost doesn't depend on the radius. Pixels past the
+   edges are taken to be copies of the edge pixels.
+   Rows are blurred horizontally in bands, and then columns vertically in
+   bands of columns, on the worker pool. */
+
+#define MAX_BLUR_PASSES 3
+// keeps window sums under 2^31
+#define MAX_BLUR_RADIUS 16383
+// fewer elements than this per band aren't worth handing off
+#define BLUR_BAND_AREA 16384
+// the vertical pass works on this many elements of each row at a time
+#define BLUR_COLUMN_GROUP 64
+
+struct LOCAL BlurJob {
+  int width, height, channels;
+  // elements per row
+  size_t pitch;
+  uint16_t* a, *b;
+  int hradius[MAX_BLUR_PASSES], vradius[MAX_BLUR_PASSES];
+  int hpasses, vpasses;
+  // for the vertical pass in progress
+  const uint16_t* vin;
+  uint16_t* vout;
+  int radius;
+  uint32_t* sums;
+  // what's being blurred
+  const Drawable* src_d;
+  Drawable* dst_d;
+  const Frisket* src_f;
+  Frisket* dst_f;
+  int rsh, gsh, bsh, ash;
+  bool alpha, premultiplied;
+};
+
+static inline uint16_t Average(uint32_t sum, float rcp) {
+  return (uint16_t)(sum * rcp + 0.5f);
+}
+
+#ifdef __SSE2__
+static inline __m128i Load4(const uint16_t* p) {
+  return _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+}
+static inline void Store4(uint16_t* p, __m128i sum, __m128 rcp) {
+  __m128i v = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(sum), rcp), _mm_set1_ps(0.5f)));
+  // there's no unsigned 32-to-16 pack before SSE4.1
+  v = _mm_packs_epi32(_mm_sub_epi32(v, _mm_set1_epi32(32768)), _mm_setzero_si128());
+  _mm_storel_epi64((__m128i*)p, _mm_xor_si128(v, _mm_set1_epi16((short)0x8000)));
+}
+#endif
+
+/* The window sum for the first element: the edge counts r + 1 times, and
+   anything past the far end counts as the last element. */
+static inline uint32_t FirstWindow(const uint16_t* in, size_t stride, int n, int r) {
+  uint32_t sum = in[0] * (uint32_t)(r + 1);
+  int near = r < n - 1 ? r : n - 1;
+  for(int i = 1; i <= near; ++i) sum += in[i * stride];
+  sum += in[(n - 1) * stride] * (uint32_t)(r - near);
+  return sum;
+}
+
+/* One horizontal box pass over a row of n pixels of C channels each. */
+template<int C> static void BoxRow(uint16_t*restrict out, const uint16_t*restrict in, int n, int r) {
+  const float rcp = 1.f / (2 * r + 1);
+#ifdef __SSE2__
+  if(C == 4) {
+    __m128i sum = _mm_setr_epi32(FirstWindow(in, 4, n, r), FirstWindow(in + 1, 4, n, r),
+				 FirstWindow(in + 2, 4, n, r), FirstWindow(in + 3, 4, n, r));
+    __m128 vrcp = _mm_set1_ps(rcp);
+    for(int x = 0; x < n; ++x) {
+      Store4(out + x * 4, sum, vrcp);
+      int add = x + r + 1 < n ? x + r + 1 : n - 1, sub = x - r > 0 ? x - r : 0;
+      sum = _mm_sub_epi32(_mm_add_epi32(sum, Load4(in + add * 4)), Load4(in + sub * 4));
+    }
+    return;
+  }
+#endif
+  uint32_t sum[C];
+  for(int c = 0; c < C; ++c) sum[c] = FirstWindow(in + c, C, n, r);
+  for(int x = 0; x < n; ++x) {
+    int add = x + r + 1 < n ? x + r + 1 : n - 1, sub = x - r > 0 ? x - r : 0;
+    for(int c = 0; c < C; ++c) {
+      out[x * C + c] = Average(sum[c], rcp);
+      sum[c] += in[add * C + c] - in[sub * C + c];
+    }
+  }
+}
+
+static void HorizontalBand(void* _job, int first, int last) {
+  const BlurJob* job = (const BlurJob*)_job;
+  uint16_t temp[2][job->pitch];
+  for(int y = first; y < last; ++y) {
+    uint16_t* row = job->a + job->pitch * y;
+    // a pass can't work in place, so the row starts out in the second temp
+    memcpy(temp[1], row, job->pitch * sizeof(uint16_t));
+    const uint16_t* in = temp[1];
+    for(int pass = 0; pass < job->hpasses; ++pass) {
+      uint16_t* out = pass == job->hpasses - 1 ? row : temp[pass & 1];
+      if(job->channels == 4) BoxRow<4>(out, in, job->width, job->hradius[pass]);
+      else BoxRow<1>(out, in, job->width, job->hradius[pass]);
+      in = out;
+    }
+  }
+}
+
+/* One vertical box pass over elements group * BLUR_COLUMN_GROUP on, of
+   every row. The running sums for a whole row are updated together, so
+   memory is read in order. */
+static void VerticalBand(void* _job, int first, int last) {
+  const BlurJob* job = (const BlurJob*)_job;
+  const int r = job->radius, h = job->height;
+  const size_t pitch = job->pitch;
+  const float rcp = 1.f / (2 * r + 1);
+  size_t e0 = first * BLUR_COLUMN_GROUP, e1 = last * BLUR_COLUMN_GROUP;
+  if(e1 > pitch) e1 = pitch;
+  const uint16_t* in = job->vin;
+  uint32_t*restrict sums = job->sums;
+  for(size_t e = e0; e < e1; ++e) sums[e] = FirstWindow(in + e, pitch, h, r);
+  for(int y = 0; y < h; ++y) {
+    uint16_t*restrict out = job->vout + pitch * y;
+    const uint16_t* add = in + pitch * (y + r + 1 < h ? y + r + 1 : h - 1);
+    const uint16_t* sub = in + pitch * (y - r > 0 ? y - r : 0);
+    size_t e = e0;
+#ifdef __SSE2__
+    __m128 vrcp = _mm_set1_ps(rcp);
+    for(; e + 4 <= e1; e += 4) {
+      __m128i sum = _mm_loadu_si128((const __m128i*)(sums + e));
+      Store4(out + e, sum, vrcp);
+      sum = _mm_sub_epi32(_mm_add_epi32(sum, Load4(add + e)), Load4(sub + e));
+      _mm_storeu_si128((__m128i*)(sums + e), sum);
+    }
+#endif
+    for(; e < e1; ++e) {
+      out[e] = Average(sums[e], rcp);
+      sums[e] += add[e] - sub[e];
+    }
+  }
+}
+
+static void LoadBand(void* _job, int first, int last) {
+  const BlurJob* job = (const BlurJob*)_job;
+  for(int y = first; y < last; ++y) {
+    uint16_t*restrict p = job->a + job->pitch * y;
+    if(job->src_f) {
+      const Frixel* s = job->src_f->rows[y];
+      for(int x = 0; x < job->width; ++x) p[x] = s[x] * 257;
+      continue;
+    }
+    const Pixel* s = job->src_d->rows[y];
+    for(int x = 0; x < job->width; ++x, p += 4) {
+      Pixel px = s[x];
+      uint32_t r = SrgbToLinear[(px >> job->rsh) & 255];
+      uint32_t g = SrgbToLinear[(px >> job->gsh) & 255];
+      uint32_t b = SrgbToLinear[(px >> job->bsh) & 255];
+      uint32_t a = job->alpha ? (px >> job->ash) & 255 : 255;
+      if(job->alpha && !job->premultiplied) {
+	r = (r * a + 127) / 255;
+	g = (g * a + 127) / 255;
+	b = (b * a + 127) / 255;
+      }
+      p[0] = r; p[1] = g; p[2] = b; p[3] = a * 257;
+    }
+  }
+}
+
+static void StoreBand(void* _job, int first, int last) {
+  const BlurJob* job = (const BlurJob*)_job;
+  // the result is wherever the last pass left it
+  const uint16_t* result = (job->vpasses & 1) ? job->b : job->a;
+  for(int y = first; y < last; ++y) {
+    const uint16_t*restrict p = result + job->pitch * y;
+    if(job->dst_f) {
+      Frixel* d = job->dst_f->rows[y];
+      for(int x = 0; x < job->width; ++x) d[x] = (p[x] + 128) / 257;
+      continue;
+    }
+    Pixel* d = job->dst_d->rows[y];
+    Pixel mask = job->alpha ? 0 : 255 << job->ash;
+    for(int x = 0; x < job->width; ++x, p += 4) {
+      uint32_t r = p[0], g = p[1], b = p[2], a = (p[3] + 128) / 257;
+      if(job->alpha) {
+	if(!job->premultiplied) {
+	  if(p[3]) {
+	    r = r * 65535 / p[3];
+	    g = g * 65535 / p[3];
+	    b = b * 65535 / p[3];
+	    if(r > 65535) r = 65535;
+	    if(g > 65535) g = 65535;
+	    if(b > 65535) b = 65535;
+	  }
+	  else r = g = b = 0;
+	}
+	mask = a << job->ash;
+      }
+      d[x] = ((Pixel)LinearToSrgb[r] << job->rsh) | ((Pixel)LinearToSrgb[g] << job->gsh) | ((Pixel)LinearToSrgb[b] << job->bsh) | mask;
+    }
+  }
+}
+
+static void Blur(BlurJob& job) {
+  int row_grain = BLUR_BAND_AREA / job.pitch + 1;
+  ParallelBands(LoadBand, &job, 0, job.height, row_grain);
+  if(job.hpasses) ParallelBands(HorizontalBand, &job, 0, job.height, row_grain);
+  int groups = (job.pitch + BLUR_COLUMN_GROUP - 1) / BLUR_COLUMN_GROUP;
+  int group_grain = BLUR_BAND_AREA / (BLUR_COLUMN_GROUP * job.height) + 1;
+  for(int pass = 0; pass < job.vpasses; ++pass) {
+    job.vin = (pass & 1) ? job.b : job.a;
+    job.vout = (pass & 1) ? job.a : job.b;
+    job.radius = job.vradius[pass];
+    ParallelBands(VerticalBand, &job, 0, groups, group_grain);
+  }
+  ParallelBands(StoreBand, &job, 0, job.height, row_grain);
+}
+
+/* Box widths whose three passes come closest to a Gaussian with the given
+   standard deviation (from "Fast Almost-Gaussian Filtering", Kovesi). */
+static int GaussianRadii(float sigma, int* radii) {
+  if(sigma <= 0.f) return 0;
+  const int n = MAX_BLUR_PASSES;
+  float ideal = sqrtf(12.f * sigma * sigma / n + 1.f);
+  int wl = (int)floorf(ideal);
+  if(!(wl & 1)) --wl;
+  int wu = wl + 2;
+  float mideal = (12.f * sigma * sigma - n * wl * wl - 4.f * n * wl - 3.f * n) / (-4.f * wl - 4.f);
+  int m = (int)floorf(mideal + 0.5f);
+  for(int i = 0; i < n; ++i) {
+    int r = ((i < m ? wl : wu) - 1) / 2;
+    radii[i] = r > MAX_BLUR_RADIUS ? MAX_BLUR_RADIUS : r;
+  }
+  return n;
+}
+
+/* SCUtil.BoxBlur(source, radius[, radius_y][, destination]) or
+   SCUtil.GaussianBlur(source, sigma[, sigma_y][, destination]) */
+static int DoBlur(lua_State* L, bool gaussian, const char* what) {
+  Object* source = Object::To(L, 1);
+  int dest_index = lua_type(L, 3) == LUA_TNUMBER ? 4 : 3;
+  lua_Number rx = luaL_checknumber(L, 2);
+  lua_Number ry = dest_index == 4 ? lua_tonumber(L, 3) : rx;
+  if(rx < 0 || ry < 0) return luaL_error(L, "%s radius must not be negative", what);
+  BlurJob job;
+  memset(&job, 0, sizeof(job));
+  if(gaussian) {
+    job.hpasses = GaussianRadii(rx, job.hradius);
+    job.vpasses = GaussianRadii(ry, job.vradius);
+  }
+  else {
+    job.hradius[0] = rx > MAX_BLUR_RADIUS ? MAX_BLUR_RADIUS : (int)rx;
+    job.vradius[0] = ry > MAX_BLUR_RADIUS ? MAX_BLUR_RADIUS : (int)ry;
+    job.hpasses = job.hradius[0] > 0;
+    job.vpasses = job.vradius[0] > 0;
+  }
+  if(source->IsA("Frisket")) {
+    job.src_f = (const Frisket*)source;
+    job.width = job.src_f->width;
+    job.height = job.src_f->height;
+    job.channels = 1;
+    if(lua_type(L, dest_index) == LUA_TUSERDATA) {
+      job.dst_f = lua_toobject(L, dest_index, Frisket);
+      if(job.dst_f == job.src_f) return luaL_error(L, "source and destination must differ");
+      if(job.dst_f->width != job.width || job.dst_f->height != job.height)
+	return luaL_error(L, "%s needs a %dx%d destination", what, job.width, job.height);
+      lua_pushvalue(L, dest_index);
+    }
+    else {
+      job.dst_f = new Frisket(job.width, job.height);
+      job.dst_f->Push(L);
+    }
+  }
+  else if(source->IsA("Drawable")) {
+    job.src_d = (const Drawable*)source;
+    job.width = job.src_d->width;
+    job.height = job.src_d->height;
+    job.channels = 4;
+    job.dst_d = GetDestination(L, dest_index, (Drawable*)job.src_d, job.width, job.height, what);
+    switch(job.src_d->layout) {
+#define DO_FBLAYOUT(layout, _rsh, _gsh, _bsh, _ash)			\
+      case layout: job.rsh = _rsh; job.gsh = _gsh; job.bsh = _bsh; job.ash = _ash; break
+      DO_FBLAYOUT(FB_RGBx, 24, 16, 8, 0);
+      DO_FBLAYOUT(FB_xRGB, 16, 8, 0, 24);
+      DO_FBLAYOUT(FB_BGRx, 8, 16, 24, 0);
+    default:
+      DO_FBLAYOUT(FB_xBGR, 0, 8, 16, 24);
+#undef DO_FBLAYOUT
+    }
+    job.alpha = job.src_d->has_alpha;
+    job.premultiplied = job.src_d->premultiplied;
+    // blurring makes partial alpha out of simple alpha
+    if(job.dst_d->has_alpha) job.dst_d->simple_alpha = false;
+  }
+  else return luaL_typerror(L, 1, "Drawable or Frisket");
+  job.pitch = (size_t)job.width * job.channels;
+  size_t elements = job.pitch * job.height;
+  job.a = (uint16_t*)malloc(elements * sizeof(uint16_t));
+  job.b = job.vpasses ? (uint16_t*)malloc(elements * sizeof(uint16_t)) : NULL;
+  job.sums = job.vpasses ? (uint32_t*)malloc(job.pitch * sizeof(uint32_t)) : NULL;
+  if(!job.a || (job.vpasses && (!job.b || !job.sums))) {
+    free(job.a);
+    free(job.b);
+    free(job.sums);
+    return luaL_error(L, "Out of memory");
+  }
+  Blur(job);
+  free(job.a);
+  free(job.b);
+  free(job.sums);
+  return 1;
+}
+
+SUBCRITICAL_UTILITY(BoxBlur)(lua_State* L) {
+  return DoBlur(L, false, "BoxBlur");
+}
+
+SUBCRITICAL_UTILITY(GaussianBlur)(lua_State* L) {
+  return DoBlur(L, true, "GaussianBlur");
+}
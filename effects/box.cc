@@ -21,53 +21,55 @@
 
 #include "subcritical/graphics.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 using namespace SubCritical;
 
-template<int sh1, int sh2, int sh3> void BoxDown_2x2(const Drawable*restrict src, Drawable*restrict dst) {
-  const Pixel*restrict srcpa, *restrict srcpb;
-  Pixel*restrict dstp;
-  for(int dy = 0; dy < dst->height; ++dy) {
-    size_t rem = dst->width;
-    unsigned long s1, s2, s3;
-    srcpa = src->rows[dy*2];
-    srcpb = src->rows[dy*2+1];
-    dstp = dst->rows[dy];
-    UNROLL(rem,
-	   s1 = 0; s2 = 0; s3 = 0;
-	   s1 = SrgbToLinear[(srcpa[0] >> sh1) & 255] +
-	   SrgbToLinear[(srcpa[1] >> sh1) & 255] +
-	   SrgbToLinear[(srcpb[0] >> sh1) & 255] +
-	   SrgbToLinear[(srcpb[1] >> sh1) & 255];
-	   s2 = SrgbToLinear[(srcpa[0] >> sh2) & 255] +
-	   SrgbToLinear[(srcpa[1] >> sh2) & 255] +
-	   SrgbToLinear[(srcpb[0] >> sh2) & 255] +
-	   SrgbToLinear[(srcpb[1] >> sh2) & 255];
-	   s3 = SrgbToLinear[(srcpa[0] >> sh3) & 255] +
-	   SrgbToLinear[(srcpa[1] >> sh3) & 255] +
-	   SrgbToLinear[(srcpb[0] >> sh3) & 255] +
-	   SrgbToLinear[(srcpb[1] >> sh3) & 255];
-	   srcpa += 2; srcpb += 2;
-	   *dstp++ = (LinearToSrgb[(s1/4)]<<sh1)|(LinearToSrgb[(s2/4)]<<sh2)|(LinearToSrgb[(s3/4)]<<sh3););
-  }
+/* Sums of up to 65536 SrgbToLinear values, divided by their count and
+   rounded down. The extra half keeps the result clear of any error in the
+   reciprocal, so this is exact. */
+static inline uint32_t DivideSum(unsigned long s, double rcount) {
+  return (uint32_t)((s + 0.5) * rcount);
+}
+
+typedef void(*BoxRowFunc)(Pixel*restrict dstp, const Pixel*restrict srcpa, const Pixel*restrict srcpb, size_t rem);
+
+/* One destination row from two source rows. Only the table lookups are
+   scalar; there's nothing else to speak of. */
+template<int sh1, int sh2, int sh3> static void BoxRow_2x2(Pixel*restrict dstp, const Pixel*restrict srcpa, const Pixel*restrict srcpb, size_t rem) {
+  unsigned long s1, s2, s3;
+  UNROLL(rem,
+	 s1 = SrgbToLinear[(srcpa[0] >> sh1) & 255] +
+	 SrgbToLinear[(srcpa[1] >> sh1) & 255] +
+	 SrgbToLinear[(srcpb[0] >> sh1) & 255] +
+	 SrgbToLinear[(srcpb[1] >> sh1) & 255];
+	 s2 = SrgbToLinear[(srcpa[0] >> sh2) & 255] +
+	 SrgbToLinear[(srcpa[1] >> sh2) & 255] +
+	 SrgbToLinear[(srcpb[0] >> sh2) & 255] +
+	 SrgbToLinear[(srcpb[1] >> sh2) & 255];
+	 s3 = SrgbToLinear[(srcpa[0] >> sh3) & 255] +
+	 SrgbToLinear[(srcpa[1] >> sh3) & 255] +
+	 SrgbToLinear[(srcpb[0] >> sh3) & 255] +
+	 SrgbToLinear[(srcpb[1] >> sh3) & 255];
+	 srcpa += 2; srcpb += 2;
+	 *dstp++ = (LinearToSrgb[(s1/4)]<<sh1)|(LinearToSrgb[(s2/4)]<<sh2)|(LinearToSrgb[(s3/4)]<<sh3););
 }
 
-static void BoxDown_2x2(const Drawable*restrict src, Drawable*restrict dst) {
-  switch(src->layout) {
+static BoxRowFunc GetBoxRow_2x2(FBLayout layout) {
+  switch(layout) {
   default:
   case FB_xRGB:
   case FB_xBGR:
-    BoxDown_2x2<16,8,0>(src,dst);
-    return;
+    return BoxRow_2x2<16,8,0>;
   case FB_RGBx:
   case FB_BGRx:
-    BoxDown_2x2<24,16,8>(src,dst);
-    return;
+    return BoxRow_2x2<24,16,8>;
   }
 }
 
-static void BoxDown_NxN(const Drawable*restrict src, Drawable*restrict dst, int xf, int yf) {
-  int sh1, sh2, sh3;
-  switch(src->layout) {
+static void GetBoxShifts(FBLayout layout, int& sh1, int& sh2, int& sh3) {
+  switch(layout) {
   default:
   case FB_xRGB:
   case FB_xBGR:
@@ -82,40 +84,72 @@ static void BoxDown_NxN(const Drawable*restrict src, Drawable*restrict dst, int
     sh3 = 8;
     break;
   }
-  const Pixel*restrict srcp[yf];
-  Pixel*restrict dstp;
-  unsigned long tf = xf * yf;
-  for(int dy = 0; dy < dst->height; ++dy) {
-    for(int y = 0; y < yf; ++y) srcp[y] = src->rows[dy*yf+y];
-    dstp = dst->rows[dy];
-    for(int dx = 0; dx < dst->width; ++dx) {
+}
+
+/* The source is summed a row at a time into one total per destination
+   pixel and channel, so it's read in order. */
+static void BoxRow_NxN(Pixel*restrict dstp, const Drawable*restrict src, int sy, int dw, int xf, int yf, unsigned long*restrict sums) {
+  int sh1, sh2, sh3;
+  GetBoxShifts(src->layout, sh1, sh2, sh3);
+  memset(sums, 0, dw * 3 * sizeof(unsigned long));
+  for(int y = 0; y < yf; ++y) {
+    const Pixel*restrict srcp = src->rows[sy + y];
+    unsigned long*restrict sp = sums;
+    for(int dx = 0; dx < dw; ++dx, sp += 3) {
       unsigned long s1 = 0, s2 = 0, s3 = 0;
-      for(int y = 0; y < yf; ++y) {
-	for(int x = 0; x < xf; ++x) {
-	  s1 += SrgbToLinear[(*srcp[y] >> sh1) & 255];
-	  s2 += SrgbToLinear[(*srcp[y] >> sh2) & 255];
-	  s3 += SrgbToLinear[(*srcp[y] >> sh3) & 255];
-	  ++srcp[y];
-	}
+      for(int x = 0; x < xf; ++x) {
+	s1 += SrgbToLinear[(*srcp >> sh1) & 255];
+	s2 += SrgbToLinear[(*srcp >> sh2) & 255];
+	s3 += SrgbToLinear[(*srcp >> sh3) & 255];
+	++srcp;
       }
-      *dstp++ = (LinearToSrgb[(s1/tf)]<<sh1)|(LinearToSrgb[(s2/tf)]<<sh2)|(LinearToSrgb[(s3/tf)]<<sh3);
+      sp[0] += s1;
+      sp[1] += s2;
+      sp[2] += s3;
     }
   }
+  double rtf = 1.0 / (xf * yf);
+  const unsigned long* sp = sums;
+  for(int dx = 0; dx < dw; ++dx, sp += 3)
+    *dstp++ = (LinearToSrgb[DivideSum(sp[0], rtf)]<<sh1)|(LinearToSrgb[DivideSum(sp[1], rtf)]<<sh2)|(LinearToSrgb[DivideSum(sp[2], rtf)]<<sh3);
+}
+
+/* Destination rows are split into bands on the worker pool. Fewer pixels
+   than this per band aren't worth handing off. */
+#define BOX_BAND_AREA 16384
+
+struct LOCAL BoxJob {
+  const Drawable* src;
+  Drawable* dst;
+  int xf, yf;
+};
+
+static void BoxBand(void* _job, int first, int last) {
+  const BoxJob* job = (const BoxJob*)_job;
+  const Drawable* src = job->src;
+  Drawable* dst = job->dst;
+  if(job->xf == 2 && job->yf == 2) {
+    BoxRowFunc row = GetBoxRow_2x2(src->layout);
+    for(int dy = first; dy < last; ++dy)
+      row(dst->rows[dy], src->rows[dy*2], src->rows[dy*2+1], dst->width);
+  }
+  else {
+    // on the heap, since worker threads have small stacks and rows can be wide
+    unsigned long* sums = (unsigned long*)malloc(dst->width * 3 * sizeof(unsigned long));
+    if(!sums) abort(); // :|
+    for(int dy = first; dy < last; ++dy)
+      BoxRow_NxN(dst->rows[dy], src, dy * job->yf, dst->width, job->xf, job->yf, sums);
+    free(sums);
+  }
 }
 
 SUBCRITICAL_UTILITY(BoxDown)(lua_State* L) {
   Drawable*restrict src = lua_toobject(L, 1, Drawable);
   Drawable*restrict dst = lua_toobject(L, 2, Drawable);
-  if(src == dst)
-    return luaL_error(L, "Source and destination Drawables must differ");
-  if(src->layout != dst->layout) {
-    if(src->IsA("Graphic"))
-      ((Graphic*)src)->ChangeLayout(dst->layout);
-    else if(dst->IsA("Graphic"))
-      ((Graphic*)dst)->ChangeLayout(src->layout);
-    else
-      return luaL_error(L, "Attempt to BoxDown between two non-morphable Drawables!");
-  }
+  if(DrawablesOverlap(src, dst))
+    return luaL_error(L, "Source and destination Drawables must not overlap");
+  if(!MatchLayouts(src, dst))
+    return luaL_error(L, "Attempt to BoxDown between two non-morphable Drawables!");
   if(src->has_alpha || dst->has_alpha)
     return luaL_error(L, "You cannot use BoxDown on any Drawable with an alpha channel");
   int xf, yf;
@@ -131,9 +165,91 @@ SUBCRITICAL_UTILITY(BoxDown)(lua_State* L) {
     return luaL_error(L, "Source width not equal to destination width times X scale factor");
   if(dst->height * yf != src->height)
     return luaL_error(L, "Source height not equal to destination height times Y scale factor");
-  if(xf == 2 && yf == 2)
-    BoxDown_2x2(src, dst);
-  else
-    BoxDown_NxN(src, dst, xf, yf);
+  BoxJob job = {src, dst, xf, yf};
+  ParallelBands(BoxBand, &job, 0, dst->height, BOX_BAND_AREA / (dst->width * xf * yf) + 1);
   return 0;
 }
+
+/* A mipmap chain is built in one pass over the source: as soon as two rows
+   of one level are done, the row of the next level they make is done too,
+   while they're still in the cache. Bands of rows that are a multiple of
+   2^MIP_BAND_LEVELS tall make their own rows of the first MIP_BAND_LEVELS
+   levels, independently, on the worker pool; the much smaller levels after
+   those are made the same way, from the last of them, afterwards. */
+#define MAX_MIP_LEVELS 32
+#define MIP_BAND_LEVELS 4
+
+struct LOCAL MipJob {
+  const Drawable* src;
+  Graphic* dst;
+  BoxRowFunc row;
+  int levels, band_rows;
+  // level 0 is the source; the rest are stacked in dst, top to bottom
+  int width[MAX_MIP_LEVELS+1], height[MAX_MIP_LEVELS+1], top[MAX_MIP_LEVELS+1];
+  inline Pixel* Row(int level, int y) const {
+    return level ? dst->rows[top[level] + y] : src->rows[y];
+  }
+};
+
+// row y of level has just been made; make whatever rows it finishes
+static void MipCascade(const MipJob* job, int level, int y, int last_level) {
+  while(level < last_level && (y & 1) && (y >> 1) < job->height[level+1]) {
+    job->row(job->Row(level + 1, y >> 1), job->Row(level, y - 1), job->Row(level, y), job->width[level+1]);
+    ++level;
+    y >>= 1;
+  }
+}
+
+static void MipBand(void* _job, int first, int last) {
+  const MipJob* job = (const MipJob*)_job;
+  int last_level = job->levels < MIP_BAND_LEVELS ? job->levels : MIP_BAND_LEVELS;
+  int stop = last * job->band_rows;
+  if(stop > job->height[0]) stop = job->height[0];
+  for(int y = first * job->band_rows; y < stop; ++y)
+    MipCascade(job, 0, y, last_level);
+}
+
+SUBCRITICAL_UTILITY(GenerateMipmaps)(lua_State* L) {
+  Drawable*restrict src = lua_toobject(L, 1, Drawable);
+  if(src->has_alpha)
+    return luaL_error(L, "You cannot use GenerateMipmaps on any Drawable with an alpha channel");
+  int max_levels = 0;
+  while(max_levels < MAX_MIP_LEVELS && src->width >> (max_levels + 1) && src->height >> (max_levels + 1)) ++max_levels;
+  int levels = luaL_optinteger(L, 2, max_levels);
+  if(max_levels == 0)
+    return luaL_error(L, "Drawable is too small to make any mipmaps of");
+  if(levels < 1)
+    return luaL_error(L, "Silly level count given");
+  if(levels > max_levels) levels = max_levels;
+  if(!lua_checkstack(L, levels + 4))
+    return luaL_error(L, "Too many mipmap levels");
+  MipJob job;
+  job.src = src;
+  job.row = GetBoxRow_2x2(src->layout);
+  job.levels = levels;
+  job.width[0] = src->width;
+  job.height[0] = src->height;
+  job.top[0] = 0;
+  int total_height = 0;
+  for(int n = 1; n <= levels; ++n) {
+    job.width[n] = job.width[n-1] / 2;
+    job.height[n] = job.height[n-1] / 2;
+    job.top[n] = total_height;
+    total_height += job.height[n];
+  }
+  // every pixel that's part of a level gets written
+  job.dst = new Graphic(job.width[1], total_height, src->layout, false);
+  job.dst->has_alpha = false;
+  job.dst->Push(L);
+  int dst_index = lua_gettop(L);
+  int band_rows = (BOX_BAND_AREA / src->width + 1 + (1 << MIP_BAND_LEVELS) - 1) & ~((1 << MIP_BAND_LEVELS) - 1);
+  job.band_rows = band_rows;
+  ParallelBands(MipBand, &job, 0, (src->height + band_rows - 1) / band_rows);
+  if(levels > MIP_BAND_LEVELS) {
+    for(int y = 0; y < job.height[MIP_BAND_LEVELS]; ++y)
+      MipCascade(&job, MIP_BAND_LEVELS, y, levels);
+  }
+  for(int n = 1; n <= levels; ++n)
+    NewGraphicView(L, dst_index, 0, job.top[n], job.width[n], job.height[n]);
+  return levels;
+}
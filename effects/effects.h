@@ -0,0 +1,37 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#ifndef _SUBCRITICAL_EFFECTS_H
+#define _SUBCRITICAL_EFFECTS_H
+
+/* Internal to the effects package; not installed. */
+
+#include "subcritical/graphics.h"
+
+namespace SubCritical {
+  /* Gets the destination for an effect that writes every pixel of a
+     width x height result. If the argument at index is a Drawable, it's used
+     (after checking its size and matching its layout to src's); otherwise a
+     new Graphic is made, without clearing it. Either way, the destination is
+     pushed and takes on src's alpha flags. */
+  LOCAL Drawable* GetDestination(lua_State* L, int index, Drawable* src, int width, int height, const char* what);
+}
+
+#endif
@@ -19,63 +19,71 @@
   Please see doc/license.html for clarifications.
  */
 
-#include "subcritical/graphics.h"
+#include "effects.h"
+
+#include <string.h>
 
 using namespace SubCritical;
 
+Drawable* SubCritical::GetDestination(lua_State* L, int index, Drawable* src, int width, int height, const char* what) {
+  Drawable* dst;
+  if(lua_type(L, index) == LUA_TUSERDATA) {
+    dst = lua_toobject(L, index, Drawable);
+    if(DrawablesOverlap(dst, src)) luaL_error(L, "source and destination must not overlap");
+    if(dst->width != width || dst->height != height)
+      luaL_error(L, "%s needs a %dx%d destination", what, width, height);
+    if(!MatchLayouts(src, dst))
+      luaL_error(L, "Attempt to %s between two non-morphable Drawables!", what);
+    lua_pushvalue(L, index);
+  }
+  else {
+    dst = new Graphic(width, height, src->layout, false);
+    dst->Push(L);
+  }
+  if(dst->IsA("Graphic")) {
+    dst->has_alpha = src->has_alpha;
+    dst->simple_alpha = src->simple_alpha;
+    dst->premultiplied = src->premultiplied;
+  }
+  dst->AddDamage(0, 0, width - 1, height - 1);
+  return dst;
+}
+
 SUBCRITICAL_UTILITY(MirrorHorizontal)(lua_State* L) {
   Drawable*restrict old = lua_toobject(L, 1, Drawable);
-  Graphic*restrict graphic = new Graphic(old->width, old->height, old->layout);
-  graphic->has_alpha = old->has_alpha;
-  graphic->simple_alpha = old->simple_alpha;
+  Drawable*restrict graphic = GetDestination(L, 2, old, old->width, old->height, "MirrorHorizontal");
   for(int y = 0; y < graphic->height; ++y) {
     Pixel*restrict pl = old->rows[y], *restrict pr = graphic->rows[y] + graphic->width - 1;
     int rem = graphic->width;
     UNROLL_MORE(rem,
 		*pr-- = *pl++);
   }
-  graphic->Push(L);
   return 1;
 }
 
 SUBCRITICAL_UTILITY(MirrorVertical)(lua_State* L) {
-  Graphic*restrict graphic = new Graphic(*lua_toobject(L, 1, Drawable));
-  Pixel*restrict* pt = graphic->rows, *restrict*pb = graphic->rows + graphic->height - 1, *sw;
-  int rem = graphic->height / 2;
-  UNROLL_MORE(rem,
-	      sw = *pt; *pt = *pb; *pb = sw;
-	      ++pt; --pb;);
-  graphic->Push(L);
+  Drawable*restrict old = lua_toobject(L, 1, Drawable);
+  Drawable*restrict graphic = GetDestination(L, 2, old, old->width, old->height, "MirrorVertical");
+  for(int y = 0; y < graphic->height; ++y)
+    memcpy(graphic->rows[y], old->rows[old->height - y - 1], graphic->width * sizeof(Pixel));
   return 1;
 }
 
 SUBCRITICAL_UTILITY(Flip)(lua_State* L) {
   Drawable*restrict old = lua_toobject(L, 1, Drawable);
-  Graphic*restrict graphic = new Graphic(old->width, old->height, old->layout);
-  graphic->has_alpha = old->has_alpha;
-  graphic->simple_alpha = old->simple_alpha;
+  Drawable*restrict graphic = GetDestination(L, 2, old, old->width, old->height, "Flip");
   for(int y = 0; y < graphic->height; ++y) {
-    Pixel*restrict pl = old->rows[y], *restrict pr = graphic->rows[y] + graphic->width - 1;
+    Pixel*restrict pl = old->rows[old->height - y - 1], *restrict pr = graphic->rows[y] + graphic->width - 1;
     int rem = graphic->width;
     UNROLL_MORE(rem,
 		*pr-- = *pl++;);
   }
-  {
-    Pixel*restrict* pt = graphic->rows, *restrict*pb = graphic->rows + graphic->height - 1, *sw;
-    int rem = graphic->height / 2;
-    UNROLL_MORE(rem,
-		sw = *pt; *pt = *pb; *pb = sw;
-		++pt; --pb;);
-  }
-  graphic->Push(L);
   return 1;
 }
 
 SUBCRITICAL_UTILITY(RotateRight)(lua_State* L) {
   Drawable*restrict old = lua_toobject(L, 1, Drawable);
-  Graphic*restrict graphic = new Graphic(old->height, old->width, old->layout);
-  graphic->has_alpha = old->has_alpha;
-  graphic->simple_alpha = old->simple_alpha;
+  Drawable*restrict graphic = GetDestination(L, 2, old, old->height, old->width, "RotateRight");
   for(int y = 0; y < old->height; ++y) {
     Pixel* src = old->rows[y];
     int rem = old->width;
@@ -83,15 +91,12 @@ SUBCRITICAL_UTILITY(RotateRight)(lua_State* L) {
     UNROLL(rem,
 	   graphic->rows[x++][old->height - y - 1] = *src++;);
   }
-  graphic->Push(L);
   return 1;
 }
 
 SUBCRITICAL_UTILITY(RotateLeft)(lua_State* L) {
   Drawable*restrict old = lua_toobject(L, 1, Drawable);
-  Graphic*restrict graphic = new Graphic(old->height, old->width, old->layout);
-  graphic->has_alpha = old->has_alpha;
-  graphic->simple_alpha = old->simple_alpha;
+  Drawable*restrict graphic = GetDestination(L, 2, old, old->height, old->width, "RotateLeft");
   for(int y = 0; y < old->height; ++y) {
     Pixel*restrict src = old->rows[y];
     int rem = old->width;
@@ -99,6 +104,5 @@ SUBCRITICAL_UTILITY(RotateLeft)(lua_State* L) {
     UNROLL(rem,
 	   graphic->rows[x--][y] = *src++;);
   }
-  graphic->Push(L);
   return 1;
 }
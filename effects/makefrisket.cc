@@ -19,243 +19,191 @@
   Please see doc/license.html for clarifications.
  */
 
-#include "subcritical/graphics.h"
+#include "effects.h"
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace SubCritical;
 
-SUBCRITICAL_UTILITY(MakeFrisketFromAlpha)(lua_State* L) throw() {
-  Drawable* graphic = lua_toobject(L, 1, Drawable);
-  if(!graphic->has_alpha) return luaL_error(L, "MakeFrisketFromAlpha called on graphic with no alpha channel!");
-  Frisket* ret = new Frisket(graphic->width, graphic->height);
-  int ash;
-  switch(graphic->layout) {
-  default:
-    fprintf(stderr, "WARNING: Making frisket from unknown format %i!\n", graphic->layout);
-  case FB_xRGB:
-  case FB_xBGR:
-    ash = 24; break;
-  case FB_RGBx:
-  case FB_BGRx:
-    ash = 0; break;
-  }
-  Pixel*restrict* srcp;
-  Frixel*restrict* dstp;
-  for(srcp = graphic->rows, dstp = ret->rows; srcp < graphic->rows + graphic->height; ++srcp, ++dstp) {
-    Pixel* src = *srcp;
-    Frixel* dst = *dstp;
-    size_t rem = graphic->width;
-    UNROLL(rem,
-	   *dst++ = *src++ >> ash);
+/* Any number of Friskets can be made from one Drawable in a single pass:
+   rows are split into bands on the worker pool, and each row is read once
+   and then scanned (from cache) for each channel wanted. */
+
+enum FrisketChannel {
+  FC_RED, FC_GREEN, FC_BLUE, FC_ALPHA, FC_GRAYSCALE, FC_GRAYSCALE_QUICKLY,
+  FC_DIRECT,
+};
+
+static const char* const channel_names[] = {
+  "red", "green", "blue", "alpha", "grayscale", "grayscale_quickly", "direct",
+  NULL
+};
+
+#define MAX_FRISKET_CHANNELS 16
+// fewer pixels than this per band aren't worth handing off
+#define FRISKET_BAND_AREA 16384
+
+struct LOCAL FrisketJob {
+  const Drawable* src;
+  int count;
+  FrisketChannel channels[MAX_FRISKET_CHANNELS];
+  Frisket* dests[MAX_FRISKET_CHANNELS];
+  int rsh, gsh, bsh, ash;
+};
+
+/* One byte of each pixel, as is. */
+static void ExtractRaw(Frixel*restrict dst, const Pixel*restrict src, int n, int sh) {
+  int x = 0;
+#ifdef __SSE2__
+  const __m128i mask = _mm_set1_epi32(255);
+  const __m128i shift = _mm_cvtsi32_si128(sh);
+  for(; x + 16 <= n; x += 16) {
+    __m128i a = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128((const __m128i*)(src + x)), shift), mask);
+    __m128i b = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128((const __m128i*)(src + x + 4)), shift), mask);
+    __m128i c = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128((const __m128i*)(src + x + 8)), shift), mask);
+    __m128i d = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128((const __m128i*)(src + x + 12)), shift), mask);
+    _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
   }
-  ret->Push(L);
-  return 1;
+#endif
+  size_t rem = n - x;
+  src += x;
+  dst += x;
+  if(rem) UNROLL(rem, *dst++ = *src++ >> sh);
 }
 
-SUBCRITICAL_UTILITY(MakeFrisketFromGrayscale)(lua_State* L) throw() {
-  Drawable* graphic = lua_toobject(L, 1, Drawable);
-  Frisket* ret = new Frisket(graphic->width, graphic->height);
-  int rsh, gsh, bsh;
-  switch(graphic->layout) {
-  default:
-    fprintf(stderr, "WARNING: Making frisket from unknown format %i!\n", graphic->layout);
-  case FB_xRGB:
-    rsh = 16;
-    gsh = 8;
-    bsh = 0;
-    break;
-  case FB_xBGR:
-    rsh = 0;
-    gsh = 8;
-    bsh = 16;
-    break;
-  case FB_RGBx:
-    rsh = 24;
-    gsh = 16;
-    bsh = 8;
-    break;
-  case FB_BGRx:
-    rsh = 8;
-    gsh = 16;
-    bsh = 24;
-    break;
+/* One sRGB channel of each pixel, made linear. */
+static void ExtractLinear(Frixel*restrict dst, const Pixel*restrict src, int n, int sh) {
+  size_t rem = n;
+  if(rem) UNROLL(rem, *dst++ = SrgbToLinear[(*src++ >> sh) & 255] >> 8);
+}
+
+static void ExtractGrayscale(Frixel*restrict dst, const Pixel*restrict src, int n, int rsh, int gsh, int bsh) {
+  size_t rem = n;
+  if(rem) UNROLL(rem,
+		 *dst++ = ((SrgbToLinear[(*src >> rsh) & 255] * 299 + SrgbToLinear[(*src >> gsh) & 255] * 587 + SrgbToLinear[(*src >> bsh) & 255] * 114) / 1000) >> 8;
+		 ++src);
+}
+
+static void ExtractGrayscaleQuickly(Frixel*restrict dst, const Pixel*restrict src, int n, int rsh, int gsh, int bsh) {
+  size_t rem = n;
+  if(rem) UNROLL(rem,
+		 *dst++ = ((SrgbToLinear[(*src >> rsh) & 255] + SrgbToLinear[(*src >> gsh) & 255] + SrgbToLinear[(*src >> bsh) & 255]) / 3) >> 8;
+		 ++src);
+}
+
+static void FrisketBand(void* _job, int first, int last) {
+  const FrisketJob* job = (const FrisketJob*)_job;
+  const int n = job->src->width;
+  for(int y = first; y < last; ++y) {
+    const Pixel* src = job->src->rows[y];
+    for(int c = 0; c < job->count; ++c) {
+      Frixel* dst = job->dests[c]->rows[y];
+      switch(job->channels[c]) {
+      case FC_RED: ExtractLinear(dst, src, n, job->rsh); break;
+      case FC_GREEN: ExtractLinear(dst, src, n, job->gsh); break;
+      case FC_BLUE: ExtractLinear(dst, src, n, job->bsh); break;
+      case FC_ALPHA: ExtractRaw(dst, src, n, job->ash); break;
+      case FC_GRAYSCALE: ExtractGrayscale(dst, src, n, job->rsh, job->gsh, job->bsh); break;
+      case FC_GRAYSCALE_QUICKLY: ExtractGrayscaleQuickly(dst, src, n, job->rsh, job->gsh, job->bsh); break;
+      case FC_DIRECT: ExtractRaw(dst, src, n, job->gsh); break;
+      }
+    }
   }
-  Pixel*restrict* srcp;
-  Frixel*restrict* dstp;
-  for(srcp = graphic->rows, dstp = ret->rows; srcp < graphic->rows + graphic->height; ++srcp, ++dstp) {
-    Pixel* src = *srcp;
-    Frixel* dst = *dstp;
-    size_t rem = graphic->width;
-    UNROLL(rem,
-	   *dst++ = ((SrgbToLinear[(*src >> rsh) & 255] * 299 + SrgbToLinear[(*src >> gsh) & 255] * 587 + SrgbToLinear[(*src >> bsh) & 255] * 114) / 1000) >> 8;
-	   ++src);
+}
+
+static void SetupJob(FrisketJob& job, const Drawable* src) {
+  job.src = src;
+  job.count = 0;
+  switch(src->layout) {
+  case FB_RGBx: job.rsh = 24; job.gsh = 16; job.bsh = 8; job.ash = 0; break;
+  case FB_BGRx: job.rsh = 8; job.gsh = 16; job.bsh = 24; job.ash = 0; break;
+  case FB_xBGR: job.rsh = 0; job.gsh = 8; job.bsh = 16; job.ash = 24; break;
+  default: job.rsh = 16; job.gsh = 8; job.bsh = 0; job.ash = 24; break;
   }
-  ret->Push(L);
-  return 1;
 }
 
-SUBCRITICAL_UTILITY(MakeFrisketFromGrayscaleQuickly)(lua_State* L) throw() {
+static void RunJob(FrisketJob& job) {
+  int grain = FRISKET_BAND_AREA / (job.src->width > 0 ? job.src->width : 1) + 1;
+  ParallelBands(FrisketBand, &job, 0, job.src->height, grain);
+}
+
+/* The old single-channel utilities. */
+static int MakeOne(lua_State* L, FrisketChannel channel) {
   Drawable* graphic = lua_toobject(L, 1, Drawable);
-  Frisket* ret = new Frisket(graphic->width, graphic->height);
-  int rsh, gsh, bsh;
-  switch(graphic->layout) {
-  default:
-    fprintf(stderr, "WARNING: Making frisket from unknown format %i!\n", graphic->layout);
-  case FB_xRGB:
-    rsh = 16;
-    gsh = 8;
-    bsh = 0;
-    break;
-  case FB_xBGR:
-    rsh = 0;
-    gsh = 8;
-    bsh = 16;
-    break;
-  case FB_RGBx:
-    rsh = 24;
-    gsh = 16;
-    bsh = 8;
-    break;
-  case FB_BGRx:
-    rsh = 8;
-    gsh = 16;
-    bsh = 24;
-    break;
-  }
-  Pixel*restrict* srcp;
-  Frixel*restrict* dstp;
-  for(srcp = graphic->rows, dstp = ret->rows; srcp < graphic->rows + graphic->height; ++srcp, ++dstp) {
-    Pixel* src = *srcp;
-    Frixel* dst = *dstp;
-    size_t rem = graphic->width;
-    UNROLL(rem,
-	   *dst++ = ((SrgbToLinear[(*src >> rsh) & 255] + SrgbToLinear[(*src >> gsh) & 255] + SrgbToLinear[(*src >> bsh) & 255]) / 3) >> 8;
-	   ++src);
-  }
-  ret->Push(L);
+  if(channel == FC_ALPHA && !graphic->has_alpha) return luaL_error(L, "MakeFrisketFromAlpha called on graphic with no alpha channel!");
+  FrisketJob job;
+  SetupJob(job, graphic);
+  job.channels[0] = channel;
+  job.dests[0] = new Frisket(graphic->width, graphic->height);
+  job.count = 1;
+  job.dests[0]->Push(L);
+  RunJob(job);
   return 1;
 }
 
+SUBCRITICAL_UTILITY(MakeFrisketFromAlpha)(lua_State* L) throw() {
+  return MakeOne(L, FC_ALPHA);
+}
+
+SUBCRITICAL_UTILITY(MakeFrisketFromGrayscale)(lua_State* L) throw() {
+  return MakeOne(L, FC_GRAYSCALE);
+}
+
+SUBCRITICAL_UTILITY(MakeFrisketFromGrayscaleQuickly)(lua_State* L) throw() {
+  return MakeOne(L, FC_GRAYSCALE_QUICKLY);
+}
+
 SUBCRITICAL_UTILITY(MakeFrisketFromRed)(lua_State* L) throw() {
-  Drawable* graphic = lua_toobject(L, 1, Drawable);
-  Frisket* ret = new Frisket(graphic->width, graphic->height);
-  int rsh;
-  switch(graphic->layout) {
-  default:
-    fprintf(stderr, "WARNING: Making frisket from unknown format %i!\n", graphic->layout);
-  case FB_xRGB:
-    rsh = 16;
-    break;
-  case FB_xBGR:
-    rsh = 0;
-    break;
-  case FB_RGBx:
-    rsh = 24;
-    break;
-  case FB_BGRx:
-    rsh = 8;
-    break;
-  }
-  Pixel*restrict* srcp;
-  Frixel*restrict* dstp;
-  for(srcp = graphic->rows, dstp = ret->rows; srcp < graphic->rows + graphic->height; ++srcp, ++dstp) {
-    Pixel* src = *srcp;
-    Frixel* dst = *dstp;
-    size_t rem = graphic->width;
-    UNROLL(rem,
-	   *dst++ = SrgbToLinear[(*src++ >> rsh) & 255] >> 8);
-  }
-  ret->Push(L);
-  return 1;
+  return MakeOne(L, FC_RED);
 }
 
 SUBCRITICAL_UTILITY(MakeFrisketFromGreen)(lua_State* L) throw() {
-  Drawable* graphic = lua_toobject(L, 1, Drawable);
-  Frisket* ret = new Frisket(graphic->width, graphic->height);
-  int gsh;
-  switch(graphic->layout) {
-  default:
-    fprintf(stderr, "WARNING: Making frisket from unknown format %i!\n", graphic->layout);
-  case FB_xRGB:
-  case FB_xBGR:
-    gsh = 8;
-    break;
-  case FB_BGRx:
-  case FB_RGBx:
-    gsh = 16;
-    break;
-  }
-  Pixel*restrict* srcp;
-  Frixel*restrict* dstp;
-  for(srcp = graphic->rows, dstp = ret->rows; srcp < graphic->rows + graphic->height; ++srcp, ++dstp) {
-    Pixel* src = *srcp;
-    Frixel* dst = *dstp;
-    size_t rem = graphic->width;
-    UNROLL(rem,
-	   *dst++ = SrgbToLinear[(*src++ >> gsh) & 255] >> 8);
-  }
-  ret->Push(L);
-  return 1;
+  return MakeOne(L, FC_GREEN);
 }
 
 SUBCRITICAL_UTILITY(MakeFrisketFromBlue)(lua_State* L) throw() {
-  Drawable* graphic = lua_toobject(L, 1, Drawable);
-  Frisket* ret = new Frisket(graphic->width, graphic->height);
-  int bsh;
-  switch(graphic->layout) {
-  default:
-    fprintf(stderr, "WARNING: Making frisket from unknown format %i!\n", graphic->layout);
-  case FB_xRGB:
-    bsh = 0;
-    break;
-  case FB_xBGR:
-    bsh = 16;
-    break;
-  case FB_RGBx:
-    bsh = 8;
-    break;
-  case FB_BGRx:
-    bsh = 24;
-    break;
-  }
-  Pixel*restrict* srcp;
-  Frixel*restrict* dstp;
-  for(srcp = graphic->rows, dstp = ret->rows; srcp < graphic->rows + graphic->height; ++srcp, ++dstp) {
-    Pixel* src = *srcp;
-    Frixel* dst = *dstp;
-    size_t rem = graphic->width;
-    UNROLL(rem,
-	   *dst++ = SrgbToLinear[(*src++ >> bsh) & 255] >> 8);
-  }
-  ret->Push(L);
-  return 1;
+  return MakeOne(L, FC_BLUE);
 }
 
 SUBCRITICAL_UTILITY(MakeFrisketDirectly)(lua_State* L) throw() {
+  return MakeOne(L, FC_DIRECT);
+}
+
+/* SCUtil.MakeFriskets(graphic, channel[, frisket], channel[, frisket], ...) */
+SUBCRITICAL_UTILITY(MakeFriskets)(lua_State* L) throw() {
   Drawable* graphic = lua_toobject(L, 1, Drawable);
-  Frisket* ret = new Frisket(graphic->width, graphic->height);
-  int gsh;
-  switch(graphic->layout) {
-  default:
-    fprintf(stderr, "WARNING: Making frisket from unknown format %i!\n", graphic->layout);
-  case FB_xRGB:
-  case FB_xBGR:
-    gsh = 8;
-    break;
-  case FB_RGBx:
-  case FB_BGRx:
-    gsh = 16;
-    break;
-  }
-  Pixel*restrict* srcp;
-  Frixel*restrict* dstp;
-  for(srcp = graphic->rows, dstp = ret->rows; srcp < graphic->rows + graphic->height; ++srcp, ++dstp) {
-    Pixel* src = *srcp;
-    Frixel* dst = *dstp;
-    size_t rem = graphic->width;
-    UNROLL(rem,
-	   *dst++ = *src >> gsh;
-	   ++src);
+  FrisketJob job;
+  SetupJob(job, graphic);
+  int top = lua_gettop(L);
+  if(top < 2) return luaL_error(L, "MakeFriskets needs at least one channel");
+  for(int n = 2; n <= top; ++n) {
+    if(job.count == MAX_FRISKET_CHANNELS)
+      return luaL_error(L, "MakeFriskets can make at most %d Friskets at once", MAX_FRISKET_CHANNELS);
+    const char* name = luaL_checkstring(L, n);
+    int channel;
+    for(channel = 0; channel_names[channel]; ++channel)
+      if(!strcmp(channel_names[channel], name)) break;
+    if(!channel_names[channel]) return luaL_error(L, "unknown Frisket channel: %s", name);
+    if(channel == FC_ALPHA && !graphic->has_alpha)
+      return luaL_error(L, "MakeFriskets asked for alpha from a graphic with no alpha channel");
+    Frisket* dest;
+    if(n < top && lua_type(L, n + 1) == LUA_TUSERDATA) {
+      dest = lua_toobject(L, ++n, Frisket);
+      if(dest->width != graphic->width || dest->height != graphic->height)
+	return luaL_error(L, "MakeFriskets needs %dx%d Friskets", graphic->width, graphic->height);
+      lua_pushvalue(L, n);
+    }
+    else {
+      dest = new Frisket(graphic->width, graphic->height);
+      dest->Push(L);
+    }
+    job.channels[job.count] = (FrisketChannel)channel;
+    job.dests[job.count] = dest;
+    ++job.count;
   }
-  ret->Push(L);
-  return 1;
+  RunJob(job);
+  return job.count;
 }
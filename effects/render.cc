@@ -20,8 +20,13 @@
  */
 
 #include "subcritical/graphics.h"
+#include "subcritical/perlin.h"
 
+#include <ctype.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 using namespace SubCritical;
 
@@ -39,94 +44,520 @@ static Pixel num2srgb(lua_Number n) {
   else return LinearToSrgb[lin];
 }
 
-SUBCRITICAL_UTILITY(Render)(lua_State* L) {
-  if(!lua_isfunction(L, 1)) return luaL_typerror(L, 1, "function");
-  Graphic* ret = new Graphic(luaL_checkinteger(L, 2), luaL_checkinteger(L, 3), FB_xRGB);
-  bool alpha = lua_toboolean(L, 4);
-  ret->Push(L); // we want it to be collected on error, this is the easiest way
+/* What the numbers a render function gives are made into. */
+enum RenderKind { RENDER_LINEAR, RENDER_SRGB, RENDER_FRISKET };
+
+/* Stores count pixels from numbers, r,g,b[,a] for each (or a, for a
+   Frisket). */
+static void StoreNumbers(RenderKind kind, bool alpha, void* dest, const lua_Number* c, int count) {
+  if(kind == RENDER_FRISKET) {
+    Frixel* d = (Frixel*)dest;
+    for(int x = 0; x < count; ++x) d[x] = num2lin(c[x]);
+    return;
+  }
+  Pixel* d = (Pixel*)dest;
+  Pixel (*conv)(lua_Number) = kind == RENDER_LINEAR ? num2srgb : num2lin;
   if(alpha) {
-    for(int y = 0; y < ret->height; ++y) {
-      Pixel* dest = ret->rows[y];
-      for(int x = 0; x < ret->width; ++x) {
-	lua_pushvalue(L, 1);
-	lua_pushnumber(L, x);
-	lua_pushnumber(L, y);
-	lua_call(L, 2, 4);
-	*dest++ = (num2lin(lua_tonumber(L,-1)) << 24) | (num2srgb(lua_tonumber(L,-4)) << 16) | (num2srgb(lua_tonumber(L,-3)) << 8) | num2srgb(lua_tonumber(L,-2));
-	lua_pop(L, 4);
-      }
-    }
-    ret->CheckAlpha();
+    for(int x = 0; x < count; ++x, c += 4)
+      d[x] = (num2lin(c[3]) << 24) | (conv(c[0]) << 16) | (conv(c[1]) << 8) | conv(c[2]);
   }
   else {
-    Pixel mask = 0xFF000000;
-    ret->has_alpha = false;
-    for(int y = 0; y < ret->height; ++y) {
-      Pixel* dest = ret->rows[y];
-      for(int x = 0; x < ret->width; ++x) {
-	lua_pushvalue(L, 1);
-	lua_pushnumber(L, x);
-	lua_pushnumber(L, y);
-	lua_call(L, 2, 3);
-	*dest++ = mask | (num2srgb(lua_tonumber(L,-3)) << 16) | (num2srgb(lua_tonumber(L,-2)) << 8) | num2srgb(lua_tonumber(L,-1));
-	lua_pop(L, 3);
-      }
-    }
+    for(int x = 0; x < count; ++x, c += 3)
+      d[x] = 0xFF000000 | (conv(c[0]) << 16) | (conv(c[1]) << 8) | conv(c[2]);
   }
-  return 1;
 }
 
-SUBCRITICAL_UTILITY(RenderPreCompressed)(lua_State* L) {
-  if(!lua_isfunction(L, 1)) return luaL_typerror(L, 1, "function");
-  Graphic* ret = new Graphic(luaL_checkinteger(L, 2), luaL_checkinteger(L, 3), FB_xRGB);
-  bool alpha = lua_toboolean(L, 4);
+/* Makes and pushes the result of any kind of Render. */
+static Object* NewRenderTarget(lua_State* L, RenderKind kind, bool alpha) {
+  Object* ret;
+  if(kind == RENDER_FRISKET)
+    ret = new Frisket(luaL_checkinteger(L, 2), luaL_checkinteger(L, 3));
+  else {
+    Graphic* graphic = new Graphic(luaL_checkinteger(L, 2), luaL_checkinteger(L, 3), FB_xRGB);
+    graphic->has_alpha = alpha;
+    ret = graphic;
+  }
   ret->Push(L); // we want it to be collected on error, this is the easiest way
-  if(alpha) {
-    for(int y = 0; y < ret->height; ++y) {
-      Pixel* dest = ret->rows[y];
-      for(int x = 0; x < ret->width; ++x) {
-	lua_pushvalue(L, 1);
-	lua_pushnumber(L, x);
-	lua_pushnumber(L, y);
-	lua_call(L, 2, 4);
-	*dest++ = (num2lin(lua_tonumber(L,-1)) << 24) | (num2lin(lua_tonumber(L,-4)) << 16) | (num2lin(lua_tonumber(L,-3)) << 8) | num2lin(lua_tonumber(L,-2));
-	lua_pop(L, 4);
+  return ret;
+}
+
+static inline void* GetRenderRow(Object* target, RenderKind kind, int y) {
+  if(kind == RENDER_FRISKET) return ((Frisket*)target)->rows[y];
+  else return ((Graphic*)target)->rows[y];
+}
+
+/*** Expressions ***/
+
+/* An expression is compiled into a list of operations on registers, each of
+   which holds one number for each of a batch of pixels. Every operation has
+   its own destination register, and operations whose operands are all
+   constant are done while compiling instead. Rows are split into bands
+   that are rendered on the worker pool. */
+
+#define EXPR_BATCH 64
+#define MAX_EXPR_REGS 512
+#define MAX_EXPR_NAMES 64
+#define MAX_EXPR_NAME_LEN 32
+// how deeply parentheses and unary operators may nest, to spare the C stack
+#define MAX_EXPR_DEPTH 256
+// fewer pixels than this per band aren't worth handing off
+#define EXPR_BAND_AREA 4096
+
+enum ExprOp {
+  OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_POW, OP_NEG,
+  OP_ABS, OP_FLOOR, OP_CEIL, OP_FRACT, OP_SQRT, OP_EXP, OP_LOG,
+  OP_SIN, OP_COS, OP_TAN, OP_ASIN, OP_ACOS, OP_ATAN, OP_ATAN2,
+  OP_MIN, OP_MAX, OP_CLAMP, OP_MIX, OP_STEP, OP_SMOOTHSTEP, OP_NOISE,
+};
+
+static const struct { const char* name; int args; ExprOp op; } expr_functions[] = {
+  {"abs", 1, OP_ABS}, {"floor", 1, OP_FLOOR}, {"ceil", 1, OP_CEIL},
+  {"fract", 1, OP_FRACT}, {"sqrt", 1, OP_SQRT}, {"exp", 1, OP_EXP},
+  {"log", 1, OP_LOG}, {"sin", 1, OP_SIN}, {"cos", 1, OP_COS},
+  {"tan", 1, OP_TAN}, {"asin", 1, OP_ASIN}, {"acos", 1, OP_ACOS},
+  {"atan", 1, OP_ATAN}, {"atan", 2, OP_ATAN2}, {"pow", 2, OP_POW},
+  {"min", 2, OP_MIN}, {"max", 2, OP_MAX}, {"clamp", 3, OP_CLAMP},
+  {"mix", 3, OP_MIX}, {"step", 2, OP_STEP}, {"smoothstep", 3, OP_SMOOTHSTEP},
+  {"noise", 2, OP_NOISE}, {"noise", 3, OP_NOISE}, {NULL, 0, OP_ADD}
+};
+
+static inline double Apply(ExprOp op, double a, double b, double c) {
+  switch(op) {
+  case OP_ADD: return a + b;
+  case OP_SUB: return a - b;
+  case OP_MUL: return a * b;
+  case OP_DIV: return a / b;
+  case OP_MOD: return a - floor(a / b) * b; // as Lua does it
+  case OP_POW: return pow(a, b);
+  case OP_NEG: return -a;
+  case OP_ABS: return fabs(a);
+  case OP_FLOOR: return floor(a);
+  case OP_CEIL: return ceil(a);
+  case OP_FRACT: return a - floor(a);
+  case OP_SQRT: return sqrt(a);
+  case OP_EXP: return exp(a);
+  case OP_LOG: return log(a);
+  case OP_SIN: return sin(a);
+  case OP_COS: return cos(a);
+  case OP_TAN: return tan(a);
+  case OP_ASIN: return asin(a);
+  case OP_ACOS: return acos(a);
+  case OP_ATAN: return atan(a);
+  case OP_ATAN2: return atan2(a, b);
+  case OP_MIN: return a < b ? a : b;
+  case OP_MAX: return a > b ? a : b;
+  case OP_CLAMP: return a < b ? b : a > c ? c : a;
+  case OP_MIX: return a + (b - a) * c;
+  case OP_STEP: return b < a ? 0 : 1;
+  case OP_SMOOTHSTEP: {
+    double t = (c - a) / (b - a);
+    t = t < 0 ? 0 : t > 1 ? 1 : t;
+    return t * t * (3 - 2 * t);
+  }
+  case OP_NOISE: return PerlinNoise(a, b, c);
+  }
+  return 0;
+}
+
+struct LOCAL ExprInsn {
+  ExprOp op;
+  int dst, a, b, c;
+};
+
+/* The registers pixels are fed in through. */
+enum { REG_X, REG_Y, REG_U, REG_V, NUM_INPUT_REGS };
+
+struct LOCAL ExprProgram {
+  ExprInsn code[MAX_EXPR_REGS];
+  int code_len;
+  int num_regs;
+  bool is_constant[MAX_EXPR_REGS];
+  double constant[MAX_EXPR_REGS];
+  int outputs[4], num_outputs;
+};
+
+/* A recursive-descent compiler for a Lua-like syntax: zero or more
+   "name = expression;" assignments, then the comma-separated outputs. */
+struct LOCAL ExprCompiler {
+  lua_State* L;
+  const char* source, *p;
+  ExprProgram* prog;
+  char names[MAX_EXPR_NAMES][MAX_EXPR_NAME_LEN];
+  int name_regs[MAX_EXPR_NAMES], num_names;
+  int depth;
+  void Fail(const char* what) {
+    luaL_error(L, "render expression, character %d: %s", (int)(p - source) + 1, what);
+  }
+  void Skip() {
+    while(true) {
+      while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') ++p;
+      if(p[0] == '-' && p[1] == '-') {
+	while(*p && *p != '\n') ++p;
       }
+      else break;
     }
-    ret->CheckAlpha();
   }
-  else {
-    Pixel mask = 0xFF000000;
-    ret->has_alpha = false;
-    for(int y = 0; y < ret->height; ++y) {
-      Pixel* dest = ret->rows[y];
-      for(int x = 0; x < ret->width; ++x) {
-	lua_pushvalue(L, 1);
-	lua_pushnumber(L, x);
-	lua_pushnumber(L, y);
-	lua_call(L, 2, 3);
-	*dest++ = mask | (num2lin(lua_tonumber(L,-3)) << 16) | (num2lin(lua_tonumber(L,-2)) << 8) | num2lin(lua_tonumber(L,-1));
-	lua_pop(L, 3);
+  bool Accept(char c) {
+    Skip();
+    if(*p != c) return false;
+    ++p;
+    return true;
+  }
+  void Expect(char c) {
+    if(!Accept(c)) {
+      char what[32];
+      sprintf(what, "'%c' expected", c);
+      Fail(what);
+    }
+  }
+  // copies an identifier into name and returns true, if there is one
+  bool Identifier(char* name) {
+    Skip();
+    if(!(isalpha((unsigned char)*p) || *p == '_')) return false;
+    size_t len = 0;
+    while(isalnum((unsigned char)p[len]) || p[len] == '_') ++len;
+    if(len >= MAX_EXPR_NAME_LEN) Fail("name too long");
+    memcpy(name, p, len);
+    name[len] = 0;
+    p += len;
+    return true;
+  }
+  void Enter() {
+    if(++depth > MAX_EXPR_DEPTH) Fail("expression nested too deeply");
+  }
+  int NewRegister() {
+    if(prog->num_regs >= MAX_EXPR_REGS) Fail("expression too complex");
+    prog->is_constant[prog->num_regs] = false;
+    return prog->num_regs++;
+  }
+  int Constant(double value) {
+    int reg = NewRegister();
+    prog->is_constant[reg] = true;
+    prog->constant[reg] = value;
+    return reg;
+  }
+  int Emit(ExprOp op, int a, int b = -1, int c = -1) {
+    if(prog->is_constant[a] && (b < 0 || prog->is_constant[b]) && (c < 0 || prog->is_constant[c]))
+      return Constant(Apply(op, prog->constant[a], b < 0 ? 0 : prog->constant[b], c < 0 ? 0 : prog->constant[c]));
+    int reg = NewRegister();
+    ExprInsn& insn = prog->code[prog->code_len++];
+    insn.op = op;
+    insn.dst = reg;
+    // unused operands read a harmless register
+    insn.a = a;
+    insn.b = b < 0 ? a : b;
+    insn.c = c < 0 ? a : c;
+    return reg;
+  }
+  int Variable(const char* name) {
+    for(int n = num_names - 1; n >= 0; --n)
+      if(!strcmp(names[n], name)) return name_regs[n];
+    if(!strcmp(name, "x")) return REG_X;
+    if(!strcmp(name, "y")) return REG_Y;
+    if(!strcmp(name, "u")) return REG_U;
+    if(!strcmp(name, "v")) return REG_V;
+    if(!strcmp(name, "width")) return Constant(width);
+    if(!strcmp(name, "height")) return Constant(height);
+    if(!strcmp(name, "pi")) return Constant(M_PI);
+    char what[MAX_EXPR_NAME_LEN + 32];
+    sprintf(what, "unknown variable '%s'", name);
+    Fail(what);
+    return -1;
+  }
+  int Call(const char* name) {
+    int args[3], count = 0;
+    if(!Accept(')')) {
+      do {
+	if(count == 3) Fail("too many arguments");
+	args[count++] = Expression();
+      } while(Accept(','));
+      Expect(')');
+    }
+    bool known = false;
+    for(int n = 0; expr_functions[n].name; ++n) {
+      if(strcmp(expr_functions[n].name, name)) continue;
+      known = true;
+      if(expr_functions[n].args != count) continue;
+      ExprOp op = expr_functions[n].op;
+      // noise(x, y) is noise(x, y, 0.5), as with PerlinNoise
+      if(op == OP_NOISE && count == 2) args[count++] = Constant(0.5);
+      return Emit(op, args[0], count > 1 ? args[1] : -1, count > 2 ? args[2] : -1);
+    }
+    char what[MAX_EXPR_NAME_LEN + 48];
+    if(known) sprintf(what, "wrong number of arguments to %s", name);
+    else sprintf(what, "unknown function '%s'", name);
+    Fail(what);
+    return -1;
+  }
+  int Primary() {
+    char name[MAX_EXPR_NAME_LEN];
+    Skip();
+    if(isdigit((unsigned char)*p) || (*p == '.' && isdigit((unsigned char)p[1]))) {
+      char* end;
+      double value = strtod(p, &end);
+      p = end;
+      return Constant(value);
+    }
+    if(Identifier(name)) {
+      if(Accept('(')) return Call(name);
+      return Variable(name);
+    }
+    if(Accept('(')) {
+      Enter();
+      int ret = Expression();
+      Expect(')');
+      --depth;
+      return ret;
+    }
+    Fail(*p ? "unexpected character" : "unexpected end of expression");
+    return -1;
+  }
+  // ^ binds tighter than unary minus on its left, but not on its right
+  int Power() {
+    int a = Primary();
+    if(Accept('^')) return Emit(OP_POW, a, Unary());
+    return a;
+  }
+  int Unary() {
+    Enter();
+    int ret;
+    if(Accept('-')) ret = Emit(OP_NEG, Unary());
+    else {
+      Accept('+');
+      ret = Power();
+    }
+    --depth;
+    return ret;
+  }
+  int Term() {
+    int a = Unary();
+    while(true) {
+      if(Accept('*')) a = Emit(OP_MUL, a, Unary());
+      else if(Accept('/')) a = Emit(OP_DIV, a, Unary());
+      else if(Accept('%')) a = Emit(OP_MOD, a, Unary());
+      else return a;
+    }
+  }
+  int Expression() {
+    int a = Term();
+    while(true) {
+      if(Accept('+')) a = Emit(OP_ADD, a, Term());
+      else if(Accept('-')) a = Emit(OP_SUB, a, Term());
+      else return a;
+    }
+  }
+  void Program() {
+    prog->code_len = 0;
+    prog->num_regs = NUM_INPUT_REGS;
+    for(int n = 0; n < NUM_INPUT_REGS; ++n) prog->is_constant[n] = false;
+    num_names = 0;
+    depth = 0;
+    while(true) {
+      // an assignment is a name followed by =
+      const char* start = p;
+      char name[MAX_EXPR_NAME_LEN];
+      if(!Identifier(name) || !Accept('=')) {
+	p = start;
+	break;
+      }
+      if(num_names == MAX_EXPR_NAMES) Fail("too many names");
+      strcpy(names[num_names], name);
+      // the name isn't visible until after its own expression
+      name_regs[num_names] = Expression();
+      ++num_names;
+      Expect(';');
+    }
+    prog->num_outputs = 0;
+    do {
+      if(prog->num_outputs == 4) Fail("too many results");
+      prog->outputs[prog->num_outputs++] = Expression();
+    } while(Accept(','));
+    Accept(';');
+    Skip();
+    if(*p) Fail("unexpected character");
+  }
+  int width, height;
+};
+
+struct LOCAL ExprJob {
+  const ExprProgram* prog;
+  Object* target;
+  RenderKind kind;
+  bool alpha;
+  int width, height;
+  int band_rows;
+  // one set of registers per band
+  double* regs;
+};
+
+static void Run(const ExprProgram* prog, double* regs, int n) {
+  for(int i = 0; i < prog->code_len; ++i) {
+    const ExprInsn& insn = prog->code[i];
+    double*restrict d = regs + insn.dst * EXPR_BATCH;
+    const double* a = regs + insn.a * EXPR_BATCH;
+    const double* b = regs + insn.b * EXPR_BATCH;
+    const double* c = regs + insn.c * EXPR_BATCH;
+    // the usual suspects get loops of their own
+    switch(insn.op) {
+    case OP_ADD: for(int x = 0; x < n; ++x) d[x] = a[x] + b[x]; break;
+    case OP_SUB: for(int x = 0; x < n; ++x) d[x] = a[x] - b[x]; break;
+    case OP_MUL: for(int x = 0; x < n; ++x) d[x] = a[x] * b[x]; break;
+    case OP_DIV: for(int x = 0; x < n; ++x) d[x] = a[x] / b[x]; break;
+    case OP_NEG: for(int x = 0; x < n; ++x) d[x] = -a[x]; break;
+    case OP_MIX: for(int x = 0; x < n; ++x) d[x] = a[x] + (b[x] - a[x]) * c[x]; break;
+    default: for(int x = 0; x < n; ++x) d[x] = Apply(insn.op, a[x], b[x], c[x]); break;
+    }
+  }
+}
+
+static void ExprBand(void* _job, int first, int last) {
+  const ExprJob* job = (const ExprJob*)_job;
+  const ExprProgram* prog = job->prog;
+  // bands are disjoint, so the registers for the first one are ours alone
+  double* regs = job->regs + (size_t)first * prog->num_regs * EXPR_BATCH;
+  for(int r = 0; r < prog->num_regs; ++r) {
+    if(!prog->is_constant[r]) continue;
+    for(int x = 0; x < EXPR_BATCH; ++x) regs[r * EXPR_BATCH + x] = prog->constant[r];
+  }
+  const int channels = prog->num_outputs;
+  const size_t pixel_size = job->kind == RENDER_FRISKET ? sizeof(Frixel) : sizeof(Pixel);
+  lua_Number numbers[EXPR_BATCH * 4];
+  int last_row = last * job->band_rows;
+  if(last_row > job->height) last_row = job->height;
+  for(int y = first * job->band_rows; y < last_row; ++y) {
+    for(int x = 0; x < EXPR_BATCH; ++x) {
+      regs[REG_Y * EXPR_BATCH + x] = y;
+      regs[REG_V * EXPR_BATCH + x] = (double)y / job->height;
+    }
+    uint8_t* dest = (uint8_t*)GetRenderRow(job->target, job->kind, y);
+    for(int x0 = 0; x0 < job->width; x0 += EXPR_BATCH) {
+      int n = job->width - x0;
+      if(n > EXPR_BATCH) n = EXPR_BATCH;
+      for(int x = 0; x < n; ++x) {
+	regs[REG_X * EXPR_BATCH + x] = x0 + x;
+	regs[REG_U * EXPR_BATCH + x] = (double)(x0 + x) / job->width;
       }
+      Run(prog, regs, n);
+      for(int c = 0; c < channels; ++c) {
+	const double* out = regs + prog->outputs[c] * EXPR_BATCH;
+	for(int x = 0; x < n; ++x) numbers[x * channels + c] = out[x];
+      }
+      StoreNumbers(job->kind, job->alpha, dest + x0 * pixel_size, numbers, n);
     }
   }
+}
+
+static int RenderExpression(lua_State* L, RenderKind kind, bool alpha) {
+  // a userdata, so that it gets collected if compiling fails
+  ExprProgram* prog = (ExprProgram*)lua_newuserdata(L, sizeof(ExprProgram));
+  ExprCompiler compiler;
+  compiler.L = L;
+  compiler.source = compiler.p = lua_tostring(L, 1);
+  compiler.prog = prog;
+  compiler.width = luaL_checkinteger(L, 2);
+  compiler.height = luaL_checkinteger(L, 3);
+  compiler.Program();
+  int wanted = kind == RENDER_FRISKET ? 1 : alpha ? 4 : 3;
+  if(prog->num_outputs != wanted)
+    return luaL_error(L, "render expression gives %d results, but %d are needed", prog->num_outputs, wanted);
+  ExprJob job;
+  job.prog = prog;
+  job.kind = kind;
+  job.alpha = alpha;
+  job.target = NewRenderTarget(L, kind, alpha);
+  job.width = compiler.width;
+  job.height = compiler.height;
+  int bands = GetWorkerCount() * 4;
+  int min_rows = EXPR_BAND_AREA / (job.width > 0 ? job.width : 1) + 1;
+  if(bands > (job.height + min_rows - 1) / min_rows) bands = (job.height + min_rows - 1) / min_rows;
+  if(bands < 1) return 1;
+  job.band_rows = (job.height + bands - 1) / bands;
+  bands = (job.height + job.band_rows - 1) / job.band_rows;
+  job.regs = (double*)malloc((size_t)bands * prog->num_regs * EXPR_BATCH * sizeof(double));
+  if(!job.regs) return luaL_error(L, "Out of memory");
+  ParallelBands(ExprBand, &job, 0, bands);
+  free(job.regs);
+  if(kind != RENDER_FRISKET && alpha) ((Graphic*)job.target)->CheckAlpha();
   return 1;
 }
 
-SUBCRITICAL_UTILITY(RenderFrisket)(lua_State* L) {
-  if(!lua_isfunction(L, 1)) return luaL_typerror(L, 1, "function");
-  Frisket* ret = new Frisket(luaL_checkinteger(L, 2), luaL_checkinteger(L, 3));
-  ret->Push(L); // we want it to be collected on error, this is the easiest way
-  for(int y = 0; y < ret->height; ++y) {
-    Frixel* dest = ret->rows[y];
-    for(int x = 0; x < ret->width; ++x) {
+/*** Lua functions ***/
+
+static int RenderPixels(lua_State* L, RenderKind kind, bool alpha) {
+  Object* target = NewRenderTarget(L, kind, alpha);
+  int width = luaL_checkinteger(L, 2), height = luaL_checkinteger(L, 3);
+  int channels = kind == RENDER_FRISKET ? 1 : alpha ? 4 : 3;
+  lua_Number numbers[4];
+  for(int y = 0; y < height; ++y) {
+    uint8_t* dest = (uint8_t*)GetRenderRow(target, kind, y);
+    size_t pixel_size = kind == RENDER_FRISKET ? sizeof(Frixel) : sizeof(Pixel);
+    for(int x = 0; x < width; ++x) {
       lua_pushvalue(L, 1);
       lua_pushnumber(L, x);
       lua_pushnumber(L, y);
-      lua_call(L, 2, 1);
-      *dest++ = num2lin(lua_tonumber(L,-1));
-      lua_pop(L, 1);
+      lua_call(L, 2, channels);
+      for(int c = 0; c < channels; ++c) numbers[c] = lua_tonumber(L, c - channels);
+      StoreNumbers(kind, alpha, dest + x * pixel_size, numbers, 1);
+      lua_pop(L, channels);
     }
   }
+  if(kind != RENDER_FRISKET && alpha) ((Graphic*)target)->CheckAlpha();
+  return 1;
+}
+
+static int Render(lua_State* L, RenderKind kind, bool alpha) {
+  if(lua_type(L, 1) == LUA_TSTRING) return RenderExpression(L, kind, alpha);
+  if(!lua_isfunction(L, 1)) return luaL_typerror(L, 1, "function or string");
+  return RenderPixels(L, kind, alpha);
+}
+
+/* The function is called once per row, and returns the whole row as packed
+   data. */
+static int RenderRows(lua_State* L, RenderKind kind, bool alpha, int format_index) {
+  if(!lua_isfunction(L, 1)) return luaL_typerror(L, 1, "function");
+  if(lua_isnoneornil(L, format_index)) {
+    lua_settop(L, format_index - 1);
+    lua_pushstring(L, "f32");
+  }
+  lua_settop(L, format_index);
+  Object* target = NewRenderTarget(L, kind, alpha);
+  int width = luaL_checkinteger(L, 2), height = luaL_checkinteger(L, 3);
+  size_t count = (size_t)width * (kind == RENDER_FRISKET ? 1 : alpha ? 4 : 3);
+  // a userdata, so that it gets collected if the function fails
+  lua_Number* numbers = (lua_Number*)lua_newuserdata(L, count * sizeof(lua_Number));
+  for(int y = 0; y < height; ++y) {
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, y);
+    lua_call(L, 1, 1);
+    ReadPackedNumbers(L, -1, format_index, numbers, count);
+    StoreNumbers(kind, alpha, GetRenderRow(target, kind, y), numbers, width);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  if(kind != RENDER_FRISKET && alpha) ((Graphic*)target)->CheckAlpha();
   return 1;
 }
+
+SUBCRITICAL_UTILITY(Render)(lua_State* L) {
+  return Render(L, RENDER_LINEAR, lua_toboolean(L, 4));
+}
+
+SUBCRITICAL_UTILITY(RenderPreCompressed)(lua_State* L) {
+  return Render(L, RENDER_SRGB, lua_toboolean(L, 4));
+}
+
+SUBCRITICAL_UTILITY(RenderFrisket)(lua_State* L) {
+  return Render(L, RENDER_FRISKET, false);
+}
+
+SUBCRITICAL_UTILITY(RenderRows)(lua_State* L) {
+  return RenderRows(L, RENDER_LINEAR, lua_toboolean(L, 4), 5);
+}
+
+SUBCRITICAL_UTILITY(RenderPreCompressedRows)(lua_State* L) {
+  return RenderRows(L, RENDER_SRGB, lua_toboolean(L, 4), 5);
+}
+
+SUBCRITICAL_UTILITY(RenderFrisketRows)(lua_State* L) {
+  return RenderRows(L, RENDER_FRISKET, false, 4);
+}
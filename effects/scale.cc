@@ -19,47 +19,289 @@
   Please see doc/license.html for clarifications.
  */
 
-#include "subcritical/graphics.h"
+#include "effects.h"
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace SubCritical;
 
-SUBCRITICAL_UTILITY(ScaleFast)(lua_State* L) {
-  Drawable*restrict source = lua_toobject(L, 1, Drawable);
-  Graphic*restrict dest = new Graphic(luaL_checkinteger(L, 2), luaL_checkinteger(L, 3), source->layout);
-  if(source == dest) return luaL_error(L, "source and destination must differ");
-  dest->has_alpha = source->has_alpha;
-  dest->simple_alpha = source->simple_alpha;
-  Pixel*restrict*restrict srows = source->rows;
-  int syn = source->height, syd = dest->height, sye = 0, sys;
-  int sxn = source->width, sxd = dest->width, sxs;
-  sys = syn / syd;
-  syn = syn % syd;
-  sxs = sxn / sxd;
-  sxn = sxn % sxd;
+// SrgbToLinear, already converted to float (filled in by Init_effects)
+static float srgb_to_linear_f[256];
+
+/* The filters work on one pixel at a time as a vector of four floats: linear
+   red, green, and blue (premultiplied, if there's alpha) and alpha. */
+#ifdef __SSE2__
+typedef __m128 Vec4;
+static inline Vec4 V4Zero() { return _mm_setzero_ps(); }
+static inline Vec4 V4Set(float r, float g, float b, float a) { return _mm_setr_ps(r, g, b, a); }
+static inline Vec4 V4Load(const float* p) { return _mm_loadu_ps(p); }
+static inline void V4Store(float* p, Vec4 v) { _mm_storeu_ps(p, v); }
+static inline Vec4 V4MulAdd(Vec4 acc, Vec4 v, float w) { return _mm_add_ps(acc, _mm_mul_ps(v, _mm_set1_ps(w))); }
+#else
+struct Vec4 { float r, g, b, a; };
+static inline Vec4 V4Set(float r, float g, float b, float a) { Vec4 v = {r, g, b, a}; return v; }
+static inline Vec4 V4Zero() { return V4Set(0.f, 0.f, 0.f, 0.f); }
+static inline Vec4 V4Load(const float* p) { return V4Set(p[0], p[1], p[2], p[3]); }
+static inline void V4Store(float* p, Vec4 v) { p[0] = v.r; p[1] = v.g; p[2] = v.b; p[3] = v.a; }
+static inline Vec4 V4MulAdd(Vec4 acc, Vec4 v, float w) {
+  return V4Set(acc.r + v.r * w, acc.g + v.g * w, acc.b + v.b * w, acc.a + v.a * w);
+}
+#endif
+
+template<bool ALPHA> static inline Vec4 LoadLinear(Pixel p, int rsh, int gsh, int bsh, int ash) {
+  float r = srgb_to_linear_f[(p >> rsh) & 255];
+  float g = srgb_to_linear_f[(p >> gsh) & 255];
+  float b = srgb_to_linear_f[(p >> bsh) & 255];
+  if(!ALPHA) return V4Set(r, g, b, 0.f);
+  float a = (float)((p >> ash) & 255);
+  return V4Set(r * a, g * a, b * a, a);
+}
+
+static inline int32_t Clamp(int32_t i, int32_t max) {
+  return i < 0 ? 0 : i > max ? max : i;
+}
+
+static void GetShifts(FBLayout layout, int& rsh, int& gsh, int& bsh, int& ash) {
+  switch(layout) {
+#define DO_FBLAYOUT(layout, _rsh, _gsh, _bsh, _ash)			\
+    case layout: rsh = _rsh; gsh = _gsh; bsh = _bsh; ash = _ash; break
+    DO_FBLAYOUT(FB_RGBx, 24, 16, 8, 0);
+    DO_FBLAYOUT(FB_xRGB, 16, 8, 0, 24);
+    DO_FBLAYOUT(FB_BGRx, 8, 16, 24, 0);
+  default:
+    DO_FBLAYOUT(FB_xBGR, 0, 8, 16, 24);
+#undef DO_FBLAYOUT
+  }
+}
+
+/* Nearest neighbour: source column (or row) n/d of the way along for each
+   destination one, stepped the same way the old per-pixel loop did. */
+static void NearestMap(int* map, int src_size, int dst_size) {
+  int step = src_size / dst_size, n = src_size % dst_size, e = 0, s = 0;
+  for(int d = 0; d < dst_size; ++d) {
+    map[d] = s;
+    s += step;
+    e += n;
+    if(e >= dst_size) {
+      e -= dst_size;
+      ++s;
+    }
+  }
+}
+
+/* Exact enlargements write each source pixel factor times in a row. */
+static void ReplicateRow(Pixel*restrict d, const Pixel*restrict s, int count, int factor) {
+  int rem = count;
+  switch(factor) {
+  case 1:
+    memcpy(d, s, count * sizeof(Pixel));
+    break;
+  case 2:
+#ifdef __SSE2__
+    for(; rem >= 4; rem -= 4, s += 4, d += 8) {
+      __m128i v = _mm_loadu_si128((const __m128i*)s);
+      _mm_storeu_si128((__m128i*)d, _mm_unpacklo_epi32(v, v));
+      _mm_storeu_si128((__m128i*)(d + 4), _mm_unpackhi_epi32(v, v));
+    }
+#endif
+    UNROLL_MORE(rem, d[0] = d[1] = *s++; d += 2;);
+    break;
+  case 3:
+    UNROLL(rem, d[0] = d[1] = d[2] = *s++; d += 3;);
+    break;
+  default:
+    for(int n = 0; n < count; ++n) {
+      int k = factor;
+#ifdef __SSE2__
+      __m128i v = _mm_set1_epi32(s[n]);
+      for(; k >= 4; k -= 4, d += 4) _mm_storeu_si128((__m128i*)d, v);
+#endif
+      for(; k > 0; --k) *d++ = s[n];
+    }
+  }
+}
+
+static void ScaleNearest(const Drawable* source, Drawable* dest) {
+  int dw = dest->width, sw = source->width;
+  int xmap[dw], ymap[dest->height];
+  NearestMap(xmap, sw, dw);
+  NearestMap(ymap, source->height, dest->height);
+  int factor = dw % sw ? 0 : dw / sw;
   for(int y = 0; y < dest->height; ++y) {
     Pixel*restrict d = dest->rows[y];
-    Pixel*restrict s = *srows;
-    int sxe = 0;
-    int rem = dest->width;
-    UNROLL(rem,
-	   *d++ = *s;
-	   s += sxs;
-	   sxe += sxn;
-	   if(sxe >= sxd) {
-	     sxe -= sxd;
-	     ++s;
-	   });
-    srows += sys;
-    sye += syn;
-    if(sye >= syd) {
-      sye -= syd;
-      ++srows;
+    // rows that come from the same source row are just copied
+    if(y > 0 && ymap[y] == ymap[y-1]) {
+      memcpy(d, dest->rows[y-1], dw * sizeof(Pixel));
+      continue;
+    }
+    const Pixel*restrict s = source->rows[ymap[y]];
+    if(factor) ReplicateRow(d, s, sw, factor);
+    else {
+      const int* xp = xmap;
+      int rem = dw;
+      UNROLL(rem, *d++ = s[*xp++];);
+    }
+  }
+}
+
+/* Where each destination column (or row) samples the source: the two
+   neighbouring source pixels and how far it is between them. */
+struct LOCAL BilinearTap {
+  int p0, p1;
+  float f;
+};
+
+static void BilinearMap(BilinearTap* map, int src_size, int dst_size) {
+  double scale = (double)src_size / dst_size;
+  for(int d = 0; d < dst_size; ++d) {
+    // sample centers are at half-pixels
+    double pos = (d + 0.5) * scale - 0.5;
+    if(pos < 0) pos = 0;
+    int p = (int)pos;
+    if(p > src_size - 1) p = src_size - 1;
+    map[d].p0 = p;
+    map[d].p1 = p + 1 < src_size ? p + 1 : p;
+    map[d].f = (float)(pos - p);
+  }
+}
+
+/* Plain bilinear filtering works on the stored values, two channels at a
+   time, and treats alpha as just another channel. */
+static inline Pixel LerpPixel(Pixel a, Pixel b, uint32_t f) {
+  uint32_t rf = 256 - f;
+  return ((((a & 0xFF00FF) * rf + (b & 0xFF00FF) * f) >> 8) & 0xFF00FF)
+    | ((((a >> 8) & 0xFF00FF) * rf + ((b >> 8) & 0xFF00FF) * f) & 0xFF00FF00);
+}
+
+static void ScaleBilinearSrgb(const Drawable* source, Drawable* dest) {
+  int dw = dest->width;
+  BilinearTap xmap[dw], ymap[dest->height];
+  BilinearMap(xmap, source->width, dw);
+  BilinearMap(ymap, source->height, dest->height);
+  uint32_t xf[dw];
+  for(int x = 0; x < dw; ++x) xf[x] = (uint32_t)(xmap[x].f * 256.f + 0.5f);
+  for(int y = 0; y < dest->height; ++y) {
+    const Pixel*restrict s0 = source->rows[ymap[y].p0], *restrict s1 = source->rows[ymap[y].p1];
+    uint32_t yf = (uint32_t)(ymap[y].f * 256.f + 0.5f);
+    Pixel*restrict d = dest->rows[y];
+    for(int x = 0; x < dw; ++x) {
+      const BilinearTap& t = xmap[x];
+      Pixel top = LerpPixel(s0[t.p0], s0[t.p1], xf[x]);
+      Pixel bottom = LerpPixel(s1[t.p0], s1[t.p1], xf[x]);
+      *d++ = LerpPixel(top, bottom, yf);
+    }
+  }
+}
+
+/* Linear-light bilinear filtering, done separably: each source row that's
+   needed is filtered horizontally once, into one of two float rows, and
+   every destination row is a blend of the two. As with BlitTransformed,
+   the colors of straight-alpha pixels are weighted by their alpha. */
+enum BilinearAlpha { BILINEAR_OPAQUE, BILINEAR_STRAIGHT, BILINEAR_PREMULTIPLIED };
+
+template<BilinearAlpha MODE> static void ScaleBilinearLinear(const Drawable* source, Drawable* dest) {
+  int rsh, gsh, bsh, ash;
+  GetShifts(source->layout, rsh, gsh, bsh, ash);
+  int dw = dest->width, sw = source->width;
+  BilinearTap xmap[dw], ymap[dest->height];
+  BilinearMap(xmap, sw, dw);
+  BilinearMap(ymap, source->height, dest->height);
+  float* buf = (float*)malloc((sw + dw * 2) * 4 * sizeof(float));
+  if(!buf) abort(); // :|
+  float* linear = buf, *rows[2] = {buf + sw * 4, buf + (sw + dw) * 4};
+  int have[2] = {-1, -1};
+  const Pixel mask = MODE == BILINEAR_OPAQUE ? 0xFF << ash : 0;
+  for(int y = 0; y < dest->height; ++y) {
+    int want[2] = {ymap[y].p0, ymap[y].p1};
+    if(have[0] != want[0] && have[1] == want[0]) {
+      float* t = rows[0]; rows[0] = rows[1]; rows[1] = t;
+      have[1] = have[0]; have[0] = want[0];
+    }
+    for(int n = 0; n < 2; ++n) {
+      if(have[n] == want[n]) continue;
+      const Pixel* sp = source->rows[want[n]];
+      for(int x = 0; x < sw; ++x) {
+	Vec4 v;
+	if(MODE == BILINEAR_PREMULTIPLIED) {
+	  v = LoadLinear<false>(sp[x], rsh, gsh, bsh, ash);
+	  V4Store(linear + x * 4, v);
+	  linear[x * 4 + 3] = (float)((sp[x] >> ash) & 255);
+	  continue;
+	}
+	v = LoadLinear<MODE == BILINEAR_STRAIGHT>(sp[x], rsh, gsh, bsh, ash);
+	V4Store(linear + x * 4, v);
+      }
+      float* rp = rows[n];
+      for(int x = 0; x < dw; ++x, rp += 4) {
+	const BilinearTap& t = xmap[x];
+	V4Store(rp, V4MulAdd(V4MulAdd(V4Zero(), V4Load(linear + t.p0 * 4), 1.f - t.f), V4Load(linear + t.p1 * 4), t.f));
+      }
+      have[n] = want[n];
+    }
+    float fy = ymap[y].f, out[4];
+    Pixel*restrict d = dest->rows[y];
+    for(int x = 0; x < dw; ++x) {
+      V4Store(out, V4MulAdd(V4MulAdd(V4Zero(), V4Load(rows[0] + x * 4), 1.f - fy), V4Load(rows[1] + x * 4), fy));
+      Pixel a = mask;
+      if(MODE != BILINEAR_OPAQUE) {
+	a = (Pixel)Clamp((int32_t)(out[3] + 0.5f), 255) << ash;
+	if(MODE == BILINEAR_STRAIGHT) {
+	  float ra = out[3] > 0.f ? 1.f / out[3] : 0.f;
+	  out[0] *= ra; out[1] *= ra; out[2] *= ra;
+	}
+      }
+      *d++ = ((Pixel)LinearToSrgb[Clamp((int32_t)(out[0] + 0.5f), 65535)] << rsh) | ((Pixel)LinearToSrgb[Clamp((int32_t)(out[1] + 0.5f), 65535)] << gsh) | ((Pixel)LinearToSrgb[Clamp((int32_t)(out[2] + 0.5f), 65535)] << bsh) | a;
     }
   }
-  dest->Push(L);
+  free(buf);
+}
+
+SUBCRITICAL_UTILITY(ScaleFast)(lua_State* L) {
+  Drawable*restrict source = lua_toobject(L, 1, Drawable);
+  int width, height, filter_index;
+  if(lua_type(L, 2) == LUA_TUSERDATA) {
+    Drawable* d = lua_toobject(L, 2, Drawable);
+    width = d->width;
+    height = d->height;
+    filter_index = 3;
+  }
+  else {
+    width = luaL_checkinteger(L, 2);
+    height = luaL_checkinteger(L, 3);
+    filter_index = 4;
+  }
+  enum { NEAREST, BILINEAR, BILINEAR_SRGB } filter = NEAREST;
+  if(!lua_isnoneornil(L, filter_index)) {
+    const char* name = luaL_checkstring(L, filter_index);
+    if(!strcmp(name, "bilinear")) filter = BILINEAR;
+    else if(!strcmp(name, "bilinear_srgb")) filter = BILINEAR_SRGB;
+    else if(strcmp(name, "nearest")) return luaL_error(L, "Unknown filter \"%s\" (expected \"nearest\", \"bilinear\", or \"bilinear_srgb\")", name);
+  }
+  // there'd be nothing to sample
+  if((source->width <= 0 || source->height <= 0) && width > 0 && height > 0)
+    return luaL_error(L, "Can't ScaleFast an empty Drawable up to %dx%d", width, height);
+  Drawable*restrict dest = GetDestination(L, 2, source, width, height, "ScaleFast");
+  if(width <= 0 || height <= 0) return 1;
+  switch(filter) {
+  case NEAREST:
+    ScaleNearest(source, dest);
+    break;
+  case BILINEAR_SRGB:
+    ScaleBilinearSrgb(source, dest);
+    break;
+  case BILINEAR:
+    if(!source->has_alpha) ScaleBilinearLinear<BILINEAR_OPAQUE>(source, dest);
+    else if(source->premultiplied) ScaleBilinearLinear<BILINEAR_PREMULTIPLIED>(source, dest);
+    else ScaleBilinearLinear<BILINEAR_STRAIGHT>(source, dest);
+    break;
+  }
+  // blending makes partial alpha out of simple alpha
+  if(filter != NEAREST && dest->has_alpha) dest->simple_alpha = false;
   return 1;
 }
 
@@ -81,6 +323,7 @@ LUA_EXPORT int Init_effects(lua_State* L) {
   for(int y = 0; y < L3SINC_TABLE_SIZE; ++y) {
     l3sincf_table[y] = l3((y - L3SINC_TABLE_CENTER) / L3SINC_TABLE_DIV);
   }
+  for(int n = 0; n < 256; ++n) srgb_to_linear_f[n] = SrgbToLinear[n];
   return 0;
 }
 #define L3(x) l3sincf_table[(int)(x * L3SINC_TABLE_DIV + L3SINC_TABLE_CENTER)];
@@ -97,15 +340,6 @@ LUA_EXPORT int Init_effects(lua_State* L) {
   return l3sincf_table[y];
   }*/
 
-static inline float FastFloat(uint32_t u) {
-  union {
-    float f;
-    uint32_t u;
-  } x;
-  x.u = 0x4B000000U + u;
-  return x.f - 8388608.f;
-}
-
 struct LanczosKernel {
   int32_t start;
   uint32_t rem, count;
@@ -162,200 +396,218 @@ struct LanczosKernel {
   }
 };
 
+/* Every output row and column has its own kernel, but a row's kernel is the
+   same for every column and vice versa, so they're all worked out up front.
+   The weights are divided by their total here rather than per pixel. The
+   table lives in a userdata pushed onto the stack by Build, so that nothing
+   leaks if a later error or callback unwinds past it. */
+struct LOCAL KernelTable {
+  size_t* offset;
+  int* start;
+  int* taps;
+  float* weights;
+  int max_taps;
+  void Build(lua_State* L, int dst_size, int src_size) {
+    float fact = (float)src_size / dst_size;
+    float inc = fact > 1.f ? 1.f / fact : 1.f;
+    size_t used = 0;
+    {
+      LanczosKernel k;
+      for(int dst = 0; dst < dst_size; ++dst) {
+        k.Setup(dst, fact, inc, src_size);
+        used += k.rem;
+      }
+    }
+    offset = (size_t*)lua_newuserdata(L, dst_size * (sizeof(size_t) + sizeof(int) * 2) + used * sizeof(float));
+    start = (int*)(offset + dst_size);
+    taps = start + dst_size;
+    weights = (float*)(taps + dst_size);
+    max_taps = 0;
+    used = 0;
+    LanczosKernel k;
+    for(int dst = 0; dst < dst_size; ++dst) {
+      k.Setup(dst, fact, inc, src_size);
+      start[dst] = k.start;
+      taps[dst] = k.rem;
+      if((int)k.rem > max_taps) max_taps = k.rem;
+      offset[dst] = used;
+      for(uint32_t n = 0; n < k.rem; ++n)
+        weights[used++] = k.kernel[n] * k.rtotal;
+    }
+  }
+};
+
+/* Each band filters every source row it needs horizontally, once, into a
+   ring of dest->width wide rows, then filters those vertically. Alpha is
+   handled as in ScaleFast: straight colors are weighted by their alpha and
+   divided back out, premultiplied ones are filtered as they are. */
+struct LOCAL ScaleBestJob {
+  const Drawable* source;
+  Drawable* dest;
+  KernelTable xk, yk;
+  int rsh, gsh, bsh, ash;
+  // rows first up to last, in bands of band_rows, each with its own buffers
+  int first, last, band_rows;
+  float* buffers;
+  size_t buffer_size;
+};
+
+template<BilinearAlpha MODE> static void ScaleBestBand(void* _job, int first_band, int last_band) {
+  const ScaleBestJob* job = (const ScaleBestJob*)_job;
+  const Drawable* source = job->source;
+  Drawable* dest = job->dest;
+  const int sw = source->width, dw = dest->width, ring_rows = job->yk.max_taps;
+  const Pixel mask = MODE == BILINEAR_OPAQUE ? 0xFF << job->ash : 0;
+  for(int band = first_band; band < last_band; ++band) {
+    float*restrict linear = job->buffers + job->buffer_size * band;
+    float*restrict acc = linear + sw * 4;
+    float*restrict ring = acc + dw * 4;
+    int first = job->first + band * job->band_rows;
+    int last = first + job->band_rows;
+    if(last > job->last) last = job->last;
+    int next = job->yk.start[first];
+    for(int y = first; y < last; ++y) {
+      int start = job->yk.start[y], taps = job->yk.taps[y];
+      if(next < start) next = start;
+      for(; next < start + taps; ++next) {
+	// horizontal pass
+	const Pixel* sp = source->rows[next];
+	for(int x = 0; x < sw; ++x) {
+	  V4Store(linear + x * 4, LoadLinear<MODE == BILINEAR_STRAIGHT>(sp[x], job->rsh, job->gsh, job->bsh, job->ash));
+	  if(MODE == BILINEAR_PREMULTIPLIED)
+	    linear[x * 4 + 3] = (float)((sp[x] >> job->ash) & 255);
+	}
+	float* rp = ring + (size_t)(next % ring_rows) * dw * 4;
+	for(int x = 0; x < dw; ++x, rp += 4) {
+	  const float* fp = linear + job->xk.start[x] * 4;
+	  const float* lp = job->xk.weights + job->xk.offset[x];
+	  Vec4 v = V4Zero();
+	  for(int t = 0; t < job->xk.taps[x]; ++t, fp += 4)
+	    v = V4MulAdd(v, V4Load(fp), lp[t]);
+	  V4Store(rp, v);
+	}
+      }
+      // vertical pass
+      const float* w = job->yk.weights + job->yk.offset[y];
+      for(int x = 0; x < dw; ++x) V4Store(acc + x * 4, V4Zero());
+      for(int t = 0; t < taps; ++t) {
+	const float* rp = ring + (size_t)((start + t) % ring_rows) * dw * 4;
+	float wt = w[t];
+	for(int x = 0; x < dw * 4; x += 4)
+	  V4Store(acc + x, V4MulAdd(V4Load(acc + x), V4Load(rp + x), wt));
+      }
+      Pixel*restrict dp = dest->rows[y];
+      const float* fp = acc;
+      for(int x = 0; x < dw; ++x, fp += 4) {
+	int32_t ir, ig, ib;
+	Pixel a = mask;
+	if(MODE == BILINEAR_STRAIGHT) {
+	  float ta = fp[3];
+	  a = (Pixel)Clamp((int32_t)ta, 255) << job->ash;
+	  if(ta != 0.f) ta = 1.f / ta;
+	  ir = (int32_t)(fp[0] * ta);
+	  ig = (int32_t)(fp[1] * ta);
+	  ib = (int32_t)(fp[2] * ta);
+	}
+	else if(MODE == BILINEAR_PREMULTIPLIED) {
+	  // ringing mustn't leave a color brighter than its alpha allows
+	  int32_t ia = Clamp((int32_t)fp[3], 255), max = ia * 257;
+	  a = (Pixel)ia << job->ash;
+	  ir = (int32_t)fp[0]; if(ir > max) ir = max;
+	  ig = (int32_t)fp[1]; if(ig > max) ig = max;
+	  ib = (int32_t)fp[2]; if(ib > max) ib = max;
+	}
+	else {
+	  ir = (int32_t)fp[0];
+	  ig = (int32_t)fp[1];
+	  ib = (int32_t)fp[2];
+	}
+	*dp++ = ((Pixel)LinearToSrgb[Clamp(ir, 65535)] << job->rsh) | ((Pixel)LinearToSrgb[Clamp(ig, 65535)] << job->gsh) | ((Pixel)LinearToSrgb[Clamp(ib, 65535)] << job->bsh) | a;
+      }
+    }
+  }
+}
+
+/* Runs rows first up to last on the worker pool. */
+static void ScaleBestRows(ScaleBestJob& job, int first, int last, int max_bands) {
+  int bands = max_bands;
+  if(bands > last - first) bands = last - first;
+  job.first = first;
+  job.last = last;
+  job.band_rows = (last - first + bands - 1) / bands;
+  bands = (last - first + job.band_rows - 1) / job.band_rows;
+  const Drawable* source = job.source;
+  ParallelBands(!source->has_alpha ? ScaleBestBand<BILINEAR_OPAQUE>
+		: source->premultiplied ? ScaleBestBand<BILINEAR_PREMULTIPLIED>
+		: ScaleBestBand<BILINEAR_STRAIGHT>, &job, 0, bands);
+}
+
 SUBCRITICAL_UTILITY(ScaleBest)(lua_State* L) {
   Drawable*restrict source = lua_toobject(L, 1, Drawable);
   Drawable*restrict dest;
   int callback;
-  int rowskip = 0, rowskiprem = 0;
+  int rowskip = 0;
   if(lua_gettop(L) >= 2 && lua_type(L, 2) == LUA_TUSERDATA) {
     dest = lua_toobject(L, 2, Drawable);
-    if(dest->layout != source->layout) {
-      if(source->IsA("Graphic"))
-        ((Graphic*)source)->ChangeLayout(dest->layout);
-      else if(dest->IsA("Graphic"))
-        ((Graphic*)dest)->ChangeLayout(source->layout);
-      else
-        return luaL_error(L, "Attempt to ScaleBest between two non-morphable Drawables!");
-    }
+    if(!MatchLayouts(source, dest))
+      return luaL_error(L, "Attempt to ScaleBest between two non-morphable Drawables!");
     callback = lua_gettop(L) >= 3 ? 3 : 0;
     lua_pushvalue(L, 2);
+    dest->AddDamage(0, 0, dest->width - 1, dest->height - 1);
   }
   else {
-    dest = new Graphic(luaL_checkinteger(L, 2), luaL_checkinteger(L, 3), source->layout);
     callback = lua_gettop(L) >= 4 ? 4 : 0;
+    // every pixel gets written, so don't bother clearing, unless the
+    // callback might abort partway
+    dest = new Graphic(luaL_checkinteger(L, 2), luaL_checkinteger(L, 3), source->layout, callback != 0);
     dest->Push(L);
   }
-  if(source == dest) return luaL_error(L, "source and destination must differ");
+  if(DrawablesOverlap(source, dest)) return luaL_error(L, "source and destination must not overlap");
   if(callback) {
     // yes callback!
     rowskip = luaL_optinteger(L, callback + 1, 1);
     if(rowskip < 1) rowskip = 1;
-    rowskiprem = rowskip;
-  }
-  int rsh, gsh, bsh, ash;
-  switch(source->layout) {
-#define DO_FBLAYOUT(layout, _rsh, _gsh, _bsh, _ash)			\
-    case layout: rsh = _rsh; gsh = _gsh; bsh = _bsh; ash = _ash; break
-    DO_FBLAYOUT(FB_RGBx, 24, 16, 8, 0);
-    DO_FBLAYOUT(FB_xRGB, 16, 8, 0, 24);
-    DO_FBLAYOUT(FB_BGRx, 8, 16, 24, 0);
-  default:
-    DO_FBLAYOUT(FB_xBGR, 0, 8, 16, 24);
-#undef DO_FBLAYOUT
-  }
-  float xfact, yfact;
-  xfact = (float)source->width / dest->width;
-  yfact = (float)source->height / dest->height;
-  float xinc, yinc;
-  if(xfact > 1.f) xinc = 1.f / xfact;
-  else xinc = 1.f;
-  if(yfact > 1.f) yinc = 1.f / yfact;
-  else yinc = 1.f;
-  /* the X kernels will be the same for each row */
-  LanczosKernel x_kernels[dest->width];
-  for(int32_t x = 0; x < dest->width; ++x) {
-    x_kernels[x].Setup(x, xfact, xinc, source->width);
-  }
-  // the Y kernel is constant across a given row
-  LanczosKernel y_kernel;
-  if(source->has_alpha) {
-    /* the alpha code is a slight modification of the below */
-    dest->has_alpha = true;
-    dest->simple_alpha = false; // if it was simple before, it won't be soon
-    float interbuf[source->width*4];
-    dest->has_alpha = false;
-    int source_pitch = (const uint8_t*)source->rows[1] - (const uint8_t*)source->rows[0];
-    for(int y = 0; y < dest->height; ++y) {
-      float* fp = interbuf;
-      y_kernel.Setup(y, yfact, yinc, source->height);
-      for(int x = 0; x < source->width; ++x) {
-        float tr = 0.f, tg = 0.f, tb = 0.f, ta = 0.f;
-        float a;
-        const Pixel* srcp = source->rows[y_kernel.start] + x;
-        uint32_t rem = y_kernel.rem;
-        float* lp = y_kernel.kernel;
-        UNROLL_MORE(rem,
-                    a = FastFloat((*srcp >> ash) & 255) * *lp;
-                    ta += a;
-                    tr += FastFloat(SrgbToLinear[(*srcp >> rsh) & 255]) * a;
-                    tg += FastFloat(SrgbToLinear[(*srcp >> gsh) & 255]) * a;
-                    tb += FastFloat(SrgbToLinear[(*srcp >> bsh) & 255]) * a;
-                    ++lp;
-                    srcp = (const Pixel*)((const uint8_t*)srcp + source_pitch););
-        *fp++ = ta * y_kernel.rtotal;
-        if(ta != 0.f) {
-#ifdef __powerpc__
-          __asm__("fres %0,%1" : "=f"(ta) : "f"(ta));
-#else
-          ta = 1.f / ta;
-#endif
-        }
-        *fp++ = tr * ta;
-        *fp++ = tg * ta;
-        *fp++ = tb * ta;
-      }
-      Pixel*restrict dp = dest->rows[y];
-      for(int x = 0; x < dest->width; ++x) {
-        LanczosKernel& x_kernel = x_kernels[x];
-        float tr = 0.f, tg = 0.f, tb = 0.f, ta = 0.f;
-        uint32_t rem = x_kernel.rem;
-        float* lp = x_kernel.kernel;
-        float a;
-        fp = interbuf + x_kernel.start * 4;
-        UNROLL_MORE(rem,
-                    a = *fp++ * *lp;
-                    ta += a;
-                    tr += *fp++ * a;
-                    tg += *fp++ * a;
-                    tb += *fp++ * a;
-                    ++lp;);
-        int32_t ia;
-        ia = (int32_t)(ta * x_kernel.rtotal);
-        if(ta != 0.f) {
-#ifdef __powerpc__
-          __asm__("fres %0,%1" : "=f"(ta) : "f"(ta));
-#else
-          ta = 1.f / ta;
-#endif
-        }
-        if(ia < 0) ia = 0;
-        else if(ia > 255) ia = 255;
-        int32_t ir, ig, ib;
-        ir = (int32_t)(tr * ta);
-        ig = (int32_t)(tg * ta);
-        ib = (int32_t)(tb * ta);
-        if(ir < 0) ir = 0;
-        else if(ir > 65535) ir = 65535;
-        if(ig < 0) ig = 0;
-        else if(ig > 65535) ig = 65535;
-        if(ib < 0) ib = 0;
-        else if(ib > 65535) ib = 65535;
-        *dp++ = (LinearToSrgb[ir] << rsh) | (LinearToSrgb[ig] << gsh) | (LinearToSrgb[ib] << bsh) | (ia << ash);
-      }
-    }
   }
+  dest->has_alpha = source->has_alpha;
+  // if it was simple before, it won't be soon
+  dest->simple_alpha = !source->has_alpha;
+  dest->premultiplied = source->premultiplied;
+  if(dest->width <= 0 || dest->height <= 0) return 1;
+  int dest_index = lua_gettop(L);
+  ScaleBestJob job;
+  job.source = source;
+  job.dest = dest;
+  GetShifts(source->layout, job.rsh, job.gsh, job.bsh, job.ash);
+  // the tables and buffers are userdata, collected however we leave
+  job.xk.Build(L, dest->width, source->width);
+  job.yk.Build(L, dest->height, source->height);
+  int max_bands = GetWorkerCount() * 4;
+  if(max_bands > dest->height) max_bands = dest->height;
+  // one converted source row, one output row, and the ring
+  job.buffer_size = (size_t)(source->width + dest->width * (job.yk.max_taps + 1)) * 4;
+  job.buffers = (float*)lua_newuserdata(L, job.buffer_size * max_bands * sizeof(float));
+  if(!callback) ScaleBestRows(job, 0, dest->height, max_bands);
   else {
-    Pixel mask = 0xFF << ash;
-    float interbuf[source->width*3];
-    dest->has_alpha = false;
-    int source_pitch = (const uint8_t*)source->rows[1] - (const uint8_t*)source->rows[0];
-    for(int y = 0; y < dest->height; ++y) {
-      float* fp = interbuf;
-      y_kernel.Setup(y, yfact, yinc, source->height);
-      for(int x = 0; x < source->width; ++x) {
-        float tr = 0.f, tg = 0.f, tb = 0.f;
-        const Pixel* srcp = source->rows[y_kernel.start] + x;
-        uint32_t rem = y_kernel.rem;
-        float* lp = y_kernel.kernel;
-        UNROLL_MORE(rem,
-                    tr += FastFloat(SrgbToLinear[(*srcp >> rsh) & 255]) * *lp;
-                    tg += FastFloat(SrgbToLinear[(*srcp >> gsh) & 255]) * *lp;
-                    tb += FastFloat(SrgbToLinear[(*srcp >> bsh) & 255]) * *lp;
-                    ++lp;
-                    srcp = (const Pixel*)((const uint8_t*)srcp + source_pitch););
-        *fp++ = tr * y_kernel.rtotal;
-        *fp++ = tg * y_kernel.rtotal;
-        *fp++ = tb * y_kernel.rtotal;
-      }
-      Pixel*restrict dp = dest->rows[y];
-      for(int x = 0; x < dest->width; ++x) {
-        LanczosKernel& x_kernel = x_kernels[x];
-        float tr = 0.f, tg = 0.f, tb = 0.f;
-        uint32_t rem = x_kernel.rem;
-        float* lp = x_kernel.kernel;
-        fp = interbuf + x_kernel.start * 3;
-        UNROLL_MORE(rem,
-                    tr += *fp++ * *lp;
-                    tg += *fp++ * *lp;
-                    tb += *fp++ * *lp;
-                    ++lp;);
-        int32_t ir, ig, ib;
-        ir = (int32_t)(tr * x_kernel.rtotal);
-        ig = (int32_t)(tg * x_kernel.rtotal);
-        ib = (int32_t)(tb * x_kernel.rtotal);
-        if(ir < 0) ir = 0;
-        else if(ir > 65535) ir = 65535;
-        if(ig < 0) ig = 0;
-        else if(ig > 65535) ig = 65535;
-        if(ib < 0) ib = 0;
-        else if(ib > 65535) ib = 65535;
-        *dp++ = (LinearToSrgb[ir] << rsh) | (LinearToSrgb[ig] << gsh) | (LinearToSrgb[ib] << bsh) | mask;
-      }
-      if(callback && --rowskiprem == 0) {
-        rowskiprem = rowskip;
-        // callback
-        lua_pushvalue(L, callback);
-        // callback, destination
-        lua_pushvalue(L, -2);
-        // callback, destination, row
-        lua_pushinteger(L, y);
-        // result
-        lua_call(L, 2, 1);
-        bool abort = lua_toboolean(L, -1);
-        lua_pop(L, 1);
-        if(abort) break;
+    for(int y = 0; y + rowskip <= dest->height; y += rowskip) {
+      ScaleBestRows(job, y, y + rowskip, max_bands);
+      // callback
+      lua_pushvalue(L, callback);
+      // callback, destination
+      lua_pushvalue(L, dest_index);
+      // callback, destination, row
+      lua_pushinteger(L, y + rowskip - 1);
+      // result
+      lua_call(L, 2, 1);
+      bool abort = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+      if(abort) {
+	lua_settop(L, dest_index);
+	return 1;
       }
     }
+    int rest = dest->height % rowskip;
+    if(rest) ScaleBestRows(job, dest->height - rest, dest->height, max_bands);
   }
+  lua_settop(L, dest_index);
   return 1;
 }
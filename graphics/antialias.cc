@@ -0,0 +1,280 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#include "graphics.h"
+#include <stdlib.h>
+
+#include <math.h>
+
+using namespace SubCritical;
+
+/* Anti-aliased fills work by accumulating exact coverage. Every edge adds,
+   to each cell it passes through, the signed area it sweeps out between
+   itself and the cell's left edge, and the change in coverage it causes to
+   the cells to its right. A running sum along each row then gives the
+   fraction of each pixel that lies inside the shape. Pixel x covers
+   [x, x+1), as with the aliased primitives. */
+
+struct LOCAL Coverage {
+  // accumulator; each row has w + 2 cells, the last two past the right edge
+  float* acc;
+  int w, h;
+  // pixel coordinates of acc[0]
+  int ox, oy;
+};
+
+/* Accumulate an edge lying entirely within 0 <= x <= w, in cell
+   coordinates. Rows outside [0, h) are skipped. */
+static void AccumulateLine(Coverage& c, float x0, float y0, float x1, float y1) {
+  if(y0 == y1) return;
+  float dir = 1.f;
+  if(y0 > y1) {
+    float t;
+    t = x0; x0 = x1; x1 = t;
+    t = y0; y0 = y1; y1 = t;
+    dir = -1.f;
+  }
+  float dxdy = (x1 - x0) / (y1 - y0);
+  int ystart = y0 < 0 ? 0 : (int)y0;
+  int yend = y1 > c.h ? c.h : (int)ceilf(y1);
+  float x = x0 + ((ystart > y0 ? ystart : y0) - y0) * dxdy;
+  const float maxx = (float)c.w;
+  int stride = c.w + 2;
+  for(int y = ystart; y < yend; ++y) {
+    float* row = c.acc + y * stride;
+    float dy = (y + 1 < y1 ? y + 1 : y1) - (y > y0 ? y : y0);
+    float xnext = x + dxdy * dy;
+    // rounding can take x a hair past either end
+    if(xnext < 0) xnext = 0;
+    else if(xnext > maxx) xnext = maxx;
+    float d = dy * dir;
+    float l = x < xnext ? x : xnext, r = x < xnext ? xnext : x;
+    float lfloor = floorf(l);
+    int li = (int)lfloor;
+    float rceil = ceilf(r);
+    int ri = (int)rceil;
+    if(ri <= li + 1) {
+      // within one cell
+      float xm = 0.5f * (x + xnext) - lfloor;
+      row[li] += d - d * xm;
+      row[li + 1] += d * xm;
+    }
+    else {
+      float s = 1.f / (r - l);
+      float lf = l - lfloor;
+      float a0 = 0.5f * s * (1.f - lf) * (1.f - lf);
+      float rf = r - rceil + 1.f;
+      float am = 0.5f * s * rf * rf;
+      row[li] += d * a0;
+      if(ri == li + 2)
+	row[li + 1] += d * (1.f - a0 - am);
+      else {
+	float a1 = s * (1.5f - lf);
+	row[li + 1] += d * (a1 - a0);
+	for(int xi = li + 2; xi < ri - 1; ++xi)
+	  row[xi] += d * s;
+	float a2 = a1 + (ri - li - 3) * s;
+	row[ri - 1] += d * (1.f - a2 - am);
+      }
+      row[ri] += d * am;
+    }
+    x = xnext;
+  }
+}
+
+/* Add an edge given in pixel coordinates. The parts of it left of the
+   accumulator still change the coverage of everything to their right, so
+   they're moved onto its left edge; the parts right of it are moved onto
+   its right edge, where they don't affect anything visible. */
+static void AddEdge(Coverage& c, float x0, float y0, float x1, float y1) {
+  x0 -= c.ox; x1 -= c.ox;
+  y0 -= c.oy; y1 -= c.oy;
+  if((y0 < 0 && y1 < 0) || (y0 >= c.h && y1 >= c.h) || y0 == y1) return;
+  const float maxx = (float)c.w;
+  // split at x = 0 and x = w
+  float ts[4] = {0.f, 0.f, 0.f, 1.f};
+  int nts = 1;
+  if(x0 != x1) {
+    float t0 = (0 - x0) / (x1 - x0), t1 = (maxx - x0) / (x1 - x0);
+    if(t0 > t1) { float t = t0; t0 = t1; t1 = t; }
+    if(t0 > 0 && t0 < 1) ts[nts++] = t0;
+    if(t1 > 0 && t1 < 1) ts[nts++] = t1;
+  }
+  ts[nts++] = 1.f;
+  float px = x0, py = y0;
+  for(int n = 1; n < nts; ++n) {
+    float nx, ny;
+    if(n == nts - 1) { nx = x1; ny = y1; }
+    else { nx = x0 + (x1 - x0) * ts[n]; ny = y0 + (y1 - y0) * ts[n]; }
+    float mid = 0.5f * (px + nx);
+    if(mid <= 0) AccumulateLine(c, 0, py, 0, ny);
+    else if(mid >= maxx) AccumulateLine(c, maxx, py, maxx, ny);
+    else AccumulateLine(c, px < 0 ? 0 : px > maxx ? maxx : px, py,
+			nx < 0 ? 0 : nx > maxx ? maxx : nx, ny);
+    px = nx; py = ny;
+  }
+}
+
+/* Set up an accumulator covering the bounding box of the given vertices
+   (all count of them, if indices is NULL) within the clip rect. Returns
+   false if there's nothing to draw. */
+template<class I> static bool SetupCoverage(Coverage& c, const Fixed* coords, const I* indices, size_t count, int cl, int ct, int cr, int cb) {
+  if(count == 0) return false;
+  Fixed minx, miny, maxx, maxy;
+  const Fixed* p = coords + (indices ? indices[0] : 0) * 2;
+  minx = maxx = p[0];
+  miny = maxy = p[1];
+  for(size_t n = 1; n < count; ++n) {
+    p = coords + (indices ? indices[n] : n) * 2;
+    if(p[0] < minx) minx = p[0];
+    else if(p[0] > maxx) maxx = p[0];
+    if(p[1] < miny) miny = p[1];
+    else if(p[1] > maxy) maxy = p[1];
+  }
+  int l = Q_FLOOR(minx), t = Q_FLOOR(miny);
+  int r = Q_CEIL(maxx) - 1, b = Q_CEIL(maxy) - 1;
+  if(l < cl) l = cl;
+  if(t < ct) t = ct;
+  if(r > cr) r = cr;
+  if(b > cb) b = cb;
+  if(r < l || b < t) return false;
+  c.ox = l;
+  c.oy = t;
+  c.w = r - l + 1;
+  c.h = b - t + 1;
+  c.acc = (float*)calloc((size_t)(c.w + 2) * c.h, sizeof(float));
+  return c.acc != NULL;
+}
+
+#define VX(p) Q_TO_F((p)[0])
+#define VY(p) Q_TO_F((p)[1])
+
+/* Blend the primitive color over every pixel in proportion to its
+   coverage, then free the accumulator. */
+void Drawable::FillCoverage(float* acc, int l, int t, int w, int h) throw() {
+  int stride = w + 2;
+  for(int y = 0; y < h; ++y) {
+    const float* cell = acc + y * stride;
+    Pixel*restrict p = rows[t + y] + l;
+    float sum = 0;
+    for(int x = 0; x < w; ++x, ++p) {
+      sum += cell[x];
+      float cov = fabsf(sum);
+      if(cov >= 1.f) cov = 1.f;
+      uint32_t a = (uint32_t)(cov * 65536.f + 0.5f);
+      if(a == 0) continue;
+      uint32_t r, g, b, ra;
+      if(primitive_alpha) {
+	// tr_* are premultiplied by the primitive alpha, 65536 - tr_a
+	ra = 65536 - (uint32_t)((uint64_t)a * (65536 - tr_a) >> 16);
+	r = ((uint32_t)tr_r * a >> 16) + ((uint32_t)SrgbToLinear[(*p >> rsh) & 255] * ra >> 16);
+	g = ((uint32_t)tr_g * a >> 16) + ((uint32_t)SrgbToLinear[(*p >> gsh) & 255] * ra >> 16);
+	b = ((uint32_t)tr_b * a >> 16) + ((uint32_t)SrgbToLinear[(*p >> bsh) & 255] * ra >> 16);
+	if(r > 65535) r = 65535;
+	if(g > 65535) g = 65535;
+	if(b > 65535) b = 65535;
+      }
+      else if(a >= 65536) {
+	*p = op_p;
+	continue;
+      }
+      else {
+	ra = 65536 - a;
+	r = (trf_r * a + (uint32_t)SrgbToLinear[(*p >> rsh) & 255] * ra) >> 16;
+	g = (trf_g * a + (uint32_t)SrgbToLinear[(*p >> gsh) & 255] * ra) >> 16;
+	b = (trf_b * a + (uint32_t)SrgbToLinear[(*p >> bsh) & 255] * ra) >> 16;
+      }
+      *p = ((Pixel)LinearToSrgb[r] << rsh) | ((Pixel)LinearToSrgb[g] << gsh) | ((Pixel)LinearToSrgb[b] << bsh) | (255 << ash);
+    }
+  }
+  free(acc);
+}
+
+/* All the triangles go into one accumulator, each wound the same way, so
+   triangles that share an edge add up to exactly full coverage along it
+   instead of leaving a faint seam. */
+template<class I> void Drawable::DrawTrianglesAA(const Fixed* coords, const I* indices, size_t indexcount) throw() {
+  if(primitive_alpha && tr_a == 65536) return;
+  indexcount -= indexcount % 3;
+  Coverage c;
+  if(!SetupCoverage(c, coords, indices, indexcount, clip_left, clip_top, clip_right, clip_bottom)) return;
+  if(damage) AddDamage(c.ox, c.oy, c.ox + c.w - 1, c.oy + c.h - 1);
+  for(size_t n = 0; n < indexcount; n += 3) {
+    const Fixed* a = coords + indices[n] * 2;
+    const Fixed* b = coords + indices[n+1] * 2;
+    const Fixed* d = coords + indices[n+2] * 2;
+    int64_t cross = (int64_t)(b[0] - a[0]) * (d[1] - a[1]) - (int64_t)(b[1] - a[1]) * (d[0] - a[0]);
+    if(cross == 0) continue;
+    if(cull_winding && (cross > 0) != (cull_winding > 0)) continue;
+    if(cross < 0) { const Fixed* t = b; b = d; d = t; }
+    AddEdge(c, VX(a), VY(a), VX(b), VY(b));
+    AddEdge(c, VX(b), VY(b), VX(d), VY(d));
+    AddEdge(c, VX(d), VY(d), VX(a), VY(a));
+  }
+  FillCoverage(c.acc, c.ox, c.oy, c.w, c.h);
+}
+
+/* A closed polygon through the given vertices (all count coords, in order,
+   if indices is NULL). Where it overlaps itself, it's filled once. */
+template<class I> void Drawable::DrawPolygonAA(const Fixed* coords, const I* indices, size_t count) throw() {
+  if(primitive_alpha && tr_a == 65536) return;
+  if(count < 3) return;
+  Coverage c;
+  if(!SetupCoverage(c, coords, indices, count, clip_left, clip_top, clip_right, clip_bottom)) return;
+  if(damage) AddDamage(c.ox, c.oy, c.ox + c.w - 1, c.oy + c.h - 1);
+  const Fixed* prev = coords + (indices ? indices[count-1] : count-1) * 2;
+  for(size_t n = 0; n < count; ++n) {
+    const Fixed* cur = coords + (indices ? indices[n] : n) * 2;
+    AddEdge(c, VX(prev), VY(prev), VX(cur), VY(cur));
+    prev = cur;
+  }
+  FillCoverage(c.acc, c.ox, c.oy, c.w, c.h);
+}
+
+template void Drawable::DrawTrianglesAA<Index>(const Fixed*, const Index*, size_t) throw();
+template void Drawable::DrawTrianglesAA<Index32>(const Fixed*, const Index32*, size_t) throw();
+template void Drawable::DrawPolygonAA<Index>(const Fixed*, const Index*, size_t) throw();
+template void Drawable::DrawPolygonAA<Index32>(const Fixed*, const Index32*, size_t) throw();
+
+int Drawable::Lua_DrawTrianglesAA(lua_State* L) throw() {
+  if(has_alpha) return luaL_error(L, "Graphics with alpha channels cannot be modified with this function.");
+  CoordArray* r = lua_toobject(L, 1, CoordArray);
+  IndexArray* i = lua_toobject(L, 2, IndexArray);
+  size_t count = luaL_optinteger(L, 3, i->count);
+  if(count > i->count) count = i->count;
+  if(i->indices32) DrawTrianglesAA(r->coords, i->indices32, count);
+  else DrawTrianglesAA(r->coords, i->indices, count);
+  return 0;
+}
+
+int Drawable::Lua_DrawPolygonAA(lua_State* L) throw() {
+  if(has_alpha) return luaL_error(L, "Graphics with alpha channels cannot be modified with this function.");
+  CoordArray* r = lua_toobject(L, 1, CoordArray);
+  if(lua_isnoneornil(L, 2))
+    DrawPolygonAA(r->coords, (const Index*)NULL, r->count);
+  else {
+    IndexArray* i = lua_toobject(L, 2, IndexArray);
+    size_t count = luaL_optinteger(L, 3, i->count);
+    if(count > i->count) count = i->count;
+    if(i->indices32) DrawPolygonAA(r->coords, i->indices32, count);
+    else DrawPolygonAA(r->coords, i->indices, count);
+  }
+  return 0;
+}
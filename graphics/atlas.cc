@@ -0,0 +1,364 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#include "graphics.h"
+#include <stdlib.h>
+#include <string.h>
+
+using namespace SubCritical;
+
+AtlasBuilder::AtlasBuilder(int max_width, int max_height, int padding)
+  : entries(NULL), count(0), capacity(0), max_width(max_width),
+    max_height(max_height), padding(padding), built(false) {}
+
+AtlasBuilder::~AtlasBuilder() {
+  Clear();
+  free(entries);
+}
+
+void AtlasBuilder::Clear() throw() {
+  for(size_t n = 0; n < count; ++n) delete entries[n].graphic;
+  count = 0;
+  built = false;
+}
+
+/* Skyline bottom-left packing: the skyline is a list of horizontal segments,
+   left to right, covering the whole width of the bin, and each rect goes
+   wherever its top edge would be lowest. Rects are placed tallest first.
+   Padding is added to the right and bottom of each rect, and to the bin so
+   the last row and column don't need it. */
+struct SkylineNode {
+  int x, y, w;
+};
+
+struct PackKey {
+  int w, h;
+  size_t index;
+};
+
+static int CompareForPacking(const void* _a, const void* _b) {
+  const PackKey* a = (const PackKey*)_a, *b = (const PackKey*)_b;
+  if(a->h != b->h) return a->h > b->h ? -1 : 1;
+  if(a->w != b->w) return a->w > b->w ? -1 : 1;
+  return a->index < b->index ? -1 : a->index > b->index;
+}
+
+// the y at which a w x h rect fits on the skyline at node i, or -1
+static int SkylineFit(const SkylineNode* nodes, int node_count, int i, int w, int h, int bin_w, int bin_h) {
+  if(nodes[i].x + w > bin_w) return -1;
+  int y = nodes[i].y, left = w;
+  while(left > 0) {
+    if(i >= node_count) return -1;
+    if(nodes[i].y > y) y = nodes[i].y;
+    if(y + h > bin_h) return -1;
+    left -= nodes[i].w;
+    ++i;
+  }
+  return y;
+}
+
+static void SkylineAdd(SkylineNode* nodes, int& node_count, int i, int x, int y, int w, int h) {
+  memmove(nodes + i + 1, nodes + i, (node_count - i) * sizeof(SkylineNode));
+  nodes[i].x = x; nodes[i].y = y + h; nodes[i].w = w;
+  ++node_count;
+  // trim the nodes the new one now covers
+  for(int n = i + 1; n < node_count; ) {
+    int shrink = nodes[n-1].x + nodes[n-1].w - nodes[n].x;
+    if(shrink <= 0) break;
+    nodes[n].x += shrink;
+    nodes[n].w -= shrink;
+    if(nodes[n].w > 0) break;
+    memmove(nodes + n, nodes + n + 1, (node_count - n - 1) * sizeof(SkylineNode));
+    --node_count;
+  }
+  for(int n = 0; n < node_count - 1; ) {
+    if(nodes[n].y == nodes[n+1].y) {
+      nodes[n].w += nodes[n+1].w;
+      memmove(nodes + n + 1, nodes + n + 2, (node_count - n - 2) * sizeof(SkylineNode));
+      --node_count;
+    }
+    else ++n;
+  }
+}
+
+bool AtlasBuilder::Pack(int width, int* xs, int* ys, int& used_width, int& used_height) const throw() {
+  int bin_w = width + padding, bin_h = max_height + padding;
+  PackKey* keys = (PackKey*)malloc(count * sizeof(PackKey));
+  SkylineNode* nodes = (SkylineNode*)malloc((count + 2) * sizeof(SkylineNode));
+  if(!keys || !nodes) {
+    free(keys);
+    free(nodes);
+    return false;
+  }
+  for(size_t n = 0; n < count; ++n) {
+    keys[n].w = entries[n].w + padding;
+    keys[n].h = entries[n].h + padding;
+    keys[n].index = n;
+  }
+  qsort(keys, count, sizeof(PackKey), CompareForPacking);
+  int node_count = 1;
+  nodes[0].x = 0; nodes[0].y = 0; nodes[0].w = bin_w;
+  used_width = used_height = 0;
+  bool ok = true;
+  for(size_t n = 0; n < count; ++n) {
+    const PackKey& k = keys[n];
+    int best = -1, best_top = 0, best_w = 0, best_y = 0;
+    for(int i = 0; i < node_count; ++i) {
+      int y = SkylineFit(nodes, node_count, i, k.w, k.h, bin_w, bin_h);
+      if(y < 0) continue;
+      if(best < 0 || y + k.h < best_top || (y + k.h == best_top && nodes[i].w < best_w)) {
+        best = i;
+        best_top = y + k.h;
+        best_w = nodes[i].w;
+        best_y = y;
+      }
+    }
+    if(best < 0) { ok = false; break; }
+    int x = nodes[best].x;
+    xs[k.index] = x;
+    ys[k.index] = best_y;
+    SkylineAdd(nodes, node_count, best, x, best_y, k.w, k.h);
+    const Entry& e = entries[k.index];
+    if(x + e.w > used_width) used_width = x + e.w;
+    if(best_y + e.h > used_height) used_height = best_y + e.h;
+  }
+  free(keys);
+  free(nodes);
+  return ok;
+}
+
+Graphic* AtlasBuilder::Build(FBLayout layout) throw() {
+  if(count == 0) return NULL;
+  int* pos = (int*)malloc(count * 4 * sizeof(int));
+  if(!pos) return NULL;
+  int* best_xs = pos, *best_ys = pos + count, *xs = pos + count * 2, *ys = pos + count * 3;
+  /* Try power-of-two widths from about the square root of the total area up
+     to the maximum, and keep whichever packing makes the smallest atlas. */
+  uint64_t area = 0;
+  int widest = 0;
+  for(size_t n = 0; n < count; ++n) {
+    area += (uint64_t)(entries[n].w + padding) * (entries[n].h + padding);
+    if(entries[n].w > widest) widest = entries[n].w;
+  }
+  int width = 1;
+  while(width < widest || (uint64_t)width * width < area) width *= 2;
+  if(width > max_width) width = max_width;
+  int best_w = 0, best_h = 0;
+  uint64_t best_area = 0;
+  while(width >= widest) {
+    int used_w, used_h;
+    if(Pack(width, xs, ys, used_w, used_h)) {
+      uint64_t used_area = (uint64_t)used_w * used_h;
+      if(best_w == 0 || used_area < best_area) {
+        best_w = used_w;
+        best_h = used_h;
+        best_area = used_area;
+        memcpy(best_xs, xs, count * sizeof(int));
+        memcpy(best_ys, ys, count * sizeof(int));
+      }
+    }
+    if(width == max_width) break;
+    width *= 2;
+    if(width > max_width) width = max_width;
+  }
+  if(best_w == 0) {
+    free(pos);
+    return NULL;
+  }
+  bool has_alpha = false, simple_alpha = true, premultiplied = true;
+  for(size_t n = 0; n < count; ++n) {
+    const Graphic* g = entries[n].graphic;
+    if(!g->has_alpha) continue;
+    has_alpha = true;
+    simple_alpha = simple_alpha && g->simple_alpha;
+    premultiplied = premultiplied && g->premultiplied;
+  }
+  Graphic* atlas = new Graphic(best_w, best_h, layout);
+  atlas->has_alpha = has_alpha;
+  atlas->simple_alpha = simple_alpha;
+  atlas->premultiplied = has_alpha && premultiplied;
+  Pixel mask = (layout == FB_RGBx || layout == FB_BGRx) ? 0x000000FF : 0xFF000000;
+  for(size_t n = 0; n < count; ++n) {
+    Entry& e = entries[n];
+    Graphic* g = e.graphic;
+    e.x = best_xs[n];
+    e.y = best_ys[n];
+    // mixing premultiplied and straight alpha: everything has to be straight
+    if(g->premultiplied && !atlas->premultiplied) g->Unpremultiply();
+    for(int y = 0; y < e.h; ++y) {
+      Pixel* dst = atlas->rows[e.y + y] + e.x;
+      ConvertPixels(dst, g->rows[y], e.w, g->layout, layout);
+      if(has_alpha && !g->has_alpha)
+        for(int x = 0; x < e.w; ++x) dst[x] |= mask;
+    }
+    delete g;
+    e.graphic = NULL;
+  }
+  free(pos);
+  built = true;
+  return atlas;
+}
+
+int AtlasBuilder::Lua_Add(lua_State* L) throw() {
+  if(built) return luaL_error(L, "This AtlasBuilder has already been built; Clear it first");
+  Drawable* d = lua_toobject(L, 1, Drawable);
+  if(d->width > max_width || d->height > max_height)
+    return luaL_error(L, "Drawable is bigger than the maximum atlas size");
+  if(count >= capacity) {
+    size_t nucapacity = capacity ? capacity * 2 : 64;
+    Entry* nuentries = (Entry*)realloc(entries, nucapacity * sizeof(Entry));
+    if(!nuentries) return luaL_error(L, "Out of memory");
+    entries = nuentries;
+    capacity = nucapacity;
+  }
+  Entry& e = entries[count];
+  e.graphic = new Graphic(*d);
+  e.x = e.y = 0;
+  e.w = d->width;
+  e.h = d->height;
+  lua_pushnumber(L, count++);
+  return 1;
+}
+
+int AtlasBuilder::Lua_GetCount(lua_State* L) const throw() {
+  lua_pushnumber(L, count);
+  return 1;
+}
+
+int AtlasBuilder::Lua_Build(lua_State* L) throw() {
+  if(built) return luaL_error(L, "This AtlasBuilder has already been built; Clear it first");
+  if(count == 0) return luaL_error(L, "Nothing has been added to this AtlasBuilder");
+  FBLayout layout = lua_isnoneornil(L, 1) ? entries[0].graphic->layout : lua_toobject(L, 1, Drawable)->layout;
+  Graphic* atlas = Build(layout);
+  if(!atlas) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "Unable to fit everything in a %dx%d atlas", max_width, max_height);
+    return 2;
+  }
+  atlas->Push(L);
+  return 1;
+}
+
+int AtlasBuilder::Lua_GetRect(lua_State* L) const throw() {
+  if(!built) return luaL_error(L, "This AtlasBuilder hasn't been built yet");
+  lua_Integer index = luaL_checkinteger(L, 1);
+  if(index < 0 || index >= (lua_Integer)count)
+    return luaL_error(L, "index out of range");
+  const Entry& e = entries[index];
+  lua_pushinteger(L, e.x);
+  lua_pushinteger(L, e.y);
+  lua_pushinteger(L, e.w);
+  lua_pushinteger(L, e.h);
+  return 4;
+}
+
+/* Big-endian, like PackedArray1D_S32's Dump. These are x, y, w, h records,
+   not the six-number records DrawList:AddBlits takes; GetBlits makes those. */
+int AtlasBuilder::Lua_GetRects(lua_State* L) const throw() {
+  if(!built) return luaL_error(L, "This AtlasBuilder hasn't been built yet");
+  uint32_t* buf = (uint32_t*)malloc(count * 4 * sizeof(uint32_t));
+  if(!buf) return luaL_error(L, "Out of memory");
+  uint32_t* q = buf;
+  for(size_t n = 0; n < count; ++n) {
+    const Entry& e = entries[n];
+    *q++ = Swap32_BE((uint32_t)e.x);
+    *q++ = Swap32_BE((uint32_t)e.y);
+    *q++ = Swap32_BE((uint32_t)e.w);
+    *q++ = Swap32_BE((uint32_t)e.h);
+  }
+  lua_pushlstring(L, (const char*)buf, count * 4 * sizeof(uint32_t));
+  free(buf);
+  return 1;
+}
+
+/* Turns index, x, y triples (a table, or a big-endian string) into source
+   and destination rectangles for DrawList:AddBlits. */
+int AtlasBuilder::Lua_GetBlits(lua_State* L) const throw() {
+  if(!built) return luaL_error(L, "This AtlasBuilder hasn't been built yet");
+  size_t n;
+  const int32_t* packed = NULL;
+  if(lua_type(L, 1) == LUA_TSTRING) {
+    const char* s = lua_tolstring(L, 1, &n);
+    if(n % (3 * sizeof(int32_t))) return luaL_error(L, "GetBlits data must be a multiple of 12 bytes long");
+    n /= sizeof(int32_t);
+    packed = (const int32_t*)s;
+  }
+  else if(lua_istable(L, 1)) {
+    n = lua_rawlen(L, 1);
+    if(n % 3) return luaL_error(L, "GetBlits data must have a multiple of 3 numbers");
+  }
+  else return luaL_typerror(L, 1, "table or string");
+  // a userdata, so that a bad index doesn't leak it
+  uint32_t* buf = (uint32_t*)lua_newuserdata(L, n / 3 * 6 * sizeof(uint32_t) + 1);
+  uint32_t* q = buf;
+  for(size_t i = 0; i < n; i += 3) {
+    lua_Integer v[3];
+    for(int j = 0; j < 3; ++j) {
+      if(packed) {
+	int32_t x;
+	memcpy(&x, packed + i + j, sizeof(x));
+	v[j] = (int32_t)Swap32_BE((uint32_t)x);
+      }
+      else {
+	lua_rawgeti(L, 1, i + j + 1);
+	v[j] = (lua_Integer)lua_tonumber(L, -1);
+	lua_pop(L, 1);
+      }
+    }
+    if(v[0] < 0 || v[0] >= (lua_Integer)count)
+      return luaL_error(L, "index out of range");
+    const Entry& e = entries[v[0]];
+    *q++ = Swap32_BE((uint32_t)e.x);
+    *q++ = Swap32_BE((uint32_t)e.y);
+    *q++ = Swap32_BE((uint32_t)e.w);
+    *q++ = Swap32_BE((uint32_t)e.h);
+    *q++ = Swap32_BE((uint32_t)v[1]);
+    *q++ = Swap32_BE((uint32_t)v[2]);
+  }
+  lua_pushlstring(L, (const char*)buf, (q - buf) * sizeof(uint32_t));
+  return 1;
+}
+
+int AtlasBuilder::Lua_Clear(lua_State* L) throw() {
+  Clear();
+  return 0;
+}
+
+static const struct ObjectMethod ABMethods[] = {
+  METHOD("Add", &AtlasBuilder::Lua_Add),
+  METHOD("GetCount", &AtlasBuilder::Lua_GetCount),
+  METHOD("Build", &AtlasBuilder::Lua_Build),
+  METHOD("GetRect", &AtlasBuilder::Lua_GetRect),
+  METHOD("GetRects", &AtlasBuilder::Lua_GetRects),
+  METHOD("GetBlits", &AtlasBuilder::Lua_GetBlits),
+  METHOD("Clear", &AtlasBuilder::Lua_Clear),
+  NOMOREMETHODS(),
+};
+PROTOCOL_IMP(AtlasBuilder, Object, ABMethods);
+
+SUBCRITICAL_CONSTRUCTOR(AtlasBuilder)(lua_State* L) {
+  int max_width = luaL_optinteger(L, 1, 4096);
+  int max_height = luaL_optinteger(L, 2, max_width);
+  int padding = luaL_optinteger(L, 3, 0);
+  if(max_width < 1 || max_height < 1) return luaL_error(L, "Silly maximum atlas size given");
+  if(padding < 0) return luaL_error(L, "Padding must not be negative");
+  (new AtlasBuilder(max_width, max_height, padding))->Push(L);
+  return 1;
+}
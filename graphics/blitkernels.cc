@@ -0,0 +1,785 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#include "blitkernels.h"
+
+/* The vector kernels must agree with the scalar ones bit for bit. They do the
+   same integer math in the same order; only the table lookups that SIMD can't
+   do cheaply (all of them for SSE2, the 64K LinearToSrgb ones for AVX2) are
+   left scalar. We build without -msse*, so each kernel carries its own target
+   attribute and is only called after the CPU has been checked. */
+#if defined(__GNUC__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define BLIT_X86 1
+#include <immintrin.h>
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define BLIT_X86 0
+#endif
+
+using namespace SubCritical;
+
+/*** Scalar ***/
+
+static void blend_alpha_scalar(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh) {
+  Pixel mask = 255 << sh.ash;
+  uint32_t r, g, b, a, ra;
+  UNROLL(rem,
+	 a = (*src >> sh.ash) & 255;
+	 a += a & 1;
+	 ra = 256-a;
+	 r = ((uint32_t)SrgbToLinear[(*src >> sh.rsh) & 255] * a +
+	      (uint32_t)SrgbToLinear[(*dst >> sh.rsh) & 255] * ra) >> 8;
+	 g = ((uint32_t)SrgbToLinear[(*src >> sh.gsh) & 255] * a +
+	      (uint32_t)SrgbToLinear[(*dst >> sh.gsh) & 255] * ra) >> 8;
+	 b = ((uint32_t)SrgbToLinear[(*src >> sh.bsh) & 255] * a +
+	      (uint32_t)SrgbToLinear[(*dst >> sh.bsh) & 255] * ra) >> 8;
+	 ++src;
+	 *dst++ = ((Pixel)LinearToSrgb[r] << sh.rsh) | ((Pixel)LinearToSrgb[g] << sh.gsh) | ((Pixel)LinearToSrgb[b] << sh.bsh) | mask);
+}
+
+static void blend_simple_t_scalar(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh, uint32_t an) {
+  Pixel mask = 0xFF << sh.ash;
+  uint32_t r, g, b, ra;
+  ra = 65536 - an;
+  UNROLL(rem,
+	 if(*src & mask) {
+	   r = ((uint32_t)SrgbToLinear[(*src >> sh.rsh) & 255] * an +
+		(uint32_t)SrgbToLinear[(*dst >> sh.rsh) & 255] * ra) >> 16;
+	   g = ((uint32_t)SrgbToLinear[(*src >> sh.gsh) & 255] * an +
+		(uint32_t)SrgbToLinear[(*dst >> sh.gsh) & 255] * ra) >> 16;
+	   b = ((uint32_t)SrgbToLinear[(*src >> sh.bsh) & 255] * an +
+		(uint32_t)SrgbToLinear[(*dst >> sh.bsh) & 255] * ra) >> 16;
+	   *dst = ((Pixel)LinearToSrgb[r] << sh.rsh) | ((Pixel)LinearToSrgb[g] << sh.gsh) | ((Pixel)LinearToSrgb[b] << sh.bsh) | mask;
+	 }
+	 ++src; ++dst);
+}
+
+static void blend_alpha_t_scalar(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh, uint32_t an) {
+  Pixel mask = 0xFF << sh.ash;
+  uint32_t r, g, b, a, ra;
+  UNROLL(rem,
+	 a = (*src >> sh.ash) & 255;
+	 a += a & 1;
+	 a = (a * an) >> 8;
+	 ra = 65536-a;
+	 r = ((uint32_t)SrgbToLinear[(*src >> sh.rsh) & 255] * a +
+	      (uint32_t)SrgbToLinear[(*dst >> sh.rsh) & 255] * ra) >> 16;
+	 g = ((uint32_t)SrgbToLinear[(*src >> sh.gsh) & 255] * a +
+	      (uint32_t)SrgbToLinear[(*dst >> sh.gsh) & 255] * ra) >> 16;
+	 b = ((uint32_t)SrgbToLinear[(*src >> sh.bsh) & 255] * a +
+	      (uint32_t)SrgbToLinear[(*dst >> sh.bsh) & 255] * ra) >> 16;
+	 ++src;
+	 *dst++ = ((Pixel)LinearToSrgb[r] << sh.rsh) | ((Pixel)LinearToSrgb[g] << sh.gsh) | ((Pixel)LinearToSrgb[b] << sh.bsh) | mask);
+}
+
+static void blend_opaque_t_scalar(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh, uint32_t an) {
+  uint32_t r, g, b, ra;
+  ra = 65536 - an;
+  UNROLL(rem,
+	 r = ((uint32_t)SrgbToLinear[(*src >> sh.rsh) & 255] * an +
+	      (uint32_t)SrgbToLinear[(*dst >> sh.rsh) & 255] * ra) >> 16;
+	 g = ((uint32_t)SrgbToLinear[(*src >> sh.gsh) & 255] * an +
+	      (uint32_t)SrgbToLinear[(*dst >> sh.gsh) & 255] * ra) >> 16;
+	 b = ((uint32_t)SrgbToLinear[(*src >> sh.bsh) & 255] * an +
+	      (uint32_t)SrgbToLinear[(*dst >> sh.bsh) & 255] * ra) >> 16;
+	 *dst = ((Pixel)LinearToSrgb[r] << sh.rsh) | ((Pixel)LinearToSrgb[g] << sh.gsh) | ((Pixel)LinearToSrgb[b] << sh.bsh);
+	 ++src; ++dst);
+}
+
+/* Premultiplied sources only need the destination scaled; the source's color
+   is already what it contributes. Requantizing the premultiplied color can
+   push the sum just past full intensity, hence the clamps. */
+static void blend_premul_scalar(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh) {
+  Pixel mask = 255 << sh.ash;
+  uint32_t r, g, b, a, ra;
+  UNROLL(rem,
+	 a = (*src >> sh.ash) & 255;
+	 if(a == 0) *dst |= mask;
+	 else if(a == 255) *dst = *src;
+	 else {
+	   a += a & 1;
+	   ra = 256-a;
+	   r = (uint32_t)SrgbToLinear[(*src >> sh.rsh) & 255] +
+	     (((uint32_t)SrgbToLinear[(*dst >> sh.rsh) & 255] * ra) >> 8);
+	   g = (uint32_t)SrgbToLinear[(*src >> sh.gsh) & 255] +
+	     (((uint32_t)SrgbToLinear[(*dst >> sh.gsh) & 255] * ra) >> 8);
+	   b = (uint32_t)SrgbToLinear[(*src >> sh.bsh) & 255] +
+	     (((uint32_t)SrgbToLinear[(*dst >> sh.bsh) & 255] * ra) >> 8);
+	   if(r > 65535) r = 65535;
+	   if(g > 65535) g = 65535;
+	   if(b > 65535) b = 65535;
+	   *dst = ((Pixel)LinearToSrgb[r] << sh.rsh) | ((Pixel)LinearToSrgb[g] << sh.gsh) | ((Pixel)LinearToSrgb[b] << sh.bsh) | mask;
+	 }
+	 ++src; ++dst);
+}
+
+static void blend_premul_t_scalar(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh, uint32_t an) {
+  Pixel mask = 255 << sh.ash;
+  uint32_t r, g, b, a, ra;
+  UNROLL(rem,
+	 a = (*src >> sh.ash) & 255;
+	 if(a == 0) *dst |= mask;
+	 else {
+	   a += a & 1;
+	   a = (a * an) >> 8;
+	   ra = 65536-a;
+	   // the source term can't be bounded by a, so this may not fit in 32 bits
+	   r = ((uint64_t)SrgbToLinear[(*src >> sh.rsh) & 255] * an +
+		(uint64_t)SrgbToLinear[(*dst >> sh.rsh) & 255] * ra) >> 16;
+	   g = ((uint64_t)SrgbToLinear[(*src >> sh.gsh) & 255] * an +
+		(uint64_t)SrgbToLinear[(*dst >> sh.gsh) & 255] * ra) >> 16;
+	   b = ((uint64_t)SrgbToLinear[(*src >> sh.bsh) & 255] * an +
+		(uint64_t)SrgbToLinear[(*dst >> sh.bsh) & 255] * ra) >> 16;
+	   if(r > 65535) r = 65535;
+	   if(g > 65535) g = 65535;
+	   if(b > 65535) b = 65535;
+	   *dst = ((Pixel)LinearToSrgb[r] << sh.rsh) | ((Pixel)LinearToSrgb[g] << sh.gsh) | ((Pixel)LinearToSrgb[b] << sh.bsh) | mask;
+	 }
+	 ++src; ++dst);
+}
+
+static void frisket_modulate_scalar(Frixel*restrict dst, const Frixel*restrict src, size_t rem) {
+  UNROLL_MORE(rem,
+	      *dst = (*src++ * *dst) / 255;
+	      ++dst;);
+}
+
+static void frisket_add_scalar(Frixel*restrict dst, const Frixel*restrict src, size_t rem) {
+  int res;
+  UNROLL_MORE(rem,
+	      res = *src++ + *dst;
+	      if(res > 255) *dst++ = 255;
+	      else *dst++ = res;);
+}
+
+static void frisket_subtract_scalar(Frixel*restrict dst, const Frixel*restrict src, size_t rem) {
+  int res;
+  UNROLL_MORE(rem,
+	      res = *dst - *src++;
+	      if(res < 0) *dst++ = 0;
+	      else *dst++ = res;);
+}
+
+static void frisket_min_scalar(Frixel*restrict dst, const Frixel*restrict src, size_t rem) {
+  UNROLL_MORE(rem,
+	      *dst = *src > *dst ? *dst : *src;
+	      ++src; ++dst;);
+}
+
+static void frisket_max_scalar(Frixel*restrict dst, const Frixel*restrict src, size_t rem) {
+  UNROLL_MORE(rem,
+	      *dst = *src < *dst ? *dst : *src;
+	      ++src; ++dst;);
+}
+
+/* The layout changes are the same shifts and masks at every width, so these
+   are written once and instantiated for scalars and each vector type. */
+#define SWIZZLE_ENDIAN_OP(p, SHL, SHR, AND, OR, K)			\
+  OR(OR(SHR(p, 24), AND(SHR(p, 8), K(0xFF00))), OR(AND(SHL(p, 8), K(0xFF0000)), SHL(p, 24)))
+#define SWIZZLE_ROTATE_RIGHT_OP(p, SHL, SHR, AND, OR, K) OR(SHR(p, 8), SHL(p, 24))
+#define SWIZZLE_ROTATE_LEFT_OP(p, SHL, SHR, AND, OR, K) OR(SHL(p, 8), SHR(p, 24))
+#define SWIZZLE_SWAP_EVEN_OP(p, SHL, SHR, AND, OR, K)			\
+  OR(AND(p, K(0x00FF00FF)), OR(AND(SHR(p, 16), K(0x0000FF00)), AND(SHL(p, 16), K(0xFF000000))))
+#define SWIZZLE_SWAP_ODD_OP(p, SHL, SHR, AND, OR, K)			\
+  OR(AND(p, K(0xFF00FF00)), OR(AND(SHR(p, 16), K(0x000000FF)), AND(SHL(p, 16), K(0x00FF0000))))
+
+#define S_SHL(p, n) ((p) << (n))
+#define S_SHR(p, n) ((p) >> (n))
+#define S_AND(a, b) ((a) & (b))
+#define S_OR(a, b) ((a) | (b))
+#define S_K(k) ((Pixel)(k))
+#define SWIZZLE_SCALAR(name, OP)					\
+static void swizzle_##name##_scalar(Pixel* dst, const Pixel* src, size_t rem) { \
+  Pixel p;								\
+  UNROLL_MORE(rem,							\
+	      p = *src++;						\
+	      *dst++ = OP(p, S_SHL, S_SHR, S_AND, S_OR, S_K););		\
+}
+SWIZZLE_SCALAR(endian, SWIZZLE_ENDIAN_OP)
+SWIZZLE_SCALAR(rotate_right, SWIZZLE_ROTATE_RIGHT_OP)
+SWIZZLE_SCALAR(rotate_left, SWIZZLE_ROTATE_LEFT_OP)
+SWIZZLE_SCALAR(swap_even, SWIZZLE_SWAP_EVEN_OP)
+SWIZZLE_SCALAR(swap_odd, SWIZZLE_SWAP_ODD_OP)
+#undef SWIZZLE_SCALAR
+#undef S_SHL
+#undef S_SHR
+#undef S_AND
+#undef S_OR
+#undef S_K
+
+const BlitKernels SubCritical::scalar_blit_kernels = {
+  "scalar",
+  blend_alpha_scalar,
+  blend_simple_t_scalar,
+  blend_alpha_t_scalar,
+  blend_opaque_t_scalar,
+  blend_premul_scalar,
+  blend_premul_t_scalar,
+  frisket_modulate_scalar,
+  frisket_add_scalar,
+  frisket_subtract_scalar,
+  frisket_min_scalar,
+  frisket_max_scalar,
+  {swizzle_endian_scalar, swizzle_rotate_right_scalar, swizzle_rotate_left_scalar,
+   swizzle_swap_even_scalar, swizzle_swap_odd_scalar},
+};
+
+#if BLIT_X86
+
+/* A fully transparent source pixel leaves the destination's color alone and a
+   fully opaque one replaces it, since LinearToSrgb[SrgbToLinear[x]] == x for
+   every x. Sprites are mostly one or the other, so whole groups of either kind
+   skip the math. */
+
+/*** SSE2 ***/
+
+/* Unpack the three color channels of four pixels and look them up; the
+   result holds R0-R3,G0-G3 in rg and B0-B3 in the low half of bb. */
+SSE2_TARGET static inline void linearize_sse2(const Pixel* p, PixelShifts sh, __m128i& rg, __m128i& bb) {
+  rg = _mm_setr_epi16(SrgbToLinear[(p[0] >> sh.rsh) & 255],
+		      SrgbToLinear[(p[1] >> sh.rsh) & 255],
+		      SrgbToLinear[(p[2] >> sh.rsh) & 255],
+		      SrgbToLinear[(p[3] >> sh.rsh) & 255],
+		      SrgbToLinear[(p[0] >> sh.gsh) & 255],
+		      SrgbToLinear[(p[1] >> sh.gsh) & 255],
+		      SrgbToLinear[(p[2] >> sh.gsh) & 255],
+		      SrgbToLinear[(p[3] >> sh.gsh) & 255]);
+  bb = _mm_setr_epi16(SrgbToLinear[(p[0] >> sh.bsh) & 255],
+		      SrgbToLinear[(p[1] >> sh.bsh) & 255],
+		      SrgbToLinear[(p[2] >> sh.bsh) & 255],
+		      SrgbToLinear[(p[3] >> sh.bsh) & 255],
+		      0, 0, 0, 0);
+}
+
+/* Full 32-bit products of unsigned 16-bit lanes; lo gets lanes 0-3, hi gets
+   lanes 4-7. */
+SSE2_TARGET static inline void mul_u16_sse2(__m128i x, __m128i y, __m128i& lo, __m128i& hi) {
+  __m128i pl = _mm_mullo_epi16(x, y);
+  __m128i ph = _mm_mulhi_epu16(x, y);
+  lo = _mm_unpacklo_epi16(pl, ph);
+  hi = _mm_unpackhi_epi16(pl, ph);
+}
+
+/* x*w + y*v for the channels in rg/bb, shifted right by shift. */
+SSE2_TARGET static inline void lerp_sse2(__m128i srg, __m128i sbb, __m128i w, __m128i drg, __m128i dbb, __m128i v, int shift, __m128i& r, __m128i& g, __m128i& b) {
+  __m128i sr, sg, sb, dr, dg, db, junk;
+  mul_u16_sse2(srg, w, sr, sg);
+  mul_u16_sse2(sbb, w, sb, junk);
+  mul_u16_sse2(drg, v, dr, dg);
+  mul_u16_sse2(dbb, v, db, junk);
+  __m128i count = _mm_cvtsi32_si128(shift);
+  r = _mm_srl_epi32(_mm_add_epi32(sr, dr), count);
+  g = _mm_srl_epi32(_mm_add_epi32(sg, dg), count);
+  b = _mm_srl_epi32(_mm_add_epi32(sb, db), count);
+}
+
+/* Look up and pack four output pixels. */
+SSE2_TARGET static inline void delinearize_sse2(Pixel* out, __m128i r, __m128i g, __m128i b, PixelShifts sh, Pixel mask) {
+  uint32_t rr[4], gg[4], bb[4];
+  _mm_storeu_si128((__m128i*)rr, r);
+  _mm_storeu_si128((__m128i*)gg, g);
+  _mm_storeu_si128((__m128i*)bb, b);
+  for(int n = 0; n < 4; ++n)
+    out[n] = ((Pixel)LinearToSrgb[rr[n]] << sh.rsh) | ((Pixel)LinearToSrgb[gg[n]] << sh.gsh) | ((Pixel)LinearToSrgb[bb[n]] << sh.bsh) | mask;
+}
+
+/* Alpha (0-255) of four pixels, with a += a & 1 applied, in 32-bit lanes. */
+SSE2_TARGET static inline __m128i alpha_sse2(__m128i s, __m128i ashc) {
+  __m128i a = _mm_and_si128(_mm_srl_epi32(s, ashc), _mm_set1_epi32(255));
+  return _mm_add_epi32(a, _mm_and_si128(a, _mm_set1_epi32(1)));
+}
+
+SSE2_TARGET static void blend_alpha_sse2(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh) {
+  const Pixel mask = 255 << sh.ash;
+  const __m128i vmask = _mm_set1_epi32(mask);
+  const __m128i ashc = _mm_cvtsi32_si128(sh.ash);
+  const __m128i v256 = _mm_set1_epi16(256);
+  while(rem >= 4) {
+    __m128i s = _mm_loadu_si128((const __m128i*)src);
+    __m128i d = _mm_loadu_si128((const __m128i*)dst);
+    __m128i sa = _mm_and_si128(s, vmask);
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(sa, _mm_setzero_si128())) == 0xFFFF)
+      _mm_storeu_si128((__m128i*)dst, _mm_or_si128(d, vmask));
+    else if(_mm_movemask_epi8(_mm_cmpeq_epi32(sa, vmask)) == 0xFFFF)
+      _mm_storeu_si128((__m128i*)dst, s);
+    else {
+      __m128i a = alpha_sse2(s, ashc);
+      a = _mm_packs_epi32(a, a);
+      __m128i ra = _mm_sub_epi16(v256, a);
+      __m128i srg, sbb, drg, dbb, r, g, b;
+      linearize_sse2(src, sh, srg, sbb);
+      linearize_sse2(dst, sh, drg, dbb);
+      lerp_sse2(srg, sbb, a, drg, dbb, ra, 8, r, g, b);
+      delinearize_sse2(dst, r, g, b, sh, mask);
+    }
+    src += 4; dst += 4; rem -= 4;
+  }
+  if(rem) blend_alpha_scalar(dst, src, rem, sh);
+}
+
+SSE2_TARGET static void blend_simple_t_sse2(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh, uint32_t an) {
+  const Pixel mask = 0xFF << sh.ash;
+  const __m128i vmask = _mm_set1_epi32(mask);
+  // an is 1-65535, so both of these fit in 16 bits
+  const __m128i van = _mm_set1_epi16((int16_t)an);
+  const __m128i vra = _mm_set1_epi16((int16_t)(65536 - an));
+  while(rem >= 4) {
+    __m128i s = _mm_loadu_si128((const __m128i*)src);
+    __m128i clear = _mm_cmpeq_epi32(_mm_and_si128(s, vmask), _mm_setzero_si128());
+    int clearmask = _mm_movemask_epi8(clear);
+    if(clearmask != 0xFFFF) {
+      __m128i d = _mm_loadu_si128((const __m128i*)dst);
+      __m128i srg, sbb, drg, dbb, r, g, b;
+      Pixel out[4];
+      linearize_sse2(src, sh, srg, sbb);
+      linearize_sse2(dst, sh, drg, dbb);
+      lerp_sse2(srg, sbb, van, drg, dbb, vra, 16, r, g, b);
+      delinearize_sse2(out, r, g, b, sh, mask);
+      __m128i o = _mm_loadu_si128((const __m128i*)out);
+      o = _mm_or_si128(_mm_and_si128(clear, d), _mm_andnot_si128(clear, o));
+      _mm_storeu_si128((__m128i*)dst, o);
+    }
+    src += 4; dst += 4; rem -= 4;
+  }
+  if(rem) blend_simple_t_scalar(dst, src, rem, sh, an);
+}
+
+SSE2_TARGET static void blend_alpha_t_sse2(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh, uint32_t an) {
+  const Pixel mask = 0xFF << sh.ash;
+  const __m128i vmask = _mm_set1_epi32(mask);
+  const __m128i ashc = _mm_cvtsi32_si128(sh.ash);
+  const __m128i van = _mm_set1_epi16((int16_t)an);
+  const __m128i v65535 = _mm_set1_epi16(-1);
+  while(rem >= 4) {
+    __m128i s = _mm_loadu_si128((const __m128i*)src);
+    __m128i d = _mm_loadu_si128((const __m128i*)dst);
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, vmask), _mm_setzero_si128())) == 0xFFFF)
+      _mm_storeu_si128((__m128i*)dst, _mm_or_si128(d, vmask));
+    else {
+      // a = (a * an) >> 8, at most 65535
+      __m128i a = alpha_sse2(s, ashc), lo, hi;
+      a = _mm_packs_epi32(a, a);
+      mul_u16_sse2(a, van, lo, hi);
+      a = _mm_srli_epi32(lo, 8);
+      // Shift the 16-bit results down into the low half, with no saturation
+      a = _mm_shufflelo_epi16(a, _MM_SHUFFLE(3,1,2,0));
+      a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3,1,2,0));
+      a = _mm_shuffle_epi32(a, _MM_SHUFFLE(2,0,2,0));
+      /* ra = 65536 - a can itself be 65536, which doesn't fit. Instead, use
+	 65535 - a and add one more d to the sum. */
+      __m128i ra = _mm_sub_epi16(v65535, a);
+      __m128i srg, sbb, drg, dbb, r, g, b;
+      linearize_sse2(src, sh, srg, sbb);
+      linearize_sse2(dst, sh, drg, dbb);
+      __m128i sr, sg, sb, dr, dg, db, junk;
+      mul_u16_sse2(srg, a, sr, sg);
+      mul_u16_sse2(sbb, a, sb, junk);
+      mul_u16_sse2(drg, ra, dr, dg);
+      mul_u16_sse2(dbb, ra, db, junk);
+      __m128i zero = _mm_setzero_si128();
+      r = _mm_add_epi32(_mm_add_epi32(sr, dr), _mm_unpacklo_epi16(drg, zero));
+      g = _mm_add_epi32(_mm_add_epi32(sg, dg), _mm_unpackhi_epi16(drg, zero));
+      b = _mm_add_epi32(_mm_add_epi32(sb, db), _mm_unpacklo_epi16(dbb, zero));
+      r = _mm_srli_epi32(r, 16);
+      g = _mm_srli_epi32(g, 16);
+      b = _mm_srli_epi32(b, 16);
+      delinearize_sse2(dst, r, g, b, sh, mask);
+    }
+    src += 4; dst += 4; rem -= 4;
+  }
+  if(rem) blend_alpha_t_scalar(dst, src, rem, sh, an);
+}
+
+SSE2_TARGET static void blend_opaque_t_sse2(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh, uint32_t an) {
+  const __m128i van = _mm_set1_epi16((int16_t)an);
+  const __m128i vra = _mm_set1_epi16((int16_t)(65536 - an));
+  while(rem >= 4) {
+    __m128i srg, sbb, drg, dbb, r, g, b;
+    linearize_sse2(src, sh, srg, sbb);
+    linearize_sse2(dst, sh, drg, dbb);
+    lerp_sse2(srg, sbb, van, drg, dbb, vra, 16, r, g, b);
+    delinearize_sse2(dst, r, g, b, sh, 0);
+    src += 4; dst += 4; rem -= 4;
+  }
+  if(rem) blend_opaque_t_scalar(dst, src, rem, sh, an);
+}
+
+SSE2_TARGET static void blend_premul_sse2(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh) {
+  const Pixel mask = 255 << sh.ash;
+  const __m128i vmask = _mm_set1_epi32(mask);
+  const __m128i ashc = _mm_cvtsi32_si128(sh.ash);
+  const __m128i v256 = _mm_set1_epi16(256);
+  const __m128i v65535 = _mm_set1_epi32(65535);
+  while(rem >= 4) {
+    __m128i s = _mm_loadu_si128((const __m128i*)src);
+    __m128i d = _mm_loadu_si128((const __m128i*)dst);
+    __m128i sa = _mm_and_si128(s, vmask);
+    __m128i clear = _mm_cmpeq_epi32(sa, _mm_setzero_si128());
+    int clearmask = _mm_movemask_epi8(clear);
+    if(clearmask == 0xFFFF)
+      _mm_storeu_si128((__m128i*)dst, _mm_or_si128(d, vmask));
+    else if(_mm_movemask_epi8(_mm_cmpeq_epi32(sa, vmask)) == 0xFFFF)
+      _mm_storeu_si128((__m128i*)dst, s);
+    else {
+      // an opaque pixel comes out unchanged on its own, a clear one doesn't
+      __m128i ra = alpha_sse2(s, ashc);
+      ra = _mm_sub_epi16(v256, _mm_packs_epi32(ra, ra));
+      __m128i srg, sbb, drg, dbb, dr, dg, db, junk;
+      linearize_sse2(src, sh, srg, sbb);
+      linearize_sse2(dst, sh, drg, dbb);
+      mul_u16_sse2(drg, ra, dr, dg);
+      mul_u16_sse2(dbb, ra, db, junk);
+      __m128i zero = _mm_setzero_si128();
+      __m128i r = _mm_add_epi32(_mm_srli_epi32(dr, 8), _mm_unpacklo_epi16(srg, zero));
+      __m128i g = _mm_add_epi32(_mm_srli_epi32(dg, 8), _mm_unpackhi_epi16(srg, zero));
+      __m128i b = _mm_add_epi32(_mm_srli_epi32(db, 8), _mm_unpacklo_epi16(sbb, zero));
+      __m128i over;
+      over = _mm_cmpgt_epi32(r, v65535);
+      r = _mm_or_si128(_mm_andnot_si128(over, r), _mm_and_si128(over, v65535));
+      over = _mm_cmpgt_epi32(g, v65535);
+      g = _mm_or_si128(_mm_andnot_si128(over, g), _mm_and_si128(over, v65535));
+      over = _mm_cmpgt_epi32(b, v65535);
+      b = _mm_or_si128(_mm_andnot_si128(over, b), _mm_and_si128(over, v65535));
+      Pixel out[4];
+      delinearize_sse2(out, r, g, b, sh, mask);
+      __m128i o = _mm_loadu_si128((const __m128i*)out);
+      o = _mm_or_si128(_mm_and_si128(clear, _mm_or_si128(d, vmask)), _mm_andnot_si128(clear, o));
+      _mm_storeu_si128((__m128i*)dst, o);
+    }
+    src += 4; dst += 4; rem -= 4;
+  }
+  if(rem) blend_premul_scalar(dst, src, rem, sh);
+}
+
+/* x / 255, truncated, for x in 0-65025 (any product of two frixels) in
+   16-bit lanes: (x + 1 + (x >> 8)) >> 8 is exact over that whole range. */
+SSE2_TARGET static inline __m128i div255_sse2(__m128i x) {
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+}
+
+SSE2_TARGET static void frisket_modulate_sse2(Frixel*restrict dst, const Frixel*restrict src, size_t rem) {
+  const __m128i zero = _mm_setzero_si128();
+  while(rem >= 16) {
+    __m128i s = _mm_loadu_si128((const __m128i*)src);
+    __m128i d = _mm_loadu_si128((const __m128i*)dst);
+    __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+    __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+    _mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(div255_sse2(lo), div255_sse2(hi)));
+    src += 16; dst += 16; rem -= 16;
+  }
+  if(rem) frisket_modulate_scalar(dst, src, rem);
+}
+
+/* The rest are a single saturating or min/max instruction per 16 frixels. */
+#define FRISKET_SSE2(name, op) \
+SSE2_TARGET static void frisket_##name##_sse2(Frixel*restrict dst, const Frixel*restrict src, size_t rem) { \
+  while(rem >= 16) { \
+    __m128i s = _mm_loadu_si128((const __m128i*)src); \
+    __m128i d = _mm_loadu_si128((const __m128i*)dst); \
+    _mm_storeu_si128((__m128i*)dst, op(d, s)); \
+    src += 16; dst += 16; rem -= 16; \
+  } \
+  if(rem) frisket_##name##_scalar(dst, src, rem); \
+}
+FRISKET_SSE2(add, _mm_adds_epu8)
+FRISKET_SSE2(subtract, _mm_subs_epu8)
+FRISKET_SSE2(min, _mm_min_epu8)
+FRISKET_SSE2(max, _mm_max_epu8)
+#undef FRISKET_SSE2
+
+#define V_SHL(p, n) _mm_slli_epi32(p, n)
+#define V_SHR(p, n) _mm_srli_epi32(p, n)
+#define V_K(k) _mm_set1_epi32((int)(k))
+#define SWIZZLE_SSE2(name, OP)						\
+SSE2_TARGET static void swizzle_##name##_sse2(Pixel* dst, const Pixel* src, size_t rem) { \
+  for(; rem >= 4; rem -= 4, src += 4, dst += 4) {			\
+    __m128i p = _mm_loadu_si128((const __m128i*)src);			\
+    _mm_storeu_si128((__m128i*)dst, OP(p, V_SHL, V_SHR, _mm_and_si128, _mm_or_si128, V_K)); \
+  }									\
+  if(rem) swizzle_##name##_scalar(dst, src, rem);			\
+}
+SWIZZLE_SSE2(endian, SWIZZLE_ENDIAN_OP)
+SWIZZLE_SSE2(rotate_right, SWIZZLE_ROTATE_RIGHT_OP)
+SWIZZLE_SSE2(rotate_left, SWIZZLE_ROTATE_LEFT_OP)
+SWIZZLE_SSE2(swap_even, SWIZZLE_SWAP_EVEN_OP)
+SWIZZLE_SSE2(swap_odd, SWIZZLE_SWAP_ODD_OP)
+#undef SWIZZLE_SSE2
+#undef V_SHL
+#undef V_SHR
+#undef V_K
+
+static const BlitKernels sse2_blit_kernels = {
+  "SSE2",
+  blend_alpha_sse2,
+  blend_simple_t_sse2,
+  blend_alpha_t_sse2,
+  blend_opaque_t_sse2,
+  blend_premul_sse2,
+  blend_premul_t_scalar,
+  frisket_modulate_sse2,
+  frisket_add_sse2,
+  frisket_subtract_sse2,
+  frisket_min_sse2,
+  frisket_max_sse2,
+  {swizzle_endian_sse2, swizzle_rotate_right_sse2, swizzle_rotate_left_sse2,
+   swizzle_swap_even_sse2, swizzle_swap_odd_sse2},
+};
+
+/*** AVX2 ***/
+
+/* SrgbToLinear widened to 32 bits, so that a gather never reads past the end
+   of the table. Filled in before the AVX2 kernels are chosen. */
+static uint32_t SrgbToLinear32[256];
+
+AVX2_TARGET static inline __m256i linearize_avx2(__m256i p, int shift) {
+  __m256i i = _mm256_and_si256(_mm256_srl_epi32(p, _mm_cvtsi32_si128(shift)), _mm256_set1_epi32(255));
+  return _mm256_i32gather_epi32((const int*)SrgbToLinear32, i, 4);
+}
+
+AVX2_TARGET static inline void delinearize_avx2(Pixel* out, __m256i r, __m256i g, __m256i b, PixelShifts sh, Pixel mask) {
+  uint32_t rr[8], gg[8], bb[8];
+  _mm256_storeu_si256((__m256i*)rr, r);
+  _mm256_storeu_si256((__m256i*)gg, g);
+  _mm256_storeu_si256((__m256i*)bb, b);
+  for(int n = 0; n < 8; ++n)
+    out[n] = ((Pixel)LinearToSrgb[rr[n]] << sh.rsh) | ((Pixel)LinearToSrgb[gg[n]] << sh.gsh) | ((Pixel)LinearToSrgb[bb[n]] << sh.bsh) | mask;
+}
+
+/* (x*w + y*v) >> shift, per channel. Every product and sum fits in 32 unsigned
+   bits, so the low half of the multiply is the whole answer. */
+AVX2_TARGET static inline void lerp_avx2(__m256i s, __m256i w, __m256i d, __m256i v, int shift, PixelShifts sh, __m256i& r, __m256i& g, __m256i& b) {
+  __m128i count = _mm_cvtsi32_si128(shift);
+  r = _mm256_srl_epi32(_mm256_add_epi32(_mm256_mullo_epi32(linearize_avx2(s, sh.rsh), w),
+					_mm256_mullo_epi32(linearize_avx2(d, sh.rsh), v)), count);
+  g = _mm256_srl_epi32(_mm256_add_epi32(_mm256_mullo_epi32(linearize_avx2(s, sh.gsh), w),
+					_mm256_mullo_epi32(linearize_avx2(d, sh.gsh), v)), count);
+  b = _mm256_srl_epi32(_mm256_add_epi32(_mm256_mullo_epi32(linearize_avx2(s, sh.bsh), w),
+					_mm256_mullo_epi32(linearize_avx2(d, sh.bsh), v)), count);
+}
+
+AVX2_TARGET static inline __m256i alpha_avx2(__m256i s, int ash) {
+  __m256i a = _mm256_and_si256(_mm256_srl_epi32(s, _mm_cvtsi32_si128(ash)), _mm256_set1_epi32(255));
+  return _mm256_add_epi32(a, _mm256_and_si256(a, _mm256_set1_epi32(1)));
+}
+
+AVX2_TARGET static void blend_alpha_avx2(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh) {
+  const Pixel mask = 255 << sh.ash;
+  const __m256i vmask = _mm256_set1_epi32(mask);
+  const __m256i v256 = _mm256_set1_epi32(256);
+  while(rem >= 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)src);
+    __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+    __m256i sa = _mm256_and_si256(s, vmask);
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, _mm256_setzero_si256())) == -1)
+      _mm256_storeu_si256((__m256i*)dst, _mm256_or_si256(d, vmask));
+    else if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, vmask)) == -1)
+      _mm256_storeu_si256((__m256i*)dst, s);
+    else {
+      __m256i a = alpha_avx2(s, sh.ash);
+      __m256i r, g, b;
+      lerp_avx2(s, a, d, _mm256_sub_epi32(v256, a), 8, sh, r, g, b);
+      delinearize_avx2(dst, r, g, b, sh, mask);
+    }
+    src += 8; dst += 8; rem -= 8;
+  }
+  if(rem) blend_alpha_sse2(dst, src, rem, sh);
+}
+
+AVX2_TARGET static void blend_simple_t_avx2(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh, uint32_t an) {
+  const Pixel mask = 0xFF << sh.ash;
+  const __m256i vmask = _mm256_set1_epi32(mask);
+  const __m256i van = _mm256_set1_epi32(an);
+  const __m256i vra = _mm256_set1_epi32(65536 - an);
+  while(rem >= 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)src);
+    __m256i clear = _mm256_cmpeq_epi32(_mm256_and_si256(s, vmask), _mm256_setzero_si256());
+    if(_mm256_movemask_epi8(clear) != -1) {
+      __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+      __m256i r, g, b;
+      Pixel out[8];
+      lerp_avx2(s, van, d, vra, 16, sh, r, g, b);
+      delinearize_avx2(out, r, g, b, sh, mask);
+      __m256i o = _mm256_loadu_si256((const __m256i*)out);
+      _mm256_storeu_si256((__m256i*)dst, _mm256_blendv_epi8(o, d, clear));
+    }
+    src += 8; dst += 8; rem -= 8;
+  }
+  if(rem) blend_simple_t_sse2(dst, src, rem, sh, an);
+}
+
+AVX2_TARGET static void blend_alpha_t_avx2(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh, uint32_t an) {
+  const Pixel mask = 0xFF << sh.ash;
+  const __m256i vmask = _mm256_set1_epi32(mask);
+  const __m256i van = _mm256_set1_epi32(an);
+  const __m256i v65536 = _mm256_set1_epi32(65536);
+  while(rem >= 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)src);
+    __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(s, vmask), _mm256_setzero_si256())) == -1)
+      _mm256_storeu_si256((__m256i*)dst, _mm256_or_si256(d, vmask));
+    else {
+      __m256i a = _mm256_srli_epi32(_mm256_mullo_epi32(alpha_avx2(s, sh.ash), van), 8);
+      __m256i r, g, b;
+      lerp_avx2(s, a, d, _mm256_sub_epi32(v65536, a), 16, sh, r, g, b);
+      delinearize_avx2(dst, r, g, b, sh, mask);
+    }
+    src += 8; dst += 8; rem -= 8;
+  }
+  if(rem) blend_alpha_t_sse2(dst, src, rem, sh, an);
+}
+
+AVX2_TARGET static void blend_opaque_t_avx2(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh, uint32_t an) {
+  const __m256i van = _mm256_set1_epi32(an);
+  const __m256i vra = _mm256_set1_epi32(65536 - an);
+  while(rem >= 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)src);
+    __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+    __m256i r, g, b;
+    lerp_avx2(s, van, d, vra, 16, sh, r, g, b);
+    delinearize_avx2(dst, r, g, b, sh, 0);
+    src += 8; dst += 8; rem -= 8;
+  }
+  if(rem) blend_opaque_t_sse2(dst, src, rem, sh, an);
+}
+
+AVX2_TARGET static void blend_premul_avx2(Pixel*restrict dst, const Pixel*restrict src, size_t rem, PixelShifts sh) {
+  const Pixel mask = 255 << sh.ash;
+  const __m256i vmask = _mm256_set1_epi32(mask);
+  const __m256i v256 = _mm256_set1_epi32(256);
+  const __m256i v65535 = _mm256_set1_epi32(65535);
+  const __m128i eight = _mm_cvtsi32_si128(8);
+  while(rem >= 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)src);
+    __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+    __m256i sa = _mm256_and_si256(s, vmask);
+    __m256i clear = _mm256_cmpeq_epi32(sa, _mm256_setzero_si256());
+    if(_mm256_movemask_epi8(clear) == -1)
+      _mm256_storeu_si256((__m256i*)dst, _mm256_or_si256(d, vmask));
+    else if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, vmask)) == -1)
+      _mm256_storeu_si256((__m256i*)dst, s);
+    else {
+      __m256i ra = _mm256_sub_epi32(v256, alpha_avx2(s, sh.ash));
+      __m256i r, g, b;
+      r = _mm256_add_epi32(linearize_avx2(s, sh.rsh), _mm256_srl_epi32(_mm256_mullo_epi32(linearize_avx2(d, sh.rsh), ra), eight));
+      g = _mm256_add_epi32(linearize_avx2(s, sh.gsh), _mm256_srl_epi32(_mm256_mullo_epi32(linearize_avx2(d, sh.gsh), ra), eight));
+      b = _mm256_add_epi32(linearize_avx2(s, sh.bsh), _mm256_srl_epi32(_mm256_mullo_epi32(linearize_avx2(d, sh.bsh), ra), eight));
+      r = _mm256_min_epu32(r, v65535);
+      g = _mm256_min_epu32(g, v65535);
+      b = _mm256_min_epu32(b, v65535);
+      Pixel out[8];
+      delinearize_avx2(out, r, g, b, sh, mask);
+      __m256i o = _mm256_loadu_si256((const __m256i*)out);
+      _mm256_storeu_si256((__m256i*)dst, _mm256_blendv_epi8(o, _mm256_or_si256(d, vmask), clear));
+    }
+    src += 8; dst += 8; rem -= 8;
+  }
+  if(rem) blend_premul_sse2(dst, src, rem, sh);
+}
+
+AVX2_TARGET static inline __m256i div255_avx2(__m256i x) {
+  return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, _mm256_set1_epi16(1)), _mm256_srli_epi16(x, 8)), 8);
+}
+
+/* unpack/pack work within 128-bit lanes, so the bytes come back out in the
+   order they went in */
+AVX2_TARGET static void frisket_modulate_avx2(Frixel*restrict dst, const Frixel*restrict src, size_t rem) {
+  const __m256i zero = _mm256_setzero_si256();
+  while(rem >= 32) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)src);
+    __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+    __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+    __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+    _mm256_storeu_si256((__m256i*)dst, _mm256_packus_epi16(div255_avx2(lo), div255_avx2(hi)));
+    src += 32; dst += 32; rem -= 32;
+  }
+  if(rem) frisket_modulate_sse2(dst, src, rem);
+}
+
+#define FRISKET_AVX2(name, op) \
+AVX2_TARGET static void frisket_##name##_avx2(Frixel*restrict dst, const Frixel*restrict src, size_t rem) { \
+  while(rem >= 32) { \
+    __m256i s = _mm256_loadu_si256((const __m256i*)src); \
+    __m256i d = _mm256_loadu_si256((const __m256i*)dst); \
+    _mm256_storeu_si256((__m256i*)dst, op(d, s)); \
+    src += 32; dst += 32; rem -= 32; \
+  } \
+  if(rem) frisket_##name##_sse2(dst, src, rem); \
+}
+FRISKET_AVX2(add, _mm256_adds_epu8)
+FRISKET_AVX2(subtract, _mm256_subs_epu8)
+FRISKET_AVX2(min, _mm256_min_epu8)
+FRISKET_AVX2(max, _mm256_max_epu8)
+#undef FRISKET_AVX2
+
+/* x86 is little-endian, so every layout change is a fixed shuffle of the
+   bytes of each pixel; order[n] is the old byte that becomes byte n. */
+#define SWIZZLE_AVX2(name, b0, b1, b2, b3)				\
+AVX2_TARGET static void swizzle_##name##_avx2(Pixel* dst, const Pixel* src, size_t rem) { \
+  const __m256i order = _mm256_setr_epi8(b0, b1, b2, b3, b0+4, b1+4, b2+4, b3+4, \
+					 b0+8, b1+8, b2+8, b3+8, b0+12, b1+12, b2+12, b3+12, \
+					 b0, b1, b2, b3, b0+4, b1+4, b2+4, b3+4, \
+					 b0+8, b1+8, b2+8, b3+8, b0+12, b1+12, b2+12, b3+12); \
+  for(; rem >= 8; rem -= 8, src += 8, dst += 8) {			\
+    __m256i p = _mm256_loadu_si256((const __m256i*)src);		\
+    _mm256_storeu_si256((__m256i*)dst, _mm256_shuffle_epi8(p, order));	\
+  }									\
+  if(rem) swizzle_##name##_sse2(dst, src, rem);				\
+}
+SWIZZLE_AVX2(endian, 3, 2, 1, 0)
+SWIZZLE_AVX2(rotate_right, 1, 2, 3, 0)
+SWIZZLE_AVX2(rotate_left, 3, 0, 1, 2)
+SWIZZLE_AVX2(swap_even, 0, 3, 2, 1)
+SWIZZLE_AVX2(swap_odd, 2, 1, 0, 3)
+#undef SWIZZLE_AVX2
+
+static const BlitKernels avx2_blit_kernels = {
+  "AVX2",
+  blend_alpha_avx2,
+  blend_simple_t_avx2,
+  blend_alpha_t_avx2,
+  blend_opaque_t_avx2,
+  blend_premul_avx2,
+  blend_premul_t_scalar,
+  frisket_modulate_avx2,
+  frisket_add_avx2,
+  frisket_subtract_avx2,
+  frisket_min_avx2,
+  frisket_max_avx2,
+  {swizzle_endian_avx2, swizzle_rotate_right_avx2, swizzle_rotate_left_avx2,
+   swizzle_swap_even_avx2, swizzle_swap_odd_avx2},
+};
+
+#endif
+
+static const BlitKernels* PickBlitKernels() {
+#if BLIT_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    for(int n = 0; n < 256; ++n) SrgbToLinear32[n] = SrgbToLinear[n];
+    return &avx2_blit_kernels;
+  }
+  if(__builtin_cpu_supports("sse2"))
+    return &sse2_blit_kernels;
+#endif
+  return &scalar_blit_kernels;
+}
+
+const BlitKernels* const SubCritical::blit_kernels = PickBlitKernels();
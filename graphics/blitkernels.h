@@ -0,0 +1,146 @@
+// -*- c++ -*-
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#ifndef _SUBCRITICAL_BLITKERNELS_H
+#define _SUBCRITICAL_BLITKERNELS_H
+
+/* Internal to the graphics package; not installed. */
+
+#include "graphics.h"
+
+/* Clip a source rectangle (sx, sy, sw, sh from gfk) drawn at dx, dy against
+   our clip rect and gfk's bounds. Declares sl, st, sr, sb (inclusive) and
+   adjusts dx, dy to match. Returns if nothing is left. */
+#define CLIP_FOR_BLIT() \
+  int sl, st, sr, sb; \
+  sl = sx; \
+  st = sy; \
+  sr = sx + sw - 1; \
+  sb = sy + sh - 1; \
+  if(dx < clip_left) { sl += clip_left - dx; dx = clip_left; } \
+  if(dy < clip_top) { st += clip_top - dy; dy = clip_top; } \
+  if(dx + (sr - sl) > clip_right) { sr += clip_right - (dx + (sr - sl)); } \
+  if(dy + (sb - st) > clip_bottom) { sb += clip_bottom - (dy + (sb - st)); } \
+  if(sl < 0) { dx -= sl; sl = 0; } \
+  if(sr >= gfk->width) sr = gfk->width - 1; \
+  if(st < 0) { dy -= st; st = 0; } \
+  if(sb >= gfk->height) sb = gfk->height - 1; \
+  if(sr < sl || sb < st) return;
+
+/* Use right after CLIP_FOR_BLIT in Drawable methods, to add the clipped
+   destination rect to the damage list (if damage is being tracked). */
+#define DAMAGE_FOR_BLIT() \
+  if(damage) AddDamage(dx, dy, dx + (sr - sl), dy + (sb - st));
+
+/* Use right after CLIP_FOR_BLIT (and DAMAGE_FOR_BLIT), passing the method we're in (and its extra
+   parameter, for PARALLEL_BLIT_T). If the clipped area is big enough, this
+   calls the method again on row bands of it across the worker pool, then
+   returns. The bands are already clipped, so each does exactly the rows the
+   serial loop would have; inside a band the pool is busy, so the method
+   falls through to its serial loop.
+   Anything the method does besides its row loop has to happen before this,
+   and has to be harmless when the bands do it again. */
+#define PARALLEL_BLIT(method) \
+  if(ParallelBlit(this, &method, gfk, sl, st, sr, sb, dx, dy)) return;
+#define PARALLEL_BLIT_T(method, extra) \
+  if(ParallelBlit(this, &method, gfk, sl, st, sr, sb, dx, dy, extra)) return;
+
+namespace SubCritical {
+  /* Smaller blits than this (in destination pixels) aren't worth waking the
+     workers for. */
+  static const int PARALLEL_BLIT_AREA = 65536;
+  template<class D, class S> struct BlitBands {
+    D* dst;
+    const S* src;
+    void(D::*rect)(const S*restrict, int, int, int, int, int, int) restrict throw();
+    int sl, st, sw, dx, dy;
+    static void Band(void* p, int first, int last) {
+      const BlitBands* b = (const BlitBands*)p;
+      (b->dst->*b->rect)(b->src, b->sl, first, b->sw, last - first, b->dx, b->dy + first - b->st);
+    }
+  };
+  template<class D, class S> struct BlitBandsT {
+    D* dst;
+    const S* src;
+    void(D::*rect)(const S*restrict, int, int, int, int, int, int, lua_Number) restrict throw();
+    int sl, st, sw, dx, dy;
+    lua_Number extra;
+    static void Band(void* p, int first, int last) {
+      const BlitBandsT* b = (const BlitBandsT*)p;
+      (b->dst->*b->rect)(b->src, b->sl, first, b->sw, last - first, b->dx, b->dy + first - b->st, b->extra);
+    }
+  };
+  /* Each band gets at least a quarter of PARALLEL_BLIT_AREA pixels. */
+  static inline int BlitGrain(int sw) {
+    return (PARALLEL_BLIT_AREA / 4 + sw - 1) / sw;
+  }
+  template<class D, class S> static inline bool ParallelBlit(D* dst, void(D::*rect)(const S*restrict, int, int, int, int, int, int) restrict throw(), const S* src, int sl, int st, int sr, int sb, int dx, int dy) {
+    int sw = sr - sl + 1, sh = sb - st + 1;
+    if(sw * sh < PARALLEL_BLIT_AREA) return false;
+    BlitBands<D, S> bands = {dst, src, rect, sl, st, sw, dx, dy};
+    return TryParallelBands(BlitBands<D, S>::Band, &bands, st, sb + 1, BlitGrain(sw));
+  }
+  template<class D, class S> static inline bool ParallelBlit(D* dst, void(D::*rect)(const S*restrict, int, int, int, int, int, int, lua_Number) restrict throw(), const S* src, int sl, int st, int sr, int sb, int dx, int dy, lua_Number extra) {
+    int sw = sr - sl + 1, sh = sb - st + 1;
+    if(sw * sh < PARALLEL_BLIT_AREA) return false;
+    BlitBandsT<D, S> bands = {dst, src, rect, sl, st, sw, dx, dy, extra};
+    return TryParallelBands(BlitBandsT<D, S>::Band, &bands, st, sb + 1, BlitGrain(sw));
+  }
+  struct PixelShifts {
+    uint8_t rsh, gsh, bsh, ash;
+  };
+  /* Blend one row of count pixels from src over dst. Every implementation of
+     a given kernel produces exactly the same output as the scalar one. */
+  typedef void(*BlendRowKernel)(Pixel*restrict dst, const Pixel*restrict src, size_t count, PixelShifts sh);
+  typedef void(*BlendRowKernelT)(Pixel*restrict dst, const Pixel*restrict src, size_t count, PixelShifts sh, uint32_t an);
+  /* Combine one row of count frixels from src into dst. */
+  typedef void(*FrixelRowKernel)(Frixel*restrict dst, const Frixel*restrict src, size_t count);
+  /* Rearrange the channels of count pixels from src into dst, for
+     ChangeLayout. dst may be the same as src. */
+  typedef void(*SwizzleRowKernel)(Pixel* dst, const Pixel* src, size_t count);
+  enum PixelSwizzle {
+    SWIZZLE_ENDIAN, SWIZZLE_ROTATE_RIGHT, SWIZZLE_ROTATE_LEFT,
+    SWIZZLE_SWAP_EVEN, SWIZZLE_SWAP_ODD, NUM_SWIZZLES
+  };
+  struct BlitKernels {
+    const char* name;
+    // full alpha, as in BlitRect
+    BlendRowKernel blend_alpha;
+    // simple alpha with constant opacity, as in BlitRectT
+    BlendRowKernelT blend_simple_t;
+    // full alpha with constant opacity, as in BlitRectT
+    BlendRowKernelT blend_alpha_t;
+    // no alpha with constant opacity, as in BlitRectT
+    BlendRowKernelT blend_opaque_t;
+    // premultiplied alpha, without and with constant opacity
+    BlendRowKernel blend_premul;
+    BlendRowKernelT blend_premul_t;
+    // Frisket arithmetic, as in ModulateFrisketRect etc.
+    FrixelRowKernel frisket_modulate, frisket_add, frisket_subtract, frisket_min, frisket_max;
+    // layout changes, indexed by PixelSwizzle
+    SwizzleRowKernel swizzle[NUM_SWIZZLES];
+  };
+  /* Chosen once, at load time, according to what the CPU supports. */
+  extern LOCAL const BlitKernels* const blit_kernels;
+  extern LOCAL const BlitKernels scalar_blit_kernels;
+}
+
+#endif
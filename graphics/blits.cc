@@ -19,6 +19,7 @@
   Please see doc/license.html for clarifications.
  */
 #include "graphics.h"
+#include "blitkernels.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -27,22 +28,6 @@
 
 using namespace SubCritical;
 
-#define CLIP_FOR_BLIT() \
-  int sl, st, sr, sb; \
-  sl = sx; \
-  st = sy; \
-  sr = sx + sw - 1; \
-  sb = sy + sh - 1; \
-  if(dx < clip_left) { sl += clip_left - dx; dx = clip_left; } \
-  if(dy < clip_top) { st += clip_top - dy; dy = clip_top; } \
-  if(dx + (sr - sl) > clip_right) { sr += clip_right - (dx + (sr - sl)); } \
-  if(dy + (sb - st) > clip_bottom) { sb += clip_bottom - (dy + (sb - st)); } \
-  if(sl < 0) { dx -= sl; sl = 0; } \
-  if(sr >= gfk->width) sr = gfk->width - 1; \
-  if(st < 0) { dy -= st; st = 0; } \
-  if(sb >= gfk->height) sb = gfk->height - 1; \
-  if(sr < sl || sb < st) return;
-
 static uint32_t clamp16(uint32_t x) {
   if(x > 65535) return 65535;
   else return x;
@@ -59,6 +44,7 @@ void Frisket::CopyFrisket(const Frisket*restrict gfk, int dx, int dy) restrict t
 
 void Frisket::CopyFrisketRect(const Frisket*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
   CLIP_FOR_BLIT();
+  PARALLEL_BLIT(Frisket::CopyFrisketRect);
   for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
     Frixel*restrict src, *restrict dst;
     src = gfk->rows[sY] + sl;
@@ -76,15 +62,10 @@ void Frisket::ModulateFrisket(const Frisket*restrict gfk, int dx, int dy) restri
 
 void Frisket::ModulateFrisketRect(const Frisket*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
   CLIP_FOR_BLIT();
-  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
-    Frixel*restrict src, *restrict dst;
-    src = gfk->rows[sY] + sl;
-    dst = rows[dY] + dx;
-    size_t rem = sr - sl + 1;
-    UNROLL_MORE(rem,
-		*dst = (*src++ * *dst) / 255;
-		++dst;);
-  }
+  PARALLEL_BLIT(Frisket::ModulateFrisketRect);
+  FrixelRowKernel kernel = blit_kernels->frisket_modulate;
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY)
+    kernel(rows[dY] + dx, gfk->rows[sY] + sl, sr - sl + 1);
 }
 
 void Frisket::AddFrisket(const Frisket*restrict gfk, int dx, int dy) restrict throw() {
@@ -93,17 +74,10 @@ void Frisket::AddFrisket(const Frisket*restrict gfk, int dx, int dy) restrict th
 
 void Frisket::AddFrisketRect(const Frisket*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
   CLIP_FOR_BLIT();
-  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
-    Frixel*restrict src, *restrict dst;
-    int res;
-    src = gfk->rows[sY] + sl;
-    dst = rows[dY] + dx;
-    size_t rem = sr - sl + 1;
-    UNROLL_MORE(rem,
-		res = *src++ + *dst;
-		if(res > 255) *dst++ = 255;
-		else *dst++ = res;);
-  }
+  PARALLEL_BLIT(Frisket::AddFrisketRect);
+  FrixelRowKernel kernel = blit_kernels->frisket_add;
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY)
+    kernel(rows[dY] + dx, gfk->rows[sY] + sl, sr - sl + 1);
 }
 
 void Frisket::SubtractFrisket(const Frisket*restrict gfk, int dx, int dy) restrict throw() {
@@ -112,17 +86,10 @@ void Frisket::SubtractFrisket(const Frisket*restrict gfk, int dx, int dy) restri
 
 void Frisket::SubtractFrisketRect(const Frisket*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
   CLIP_FOR_BLIT();
-  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
-    Frixel*restrict src, *restrict dst;
-    int res;
-    src = gfk->rows[sY] + sl;
-    dst = rows[dY] + dx;
-    size_t rem = sr - sl + 1;
-    UNROLL_MORE(rem,
-		res = *dst - *src++;
-		if(res < 0) *dst++ = 0;
-		else *dst++ = res;);
-  }
+  PARALLEL_BLIT(Frisket::SubtractFrisketRect);
+  FrixelRowKernel kernel = blit_kernels->frisket_subtract;
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY)
+    kernel(rows[dY] + dx, gfk->rows[sY] + sl, sr - sl + 1);
 }
 
 void Frisket::MinFrisket(const Frisket*restrict gfk, int dx, int dy) restrict throw() {
@@ -131,15 +98,10 @@ void Frisket::MinFrisket(const Frisket*restrict gfk, int dx, int dy) restrict th
 
 void Frisket::MinFrisketRect(const Frisket*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
   CLIP_FOR_BLIT();
-  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
-    Frixel*restrict src, *restrict dst;
-    src = gfk->rows[sY] + sl;
-    dst = rows[dY] + dx;
-    size_t rem = sr - sl + 1;
-    UNROLL_MORE(rem,
-		*dst = *src > *dst ? *dst : *src;
-		++src; ++dst;);
-  }
+  PARALLEL_BLIT(Frisket::MinFrisketRect);
+  FrixelRowKernel kernel = blit_kernels->frisket_min;
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY)
+    kernel(rows[dY] + dx, gfk->rows[sY] + sl, sr - sl + 1);
 }
 
 void Frisket::MaxFrisket(const Frisket*restrict gfk, int dx, int dy) restrict throw() {
@@ -148,15 +110,10 @@ void Frisket::MaxFrisket(const Frisket*restrict gfk, int dx, int dy) restrict th
 
 void Frisket::MaxFrisketRect(const Frisket*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
   CLIP_FOR_BLIT();
-  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
-    Frixel*restrict src, *restrict dst;
-    src = gfk->rows[sY] + sl;
-    dst = rows[dY] + dx;
-    size_t rem = sr - sl + 1;
-    UNROLL_MORE(rem,
-		*dst = *src < *dst ? *dst : *src;
-		++src; ++dst;);
-  }
+  PARALLEL_BLIT(Frisket::MaxFrisketRect);
+  FrixelRowKernel kernel = blit_kernels->frisket_max;
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY)
+    kernel(rows[dY] + dx, gfk->rows[sY] + sl, sr - sl + 1);
 }
 
 void Drawable::Copy(const Drawable*restrict gfk, int dx, int dy) restrict throw() {
@@ -165,6 +122,18 @@ void Drawable::Copy(const Drawable*restrict gfk, int dx, int dy) restrict throw(
 
 void Drawable::CopyRect(const Drawable*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
   CLIP_FOR_BLIT();
+  DAMAGE_FOR_BLIT();
+  if(!fake_alpha) {
+    if(!has_alpha && gfk->has_alpha) {
+      has_alpha = true;
+      simple_alpha = gfk->simple_alpha;
+      premultiplied = gfk->premultiplied;
+    }
+    else if(has_alpha && simple_alpha && !gfk->simple_alpha) {
+      simple_alpha = false;
+    }
+  }
+  PARALLEL_BLIT(Drawable::CopyRect);
   if(gfk->fake_alpha) {
     Pixel mask;
     switch(gfk->layout) {
@@ -194,15 +163,6 @@ void Drawable::CopyRect(const Drawable*restrict gfk, int sx, int sy, int sw, int
     //UNROLL_MORE(rem,
     //	*dst++ = *src++);
   }
-  if(!fake_alpha) {
-    if(!has_alpha && gfk->has_alpha) {
-      has_alpha = true;
-      simple_alpha = gfk->simple_alpha;
-    }
-    else if(has_alpha && simple_alpha) {
-      simple_alpha = simple_alpha && gfk->simple_alpha;
-    }
-  }
 }
 
 void Drawable::Blit(const Drawable*restrict gfk, int dx, int dy) restrict throw() {
@@ -211,6 +171,8 @@ void Drawable::Blit(const Drawable*restrict gfk, int dx, int dy) restrict throw(
 
 void Drawable::BlitRect(const Drawable*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
   CLIP_FOR_BLIT();
+  DAMAGE_FOR_BLIT();
+  PARALLEL_BLIT(Drawable::BlitRect);
   if(gfk->has_alpha) {
     if(gfk->simple_alpha) {
       Pixel mask = 0xFF << ash;
@@ -224,25 +186,11 @@ void Drawable::BlitRect(const Drawable*restrict gfk, int sx, int sy, int sw, int
 		    ++dst; ++src);
       }
     }
-    else for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
-      Pixel*restrict src, *restrict dst;
-      Pixel mask = 255 << ash;
-      uint32_t r, g, b, a, ra;
-      src = gfk->rows[sY] + sl;
-      dst = rows[dY] + dx;
-      size_t rem = sr - sl + 1;
-      UNROLL(rem,
-	     a = (*src >> ash) & 255;
-	     a += a & 1;
-	     ra = 256-a;
-	     r = ((uint32_t)SrgbToLinear[(*src >> rsh) & 255] * a +
-		  (uint32_t)SrgbToLinear[(*dst >> rsh) & 255] * ra) >> 8;
-	     g = ((uint32_t)SrgbToLinear[(*src >> gsh) & 255] * a +
-		  (uint32_t)SrgbToLinear[(*dst >> gsh) & 255] * ra) >> 8;
-	     b = ((uint32_t)SrgbToLinear[(*src >> bsh) & 255] * a +
-		  (uint32_t)SrgbToLinear[(*dst >> bsh) & 255] * ra) >> 8;
-	     ++src;
-	     *dst++ = ((Pixel)LinearToSrgb[r] << rsh) | ((Pixel)LinearToSrgb[g] << gsh) | ((Pixel)LinearToSrgb[b] << bsh) | mask);
+    else {
+      PixelShifts shifts = {rsh, gsh, bsh, ash};
+      BlendRowKernel kernel = gfk->premultiplied ? blit_kernels->blend_premul : blit_kernels->blend_alpha;
+      for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY)
+	kernel(rows[dY] + dx, gfk->rows[sY] + sl, sr - sl + 1, shifts);
     }
   }
   else if(gfk->fake_alpha) {
@@ -285,80 +233,49 @@ void Drawable::BlitRectT(const Drawable*restrict gfk, int sx, int sy, int sw, in
   if(an >= 65536) return BlitRect(gfk, sx, sy, sw, sh, dx, dy);
   else if(an == 0) return;
   CLIP_FOR_BLIT();
+  DAMAGE_FOR_BLIT();
+  PARALLEL_BLIT_T(Drawable::BlitRectT, a);
+  PixelShifts shifts = {rsh, gsh, bsh, ash};
+  BlendRowKernelT kernel;
   if(gfk->has_alpha) {
-    if(gfk->simple_alpha) for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
-      Pixel*restrict src, *restrict dst;
-      Pixel mask = 0xFF << ash;
-      uint32_t r, g, b, ra;
-      src = gfk->rows[sY] + sl;
-      dst = rows[dY] + dx;
-      size_t rem = sr - sl + 1;
-      ra = 65536 - an;
-      UNROLL(rem,
-	     if(*src & mask) {
-	       r = ((uint32_t)SrgbToLinear[(*src >> rsh) & 255] * an +
-		    (uint32_t)SrgbToLinear[(*dst >> rsh) & 255] * ra) >> 16;
-	       g = ((uint32_t)SrgbToLinear[(*src >> gsh) & 255] * an +
-		    (uint32_t)SrgbToLinear[(*dst >> gsh) & 255] * ra) >> 16;
-	       b = ((uint32_t)SrgbToLinear[(*src >> bsh) & 255] * an +
-		    (uint32_t)SrgbToLinear[(*dst >> bsh) & 255] * ra) >> 16;
-	       *dst = ((Pixel)LinearToSrgb[r] << rsh) | ((Pixel)LinearToSrgb[g] << gsh) | ((Pixel)LinearToSrgb[b] << bsh) | mask;
-	     }
-	     ++src; ++dst);
-    }
-    else for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
-      Pixel*restrict src, *restrict dst;
-      Pixel mask = 0xFF << ash;
-      uint32_t r, g, b, a, ra;
-      src = gfk->rows[sY] + sl;
-      dst = rows[dY] + dx;
-      size_t rem = sr - sl + 1;
-      UNROLL(rem,
-	     a = (*src >> ash) & 255;
-	     a += a & 1;
-	     a = (a * an) >> 8;
-	     ra = 65536-a;
-	     r = ((uint32_t)SrgbToLinear[(*src >> rsh) & 255] * a +
-		  (uint32_t)SrgbToLinear[(*dst >> rsh) & 255] * ra) >> 16;
-	     g = ((uint32_t)SrgbToLinear[(*src >> gsh) & 255] * a +
-		  (uint32_t)SrgbToLinear[(*dst >> gsh) & 255] * ra) >> 16;
-	     b = ((uint32_t)SrgbToLinear[(*src >> bsh) & 255] * a +
-		  (uint32_t)SrgbToLinear[(*dst >> bsh) & 255] * ra) >> 16;
-	     ++src;
-	     *dst++ = ((Pixel)LinearToSrgb[r] << rsh) | ((Pixel)LinearToSrgb[g] << gsh) | ((Pixel)LinearToSrgb[b] << bsh) | mask);
-    }
+    if(gfk->simple_alpha) kernel = blit_kernels->blend_simple_t;
+    else if(gfk->premultiplied) kernel = blit_kernels->blend_premul_t;
+    else kernel = blit_kernels->blend_alpha_t;
   }
-  else for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
-    Pixel*restrict src, *restrict dst;
-    uint32_t r, g, b, ra;
-    src = gfk->rows[sY] + sl;
-    dst = rows[dY] + dx;
-    size_t rem = sr - sl + 1;
-    ra = 65536 - an;
-    UNROLL(rem,
-	   r = ((uint32_t)SrgbToLinear[(*src >> rsh) & 255] * an +
-		(uint32_t)SrgbToLinear[(*dst >> rsh) & 255] * ra) >> 16;
-	   g = ((uint32_t)SrgbToLinear[(*src >> gsh) & 255] * an +
-		(uint32_t)SrgbToLinear[(*dst >> gsh) & 255] * ra) >> 16;
-	   b = ((uint32_t)SrgbToLinear[(*src >> bsh) & 255] * an +
-		(uint32_t)SrgbToLinear[(*dst >> bsh) & 255] * ra) >> 16;
-	   *dst = ((Pixel)LinearToSrgb[r] << rsh) | ((Pixel)LinearToSrgb[g] << gsh) | ((Pixel)LinearToSrgb[b] << bsh);
-	   ++src; ++dst);
-    }
+  else kernel = blit_kernels->blend_opaque_t;
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY)
+    kernel(rows[dY] + dx, gfk->rows[sY] + sl, sr - sl + 1, shifts, an);
 }
 
 int Drawable::Lua_Blit(lua_State* L) restrict throw() {
   if(has_alpha) return luaL_error(L, "Graphics with alpha channels cannot be modified with this function. Try :Copy.");
-  Drawable*restrict gfk = lua_toobject(L,1,Drawable);
-  if(gfk == this) return luaL_error(L, "Source and destination Drawable must differ");
-  if(gfk->layout != layout) {
-    if(gfk->IsA("Graphic"))
-      ((Graphic*)gfk)->ChangeLayout(layout);
-    else if(IsA("Graphic"))
-      ((Graphic*)this)->ChangeLayout(gfk->layout);
-    else
-      return luaL_error(L, "Attempt to blit between two non-morphable Drawables!");
+  if(Object::To(L,1)->IsA("LinearGraphic")) {
+    LinearGraphic*restrict lin = lua_toobject(L,1,LinearGraphic);
+    switch(lua_gettop(L)) {
+    case 3: BlitRectT(lin, 0, 0, lin->width, lin->height, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3), 1); return 0;
+    case 4: BlitRectT(lin, 0, 0, lin->width, lin->height, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3), luaL_checknumber(L,4)); return 0;
+    case 7: BlitRectT(lin, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3), (int)luaL_checknumber(L,4), (int)luaL_checknumber(L,5), (int)luaL_checknumber(L,6), (int)luaL_checknumber(L,7), 1); return 0;
+    case 8: BlitRectT(lin, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3), (int)luaL_checknumber(L,4), (int)luaL_checknumber(L,5), (int)luaL_checknumber(L,6), (int)luaL_checknumber(L,7), luaL_checknumber(L,8)); return 0;
+    default:
+      return luaL_error(L, "Blit takes 3, 4, 7, or 8 parameters");
+    }
   }
+  if(Object::To(L,1)->IsA("RLEGraphic")) {
+    RLEGraphic*restrict rle = lua_toobject(L,1,RLEGraphic);
+    rle->ChangeLayout(layout);
+    switch(lua_gettop(L)) {
+    case 3: BlitRect(rle, 0, 0, rle->width, rle->height, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3)); return 0;
+    case 4: BlitRectT(rle, 0, 0, rle->width, rle->height, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3), luaL_checknumber(L,4)); return 0;
+    case 7: BlitRect(rle, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3), (int)luaL_checknumber(L,4), (int)luaL_checknumber(L,5), (int)luaL_checknumber(L,6), (int)luaL_checknumber(L,7)); return 0;
+    case 8: BlitRectT(rle, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3), (int)luaL_checknumber(L,4), (int)luaL_checknumber(L,5), (int)luaL_checknumber(L,6), (int)luaL_checknumber(L,7), luaL_checknumber(L,8)); return 0;
+    default:
+      return luaL_error(L, "Blit takes 3, 4, 7, or 8 parameters");
+    }
+  }
+  Drawable*restrict gfk = lua_toobject(L,1,Drawable);
+  if(DrawablesOverlap(gfk, this)) return luaL_error(L, "Source and destination Drawable must not overlap");
+  if(!MatchLayouts(gfk, this))
+    return luaL_error(L, "Attempt to blit between two non-morphable Drawables!");
   switch(lua_gettop(L)) {
   case 3: Blit(gfk, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3)); return 0;
   case 4: BlitT(gfk, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3), luaL_checknumber(L, 4)); return 0;
@@ -375,6 +292,8 @@ void Drawable::Modulate(const Drawable*restrict gfk, int dx, int dy) restrict th
 
 void Drawable::ModulateRect(const Drawable*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
   CLIP_FOR_BLIT();
+  DAMAGE_FOR_BLIT();
+  PARALLEL_BLIT(Drawable::ModulateRect);
   Pixel mask = 0xFF << ash;
   for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
     uint32_t r, g, b;
@@ -400,7 +319,8 @@ void Drawable::Modulate2(const Drawable*restrict gfk, int dx, int dy) restrict t
 
 void Drawable::ModulateRect2(const Drawable*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
   CLIP_FOR_BLIT();
-  printf("%i,%i,%i,%i\n", sl, st, sr, sb);
+  DAMAGE_FOR_BLIT();
+  PARALLEL_BLIT(Drawable::ModulateRect2);
   Pixel mask = 0xFF << ash;
   for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
     uint32_t r, g, b;
@@ -430,6 +350,8 @@ void Drawable::ModulateRectF(const Drawable*restrict gfk, int sx, int sy, int sw
   else if(f == 2) return ModulateRect2(gfk, sx, sy, sw, sh, dx, dy);
   float ff = (float)f / 65535.0f;
   CLIP_FOR_BLIT();
+  DAMAGE_FOR_BLIT();
+  PARALLEL_BLIT_T(Drawable::ModulateRectF, f);
   Pixel mask = 0xFF << ash;
   for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
     uint32_t r, g, b;
@@ -453,16 +375,12 @@ void Drawable::ModulateRectF(const Drawable*restrict gfk, int sx, int sy, int sw
 }
 
 int Drawable::Lua_Modulate(lua_State* L) restrict throw() {
+  if(Object::To(L,1)->IsA("RLEGraphic"))
+    return luaL_error(L, "RLEGraphic can only be Blit");
   Drawable*restrict gfk = lua_toobject(L,1,Drawable);
-  if(gfk == this) return luaL_error(L, "Source and destination Drawable must differ");
-  if(gfk->layout != layout) {
-    if(gfk->IsA("Graphic"))
-      ((Graphic*)gfk)->ChangeLayout(layout);
-    else if(IsA("Graphic"))
-      ((Graphic*)this)->ChangeLayout(gfk->layout);
-    else
-      return luaL_error(L, "Attempt to modulate between two non-morphable Drawables!");
-  }
+  if(DrawablesOverlap(gfk, this)) return luaL_error(L, "Source and destination Drawable must not overlap");
+  if(!MatchLayouts(gfk, this))
+    return luaL_error(L, "Attempt to modulate between two non-morphable Drawables!");
   switch(lua_gettop(L)) {
   case 3: Modulate(gfk, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3)); return 0;
   case 4: ModulateF(gfk, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3), luaL_checknumber(L, 4)); return 0;
@@ -474,16 +392,24 @@ int Drawable::Lua_Modulate(lua_State* L) restrict throw() {
 }
 
 int Drawable::Lua_Copy(lua_State* L) restrict throw() {
-  Drawable*restrict gfk = lua_toobject(L,1,Drawable);
-  if(gfk == this) return luaL_error(L, "Source and destination Drawable must differ");
-  if(gfk->layout != layout) {
-    if(gfk->IsA("Graphic"))
-      ((Graphic*)gfk)->ChangeLayout(layout);
-    else if(IsA("Graphic"))
-      ((Graphic*)this)->ChangeLayout(gfk->layout);
-    else
-      return luaL_error(L, "Attempt to blit between two non-morphable Drawables!");
+  if(Object::To(L,1)->IsA("LinearGraphic")) {
+    LinearGraphic*restrict lin = lua_toobject(L,1,LinearGraphic);
+    switch(lua_gettop(L)) {
+    case 3: CopyRect(lin, 0, 0, lin->width, lin->height, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3)); return 0;
+    case 7: CopyRect(lin, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3), (int)luaL_checknumber(L,4), (int)luaL_checknumber(L,5), (int)luaL_checknumber(L,6), (int)luaL_checknumber(L,7)); return 0;
+    default:
+      return luaL_error(L, "Copy takes 3 or 7 parameters");
+    }
   }
+  if(Object::To(L,1)->IsA("RLEGraphic"))
+    return luaL_error(L, "RLEGraphic can only be Blit");
+  Drawable*restrict gfk = lua_toobject(L,1,Drawable);
+  if(DrawablesOverlap(gfk, this)) return luaL_error(L, "Source and destination Drawable must not overlap");
+  if(!MatchLayouts(gfk, this))
+    return luaL_error(L, "Attempt to blit between two non-morphable Drawables!");
+  // the copied pixels would be read the wrong way
+  if(!fake_alpha && has_alpha && gfk->has_alpha && premultiplied != gfk->premultiplied)
+    return luaL_error(L, "Attempt to Copy between premultiplied and straight alpha Drawables! Premultiply or Unpremultiply one of them first.");
   switch(lua_gettop(L)) {
   case 3: Copy(gfk, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3)); return 0;
   case 7: CopyRect(gfk, (int)luaL_checknumber(L,2), (int)luaL_checknumber(L,3), (int)luaL_checknumber(L,4), (int)luaL_checknumber(L,5), (int)luaL_checknumber(L,6), (int)luaL_checknumber(L,7)); return 0;
@@ -23,51 +23,46 @@
 
 using namespace SubCritical;
 
-#define double_area_triangle(a,b,c) \
-  (((a)[0]*(b)[1] - (b)[0]*(a)[1]) + ((b)[0]*(c)[1] - (c)[0]*(b)[1]) + ((c)[0]*(a)[1] - (a)[0]*(c)[1]))
-#define cull_triangle(a,b,c,dir) \
-  (double_area_triangle(a,b,c) dir 0)
+/* Twice the signed area; positive for clockwise triangles (y is down).
+   Coordinates can be big enough that the products need 64 bits. */
+static inline int64_t DoubleArea(const Fixed* a, const Fixed* b, const Fixed* c) {
+  return (int64_t)(b[0] - a[0]) * (c[1] - a[1]) - (int64_t)(b[1] - a[1]) * (c[0] - a[0]);
+}
 
-SUBCRITICAL_UTILITY(CullTrianglesCW)(lua_State* L) {
-  const CoordArray* coords = lua_toobject(L, 1, CoordArray);
-  const IndexArray* indices = lua_toobject(L, 2, IndexArray);
-  IndexArray* ret = new IndexArray(indices->count);
-  size_t in, out;
-  for(in = 0, out = 0; in < indices->count-2; in += 3) {
-    if(cull_triangle(coords->coords + indices->indices[in]*2,
-		     coords->coords + indices->indices[in+1]*2,
-		     coords->coords + indices->indices[in+2]*2, >)) {
-      ret->indices[out++] = indices->indices[in];
-      ret->indices[out++] = indices->indices[in+1];
-      ret->indices[out++] = indices->indices[in+2];
-    }
-  }
-  if(out == 0) {
-    delete ret;
-    lua_pushnil(L);
-  }
-  else {
-    ret->count = out;
-    ret->Push(L);
+/* Copies the triangles of in that face the right way into out, returning how
+   many indices that came to. Every triangle is written and the output only
+   advances past the ones that are kept, so there's no branch to mispredict.
+   out may be in, since it never gets ahead of the input. */
+template<bool cw, class I> static size_t CullTriangles(const Fixed*restrict coords, const I* in, size_t count, I* out) {
+  size_t n, ret = 0;
+  for(n = 0; n + 2 < count; n += 3) {
+    I ia = in[n], ib = in[n+1], ic = in[n+2];
+    int64_t area = DoubleArea(coords + ia*2, coords + ib*2, coords + ic*2);
+    out[ret] = ia;
+    out[ret+1] = ib;
+    out[ret+2] = ic;
+    ret += (cw ? area > 0 : area < 0) * 3;
   }
-  return 1;
+  return ret;
 }
 
-SUBCRITICAL_UTILITY(CullTrianglesCCW)(lua_State* L) {
+/* With in_place, the triangles are compacted within indices' active range,
+   which is then shrunk to fit them, and indices is returned. */
+template<bool cw> static int CullTrianglesLua(lua_State* L) {
   const CoordArray* coords = lua_toobject(L, 1, CoordArray);
-  const IndexArray* indices = lua_toobject(L, 2, IndexArray);
-  IndexArray* ret = new IndexArray(indices->count);
-  size_t in, out;
-  for(in = 0, out = 0; in < indices->count-2; in += 3) {
-    if(cull_triangle(coords->coords + indices->indices[in]*2,
-		     coords->coords + indices->indices[in+1]*2,
-		     coords->coords + indices->indices[in+2]*2, <)) {
-      ret->indices[out++] = indices->indices[in];
-      ret->indices[out++] = indices->indices[in+1];
-      ret->indices[out++] = indices->indices[in+2];
-    }
+  IndexArray* indices = lua_toobject(L, 2, IndexArray);
+  bool in_place = lua_toboolean(L, 3);
+  IndexArray* ret = in_place ? indices : new IndexArray(indices->count, indices->IsWide());
+  size_t out;
+  if(indices->IsWide())
+    out = CullTriangles<cw>(coords->coords, indices->indices32, indices->count, ret->indices32);
+  else
+    out = CullTriangles<cw>(coords->coords, indices->indices, indices->count, ret->indices);
+  if(in_place) {
+    indices->count = out;
+    lua_pushvalue(L, 2);
   }
-  if(out == 0) {
+  else if(out == 0) {
     delete ret;
     lua_pushnil(L);
   }
@@ -77,3 +72,11 @@ SUBCRITICAL_UTILITY(CullTrianglesCCW)(lua_State* L) {
   }
   return 1;
 }
+
+SUBCRITICAL_UTILITY(CullTrianglesCW)(lua_State* L) {
+  return CullTrianglesLua<true>(L);
+}
+
+SUBCRITICAL_UTILITY(CullTrianglesCCW)(lua_State* L) {
+  return CullTrianglesLua<false>(L);
+}
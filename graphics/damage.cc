@@ -0,0 +1,191 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#include "graphics.h"
+#include <stdlib.h>
+
+using namespace SubCritical;
+
+/* Past this many rects, new damage is merged into whichever existing rect
+   it grows the least. Updating a few extra pixels is cheaper than updating
+   many small rects. */
+#define MAX_DAMAGE_RECTS 16
+
+static inline int64_t Area(int l, int t, int r, int b) {
+  return (int64_t)(r - l + 1) * (b - t + 1);
+}
+
+static inline void Union(DamageRect& a, const DamageRect& b) {
+  if(b.l < a.l) a.l = b.l;
+  if(b.t < a.t) a.t = b.t;
+  if(b.r > a.r) a.r = b.r;
+  if(b.b > a.b) a.b = b.b;
+}
+
+/* How many more pixels the union of a and b covers than a and b do. */
+static inline int64_t Waste(const DamageRect& a, const DamageRect& b) {
+  DamageRect u = a;
+  Union(u, b);
+  return Area(u.l, u.t, u.r, u.b) - Area(a.l, a.t, a.r, a.b) - Area(b.l, b.t, b.r, b.b);
+}
+
+void Drawable::SetDamageTracking(bool enabled) throw() {
+  if(enabled && !damage) {
+    damage = (DamageRect*)malloc(MAX_DAMAGE_RECTS * sizeof(DamageRect));
+    damage_count = 0;
+  }
+  else if(!enabled && damage) {
+    free(damage);
+    damage = NULL;
+    damage_count = 0;
+  }
+}
+
+void Drawable::ClearDamage() throw() {
+  damage_count = 0;
+}
+
+/* Damage that's already covered doesn't write anything. This is what makes
+   it safe for the row bands of a parallel blit, which run after the whole
+   blit's rect has been added, to come through here at the same time. */
+void Drawable::AddDamage(int l, int t, int r, int b) throw() {
+  if(!damage) return;
+  if(l < 0) l = 0;
+  if(t < 0) t = 0;
+  if(r >= width) r = width - 1;
+  if(b >= height) b = height - 1;
+  if(r < l || b < t) return;
+  for(int n = 0; n < damage_count; ++n) {
+    const DamageRect& d = damage[n];
+    if(d.l <= l && d.t <= t && d.r >= r && d.b >= b) return;
+  }
+  DamageRect nu = {l, t, r, b};
+  /* Absorb every rect that overlaps or touches the new one, as long as that
+     doesn't add much that isn't damaged. Each merge can make the new rect
+     reach more, so keep going until nothing changes. */
+  bool merged;
+  do {
+    merged = false;
+    for(int n = 0; n < damage_count; ++n) {
+      const DamageRect& d = damage[n];
+      if(d.l > nu.r + 1 || d.r < nu.l - 1 || d.t > nu.b + 1 || d.b < nu.t - 1)
+	continue;
+      if(Waste(nu, d) * 4 > Area(nu.l, nu.t, nu.r, nu.b) + Area(d.l, d.t, d.r, d.b))
+	continue;
+      Union(nu, d);
+      damage[n] = damage[--damage_count];
+      merged = true;
+      break;
+    }
+  } while(merged);
+  if(damage_count < MAX_DAMAGE_RECTS) {
+    damage[damage_count++] = nu;
+    return;
+  }
+  int best = 0;
+  int64_t best_waste = Waste(damage[0], nu);
+  for(int n = 1; n < damage_count; ++n) {
+    int64_t waste = Waste(damage[n], nu);
+    if(waste < best_waste) { best = n; best_waste = waste; }
+  }
+  Union(damage[best], nu);
+}
+
+/* Damage the bounding box of the given coordinates (all count of them, if
+   indices is NULL), grown by pad on every side. */
+template<class I> void Drawable::DamageCoords(const Fixed* coords, const I* indices, size_t count, Fixed pad) throw() {
+  if(count == 0) return;
+  Fixed minx, miny, maxx, maxy;
+  const Fixed* p = coords + (indices ? indices[0] : 0) * 2;
+  minx = maxx = p[0];
+  miny = maxy = p[1];
+  for(size_t n = 1; n < count; ++n) {
+    p = coords + (indices ? indices[n] : n) * 2;
+    if(p[0] < minx) minx = p[0];
+    else if(p[0] > maxx) maxx = p[0];
+    if(p[1] < miny) miny = p[1];
+    else if(p[1] > maxy) maxy = p[1];
+  }
+  int l = Q_FLOOR(minx - pad), t = Q_FLOOR(miny - pad);
+  int r = Q_CEIL(maxx + pad), b = Q_CEIL(maxy + pad);
+  if(l < clip_left) l = clip_left;
+  if(t < clip_top) t = clip_top;
+  if(r > clip_right) r = clip_right;
+  if(b > clip_bottom) b = clip_bottom;
+  AddDamage(l, t, r, b);
+}
+template void Drawable::DamageCoords<Index>(const Fixed*, const Index*, size_t, Fixed) throw();
+template void Drawable::DamageCoords<Index32>(const Fixed*, const Index32*, size_t, Fixed) throw();
+
+int Drawable::Lua_SetDamageTracking(lua_State* L) throw() {
+  SetDamageTracking(lua_toboolean(L, 1));
+  return 0;
+}
+
+int Drawable::Lua_AddDamage(lua_State* L) throw() {
+  int x, y, w, h;
+  x = (int)luaL_checknumber(L, 1);
+  y = (int)luaL_checknumber(L, 2);
+  w = (int)luaL_checknumber(L, 3);
+  h = (int)luaL_checknumber(L, 4);
+  AddDamage(x, y, x + w - 1, y + h - 1);
+  return 0;
+}
+
+int Drawable::Lua_GetDamage(lua_State* L) throw() {
+  if(!damage) return 0;
+  lua_createtable(L, damage_count, 0);
+  for(int n = 0; n < damage_count; ++n) {
+    const DamageRect& d = damage[n];
+    lua_createtable(L, 4, 0);
+    lua_pushinteger(L, d.l);
+    lua_rawseti(L, -2, 1);
+    lua_pushinteger(L, d.t);
+    lua_rawseti(L, -2, 2);
+    lua_pushinteger(L, d.r - d.l + 1);
+    lua_rawseti(L, -2, 3);
+    lua_pushinteger(L, d.b - d.t + 1);
+    lua_rawseti(L, -2, 4);
+    lua_rawseti(L, -2, n + 1);
+  }
+  return 1;
+}
+
+int Drawable::Lua_ClearDamage(lua_State* L) throw() {
+  ClearDamage();
+  return 0;
+}
+
+void GraphicsDevice::UpdateDamaged() throw() {
+  if(!damage) {
+    UpdateAll();
+    return;
+  }
+  for(int n = 0; n < damage_count; ++n) {
+    const DamageRect& d = damage[n];
+    Update(d.l, d.t, d.r - d.l + 1, d.b - d.t + 1);
+  }
+  damage_count = 0;
+}
+
+int GraphicsDevice::Lua_UpdateDamaged(lua_State* L) throw() {
+  UpdateDamaged();
+  return 0;
+}
@@ -0,0 +1,423 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#include "graphics.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include <math.h>
+
+using namespace SubCritical;
+
+/* Everything a DrawList refers to is kept in a table at registry[this], so
+   that it can't be collected while the list might still draw it. */
+#define REF_COOKIE (this)
+
+DrawList::DrawList()
+  : commands(NULL), count(0), capacity(0), referenced_state(NULL),
+    order(NULL) {}
+
+DrawList::~DrawList() {
+  Clear();
+  free(commands);
+  free(order);
+}
+
+void DrawList::Reference(lua_State* L, int index) {
+  if(!referenced_state) referenced_state = L;
+  lua_pushlightuserdata(L, REF_COOKIE);
+  lua_gettable(L, LUA_REGISTRYINDEX);
+  if(lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushlightuserdata(L, REF_COOKIE);
+    lua_pushvalue(L, -2);
+    lua_settable(L, LUA_REGISTRYINDEX);
+  }
+  lua_pushvalue(L, index);
+  lua_pushboolean(L, 1);
+  lua_settable(L, -3);
+  lua_pop(L, 1);
+}
+
+void DrawList::Clear() throw() {
+  if(referenced_state) {
+    lua_State* L = referenced_state;
+    lua_pushlightuserdata(L, REF_COOKIE);
+    lua_pushnil(L);
+    lua_settable(L, LUA_REGISTRYINDEX);
+    referenced_state = NULL;
+  }
+  count = 0;
+}
+
+DrawCommand* DrawList::Add(lua_State* L, DrawCommand::Op op) {
+  if(count == capacity) {
+    size_t nucap = capacity ? capacity * 2 : 64;
+    DrawCommand* nu = (DrawCommand*)realloc(commands, nucap * sizeof(DrawCommand));
+    DrawCommand** nuorder = (DrawCommand**)realloc(order, nucap * sizeof(DrawCommand*));
+    if(nu) commands = nu;
+    if(nuorder) order = nuorder;
+    if(!nu || !nuorder) luaL_error(L, "Out of memory growing DrawList");
+    capacity = nucap;
+  }
+  DrawCommand* ret = commands + count++;
+  memset(ret, 0, sizeof(*ret));
+  ret->op = op;
+  ret->a = 1;
+  return ret;
+}
+
+/* Which kind of blit a source needs. Errors if it's not blittable at all. */
+static DrawCommand::Op BlitOp(lua_State* L, int n) {
+  Object* o = Object::To(L, n);
+  if(o && o->IsA("LinearGraphic")) return DrawCommand::BLIT_LINEAR;
+  else if(o && o->IsA("RLEGraphic")) return DrawCommand::BLIT_RLE;
+  lua_toobject(L, n, Drawable);
+  return DrawCommand::BLIT;
+}
+
+static void SourceSize(const DrawCommand& c, int& w, int& h) {
+  switch(c.op) {
+  case DrawCommand::BLIT: w = ((Drawable*)c.source)->width; h = ((Drawable*)c.source)->height; break;
+  case DrawCommand::BLIT_LINEAR: w = ((LinearGraphic*)c.source)->width; h = ((LinearGraphic*)c.source)->height; break;
+  case DrawCommand::BLIT_RLE: w = ((RLEGraphic*)c.source)->width; h = ((RLEGraphic*)c.source)->height; break;
+  case DrawCommand::BLIT_FRISKET: w = ((Frisket*)c.source)->width; h = ((Frisket*)c.source)->height; break;
+  default: w = h = 0; break;
+  }
+}
+
+int DrawList::Lua_Blit(lua_State* L) throw() {
+  DrawCommand::Op op = BlitOp(L, 1);
+  DrawCommand c;
+  c.op = op;
+  c.source = Object::To(L, 1);
+  SourceSize(c, c.sw, c.sh);
+  c.sx = c.sy = 0;
+  c.a = 1;
+  switch(lua_gettop(L)) {
+  case 4: c.a = luaL_checknumber(L, 4); /* fall through */
+  case 3:
+    c.dx = (int)luaL_checknumber(L, 2);
+    c.dy = (int)luaL_checknumber(L, 3);
+    break;
+  case 8: c.a = luaL_checknumber(L, 8); /* fall through */
+  case 7:
+    c.sx = (int)luaL_checknumber(L, 2);
+    c.sy = (int)luaL_checknumber(L, 3);
+    c.sw = (int)luaL_checknumber(L, 4);
+    c.sh = (int)luaL_checknumber(L, 5);
+    c.dx = (int)luaL_checknumber(L, 6);
+    c.dy = (int)luaL_checknumber(L, 7);
+    break;
+  default:
+    return luaL_error(L, "Blit takes 3, 4, 7, or 8 parameters");
+  }
+  DrawCommand* p = Add(L, op);
+  Reference(L, 1);
+  p->source = c.source;
+  p->sx = c.sx; p->sy = c.sy; p->sw = c.sw; p->sh = c.sh;
+  p->dx = c.dx; p->dy = c.dy;
+  p->a = c.a;
+  return 0;
+}
+
+int DrawList::Lua_BlitFrisket(lua_State* L) throw() {
+  Frisket* frisket = lua_toobject(L, 1, Frisket);
+  int sx = 0, sy = 0, sw = frisket->width, sh = frisket->height, dx, dy;
+  switch(lua_gettop(L)) {
+  case 3:
+    dx = (int)luaL_checknumber(L, 2);
+    dy = (int)luaL_checknumber(L, 3);
+    break;
+  case 7:
+    sx = (int)luaL_checknumber(L, 2);
+    sy = (int)luaL_checknumber(L, 3);
+    sw = (int)luaL_checknumber(L, 4);
+    sh = (int)luaL_checknumber(L, 5);
+    dx = (int)luaL_checknumber(L, 6);
+    dy = (int)luaL_checknumber(L, 7);
+    break;
+  default:
+    return luaL_error(L, "BlitFrisket takes 3 or 7 parameters");
+  }
+  DrawCommand* p = Add(L, DrawCommand::BLIT_FRISKET);
+  Reference(L, 1);
+  p->source = frisket;
+  p->sx = sx; p->sy = sy; p->sw = sw; p->sh = sh;
+  p->dx = dx; p->dy = dy;
+  return 0;
+}
+
+/* Many blits from one source at once, each of its own rect of it (as from
+   an atlas). data is either a table of numbers or a string of big-endian
+   32-bit integers (such as PackedArray1D_S32's Dump returns), six per blit:
+   sx, sy, sw, sh, x, y. */
+int DrawList::Lua_AddBlits(lua_State* L) throw() {
+  DrawCommand::Op op = BlitOp(L, 1);
+  Object* source = Object::To(L, 1);
+  lua_Number a = luaL_optnumber(L, 3, 1);
+  size_t n;
+  const int32_t* packed = NULL;
+  if(lua_type(L, 2) == LUA_TSTRING) {
+    const char* s = lua_tolstring(L, 2, &n);
+    if(n % (6 * sizeof(int32_t))) return luaL_error(L, "AddBlits data must be a multiple of 24 bytes long");
+    n /= sizeof(int32_t);
+    packed = (const int32_t*)s;
+  }
+  else if(lua_istable(L, 2)) {
+    n = lua_rawlen(L, 2);
+    if(n % 6) return luaL_error(L, "AddBlits data must have a multiple of 6 numbers");
+  }
+  else return luaL_typerror(L, 2, "table or string");
+  if(n == 0) return 0;
+  Reference(L, 1);
+  for(size_t i = 0; i < n; i += 6) {
+    int v[6];
+    for(int j = 0; j < 6; ++j) {
+      if(packed) {
+	int32_t x;
+	memcpy(&x, packed + i + j, sizeof(x));
+	v[j] = (int32_t)Swap32_BE((uint32_t)x);
+      }
+      else {
+	lua_rawgeti(L, 2, i + j + 1);
+	v[j] = (int)lua_tonumber(L, -1);
+	lua_pop(L, 1);
+      }
+    }
+    DrawCommand* p = Add(L, op);
+    p->source = source;
+    p->sx = v[0]; p->sy = v[1]; p->sw = v[2]; p->sh = v[3];
+    p->dx = v[4]; p->dy = v[5];
+    p->a = a;
+  }
+  return 0;
+}
+
+int DrawList::Lua_SetPrimitiveColor(lua_State* L) throw() {
+  lua_Number r = luaL_checknumber(L, 1);
+  lua_Number g = luaL_checknumber(L, 2);
+  lua_Number b = luaL_checknumber(L, 3);
+  lua_Number a = luaL_optnumber(L, 4, 1.0);
+  DrawCommand* p = Add(L, DrawCommand::SET_COLOR);
+  p->r = r; p->g = g; p->b = b; p->a = a;
+  return 0;
+}
+
+int DrawList::Lua_SetPrimitiveColorPremul(lua_State* L) throw() {
+  lua_Number r = luaL_checknumber(L, 1);
+  lua_Number g = luaL_checknumber(L, 2);
+  lua_Number b = luaL_checknumber(L, 3);
+  lua_Number a = luaL_optnumber(L, 4, 1.0);
+  DrawCommand* p = Add(L, DrawCommand::SET_COLOR_PREMUL);
+  p->r = r; p->g = g; p->b = b; p->a = a;
+  return 0;
+}
+
+int DrawList::Lua_DrawRect(lua_State* L) throw() {
+  int l = (int)nearbyint(luaL_checknumber(L, 1));
+  int t = (int)nearbyint(luaL_checknumber(L, 2));
+  int w = (int)nearbyint(luaL_checknumber(L, 3));
+  int h = (int)nearbyint(luaL_checknumber(L, 4));
+  DrawCommand* p = Add(L, DrawCommand::DRAW_RECT);
+  p->dx = l; p->dy = t; p->sw = w; p->sh = h;
+  return 0;
+}
+
+int DrawList::Lua_DrawBox(lua_State* L) throw() {
+  int l = (int)nearbyint(luaL_checknumber(L, 1));
+  int t = (int)nearbyint(luaL_checknumber(L, 2));
+  int w = (int)nearbyint(luaL_checknumber(L, 3));
+  int h = (int)nearbyint(luaL_checknumber(L, 4));
+  int sz = luaL_optinteger(L, 5, 1);
+  DrawCommand* p = Add(L, DrawCommand::DRAW_BOX);
+  p->dx = l; p->dy = t; p->sw = w; p->sh = h; p->sx = sz;
+  return 0;
+}
+
+int DrawList::Lua_DrawTriangles(lua_State* L) throw() {
+  CoordArray* r = lua_toobject(L, 1, CoordArray);
+  IndexArray* i = lua_toobject(L, 2, IndexArray);
+  // by default, however many indices are active at replay time
+  int n = lua_isnoneornil(L, 3) ? -1 : luaL_checkinteger(L, 3);
+  DrawCommand* p = Add(L, DrawCommand::DRAW_TRIANGLES);
+  Reference(L, 1);
+  Reference(L, 2);
+  p->source = r;
+  p->indices = i;
+  p->sw = n;
+  return 0;
+}
+
+int DrawList::Lua_Clear(lua_State* L) throw() {
+  Clear();
+  return 0;
+}
+
+int DrawList::Lua_GetCount(lua_State* L) const throw() {
+  lua_pushnumber(L, count);
+  return 1;
+}
+
+static inline bool IsBlit(DrawCommand::Op op) {
+  return op == DrawCommand::BLIT || op == DrawCommand::BLIT_LINEAR
+    || op == DrawCommand::BLIT_RLE || op == DrawCommand::BLIT_FRISKET;
+}
+
+/* Sort by source, keeping recorded order among blits of the same source. */
+static int CompareBySource(const void* _a, const void* _b) {
+  const DrawCommand* a = *(const DrawCommand*const*)_a;
+  const DrawCommand* b = *(const DrawCommand*const*)_b;
+  if(a->source != b->source) return a->source < b->source ? -1 : 1;
+  return a < b ? -1 : a > b ? 1 : 0;
+}
+
+/* Whether a command can't touch anything inside l, t, r, b. Triangles and
+   state changes are never culled. */
+static bool Culled(const DrawCommand& c, int l, int t, int r, int b) {
+  int dl, dt, dr, db;
+  if(IsBlit(c.op)) {
+    int w, h;
+    SourceSize(c, w, h);
+    // the same clipping against the source CLIP_FOR_BLIT does
+    int sl = c.sx, st = c.sy, sr = c.sx + c.sw - 1, sb = c.sy + c.sh - 1;
+    dl = c.dx; dt = c.dy;
+    if(sl < 0) { dl -= sl; sl = 0; }
+    if(st < 0) { dt -= st; st = 0; }
+    if(sr >= w) sr = w - 1;
+    if(sb >= h) sb = h - 1;
+    if(sr < sl || sb < st) return true;
+    dr = dl + (sr - sl);
+    db = dt + (sb - st);
+  }
+  else if(c.op == DrawCommand::DRAW_RECT || c.op == DrawCommand::DRAW_BOX) {
+    dl = c.dx; dt = c.dy;
+    dr = c.dx + c.sw - 1; db = c.dy + c.sh - 1;
+    if(dr < dl || db < dt) return true;
+  }
+  else return false;
+  return dr < l || dl > r || db < t || dt > b;
+}
+
+/* Draws the commands onto target, which must have been prepared as in
+   Lua_Replay. If reorder is set, each run of consecutive blits is sorted by
+   source, which is only correct if the order among them doesn't matter.
+   Returns the number of commands that weren't culled. */
+int DrawList::Replay(Drawable* target, bool reorder) throw() {
+  int l, t, r, b;
+  target->GetClipRect(l, t, r, b);
+  size_t live = 0;
+  for(size_t n = 0; n < count; ++n) {
+    if(!Culled(commands[n], l, t, r, b))
+      order[live++] = commands + n;
+  }
+  if(reorder) {
+    size_t n = 0;
+    while(n < live) {
+      if(!IsBlit(order[n]->op)) { ++n; continue; }
+      size_t end = n + 1;
+      while(end < live && IsBlit(order[end]->op)) ++end;
+      if(end - n > 1)
+	qsort(order + n, end - n, sizeof(DrawCommand*), CompareBySource);
+      n = end;
+    }
+  }
+  for(size_t n = 0; n < live; ++n) {
+    const DrawCommand& c = *order[n];
+    switch(c.op) {
+    case DrawCommand::BLIT:
+      if(c.a >= 1) target->BlitRect((Drawable*)c.source, c.sx, c.sy, c.sw, c.sh, c.dx, c.dy);
+      else target->BlitRectT((Drawable*)c.source, c.sx, c.sy, c.sw, c.sh, c.dx, c.dy, c.a);
+      break;
+    case DrawCommand::BLIT_LINEAR:
+      target->BlitRectT((LinearGraphic*)c.source, c.sx, c.sy, c.sw, c.sh, c.dx, c.dy, c.a);
+      break;
+    case DrawCommand::BLIT_RLE:
+      if(c.a >= 1) target->BlitRect((RLEGraphic*)c.source, c.sx, c.sy, c.sw, c.sh, c.dx, c.dy);
+      else target->BlitRectT((RLEGraphic*)c.source, c.sx, c.sy, c.sw, c.sh, c.dx, c.dy, c.a);
+      break;
+    case DrawCommand::BLIT_FRISKET:
+      target->BlitFrisketRect((Frisket*)c.source, c.sx, c.sy, c.sw, c.sh, c.dx, c.dy);
+      break;
+    case DrawCommand::SET_COLOR:
+      target->SetPrimitiveColor(c.r, c.g, c.b, c.a);
+      break;
+    case DrawCommand::SET_COLOR_PREMUL:
+      target->SetPrimitiveColorPremul(c.r, c.g, c.b, c.a);
+      break;
+    case DrawCommand::DRAW_RECT:
+      target->DrawRect(c.dx, c.dy, c.dx + c.sw - 1, c.dy + c.sh - 1);
+      break;
+    case DrawCommand::DRAW_BOX:
+      target->DrawBox(c.dx, c.dy, c.dx + c.sw - 1, c.dy + c.sh - 1, c.sx);
+      break;
+    case DrawCommand::DRAW_TRIANGLES: {
+      size_t n = c.sw < 0 ? c.indices->count : (size_t)c.sw;
+      const Fixed* coords = ((CoordArray*)c.source)->coords;
+      if(c.indices->indices32) target->DrawTriangles(coords, c.indices->indices32, n);
+      else target->DrawTriangles(coords, c.indices->indices, n);
+    } break;
+    }
+  }
+  return live;
+}
+
+int DrawList::Lua_Replay(lua_State* L) throw() {
+  Drawable* target = lua_toobject(L, 1, Drawable);
+  bool reorder = lua_toboolean(L, 2);
+  if(target->has_alpha) return luaL_error(L, "Graphics with alpha channels cannot be modified with this function.");
+  // do everything that could fail before drawing anything
+  for(size_t n = 0; n < count; ++n) {
+    const DrawCommand& c = commands[n];
+    if(c.op == DrawCommand::BLIT) {
+      Drawable* gfk = (Drawable*)c.source;
+      if(DrawablesOverlap(gfk, target)) return luaL_error(L, "Source and destination Drawable must not overlap");
+      if(!MatchLayouts(gfk, target))
+	return luaL_error(L, "Attempt to blit between two non-morphable Drawables!");
+    }
+    else if(c.op == DrawCommand::BLIT_RLE)
+      ((RLEGraphic*)c.source)->ChangeLayout(target->layout);
+  }
+  lua_pushnumber(L, Replay(target, reorder));
+  return 1;
+}
+
+static const struct ObjectMethod DLMethods[] = {
+  METHOD("Blit", &DrawList::Lua_Blit),
+  METHOD("BlitFrisket", &DrawList::Lua_BlitFrisket),
+  METHOD("AddBlits", &DrawList::Lua_AddBlits),
+  METHOD("SetPrimitiveColor", &DrawList::Lua_SetPrimitiveColor),
+  METHOD("SetPrimitiveColorPremul", &DrawList::Lua_SetPrimitiveColorPremul),
+  METHOD("DrawRect", &DrawList::Lua_DrawRect),
+  METHOD("DrawBox", &DrawList::Lua_DrawBox),
+  METHOD("DrawTriangles", &DrawList::Lua_DrawTriangles),
+  METHOD("Clear", &DrawList::Lua_Clear),
+  METHOD("GetCount", &DrawList::Lua_GetCount),
+  METHOD("Replay", &DrawList::Lua_Replay),
+  NOMOREMETHODS(),
+};
+PROTOCOL_IMP(DrawList, Object, DLMethods);
+
+SUBCRITICAL_CONSTRUCTOR(DrawList)(lua_State* L) {
+  DrawList* p = new DrawList();
+  p->Push(L);
+  return 1;
+}
@@ -19,6 +19,7 @@
   Please see doc/license.html for clarifications.
  */
 #include "graphics.h"
+#include "blitkernels.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -29,11 +30,12 @@ using namespace SubCritical;
 
 #define PREFERRED_ALIGNMENT 1
 
-Drawable::Drawable() : has_alpha(false),simple_alpha(true),buffer(NULL) {}
+Drawable::Drawable() : has_alpha(false),simple_alpha(true),premultiplied(false),buffer(NULL),damage(NULL),damage_count(0),cull_winding(0) {}
 
 static const struct ObjectMethod CAMethods[] = {
   METHOD("GetCount", &CoordArray::Lua_GetCount),
   METHOD("GetCoord", &CoordArray::Lua_GetCoord),
+  METHOD("Update", &CoordArray::Lua_Update),
   NOMOREMETHODS(),
 };
 PROTOCOL_IMP(CoordArray, Object, CAMethods);
@@ -42,6 +44,8 @@ static const struct ObjectMethod IAMethods[] = {
   METHOD("GetIndex", &IndexArray::Lua_GetIndex),
   METHOD("GetRealCount", &IndexArray::Lua_GetRealCount),
   METHOD("SetActiveRange", &IndexArray::Lua_SetActiveRange),
+  METHOD("IsWide", &IndexArray::Lua_IsWide),
+  METHOD("Update", &IndexArray::Lua_Update),
   NOMOREMETHODS(),
 };
 PROTOCOL_IMP(IndexArray, Object, IAMethods);
@@ -55,20 +59,21 @@ int Drawable::PadWidth(int width) {
   return force_align(width);
 }
 
-Graphic::Graphic(int width, int height, FBLayout layout) {
+Graphic::Graphic(int width, int height, FBLayout layout, bool clear) : pending_layout(layout), views(NULL) {
   this->width = width;
   this->height = height;
   this->layout = layout;
-  SetupDrawable();
+  SetupDrawable(false, clear);
 }
 
-Graphic::Graphic(Drawable& other) {
+Graphic::Graphic(Drawable& other) : pending_layout(other.layout), views(NULL) {
   this->width = other.width;
   this->height = other.height;
   this->layout = other.layout;
   SetupDrawable();
   this->has_alpha = other.has_alpha;
   this->simple_alpha = other.simple_alpha;
+  this->premultiplied = other.premultiplied;
   if(other.fake_alpha) {
     Pixel mask;
     switch(layout) {
@@ -105,56 +110,90 @@ Frisket::Frisket(int width, int height) : width(width), height(height) {
   clip_top = 0; clip_bottom = height - 1;
 }
 
-static void EndianSwapPixels(Pixel* p, size_t rem) throw() {
-  UNROLL_MORE(rem,
-	      *p = (*p >> 24) | ((*p >> 8) & 0xFF00) | ((*p << 8) & 0xFF0000) | (*p << 24);
-	      ++p;);
+/* Which swizzle kernel rearranges pixels from one layout into another, or -1
+   if we don't know. */
+static int LayoutSwitch(FBLayout layout, FBLayout nulayout) {
+  if(nulayout == (layout ^ FB_ENDIAN_SWAP_MASK)) return SWIZZLE_ENDIAN;
+  else if((nulayout == FB_xRGB && layout == FB_RGBx) ||
+	  (nulayout == FB_xBGR && layout == FB_BGRx)) return SWIZZLE_ROTATE_RIGHT;
+  else if((nulayout == FB_RGBx && layout == FB_xRGB) ||
+	  (nulayout == FB_BGRx && layout == FB_xBGR)) return SWIZZLE_ROTATE_LEFT;
+  else if((nulayout == FB_BGRx && layout == FB_RGBx) ||
+	  (nulayout == FB_RGBx && layout == FB_BGRx)) return SWIZZLE_SWAP_EVEN;
+  else if((nulayout == FB_xBGR && layout == FB_xRGB) ||
+	  (nulayout == FB_xRGB && layout == FB_xBGR)) return SWIZZLE_SWAP_ODD;
+  else return -1;
 }
 
-static void RotateRightPixels(Pixel* p, size_t rem) throw() {
-  UNROLL_MORE(rem,
-	      *p = (*p >> 8) | (*p << 24);
-	      ++p;);
+bool SubCritical::ConvertPixels(Pixel* dst, const Pixel* src, size_t count, FBLayout from, FBLayout to) throw() {
+  if(!count) return true;
+  if(from == to) {
+    if(dst != src) memmove(dst, src, count * sizeof(Pixel));
+    return true;
+  }
+  int swizzle = LayoutSwitch(from, to);
+  if(swizzle < 0) return false;
+  blit_kernels->swizzle[swizzle](dst, src, count);
+  return true;
 }
 
-static void RotateLeftPixels(Pixel* p, size_t rem) throw() {
-  UNROLL_MORE(rem,
-	      *p = (*p << 8) | (*p >> 24);
-	      ++p;);
+void Graphic::ChangeLayout(FBLayout nulayout) throw() {
+  if(nulayout == layout && pending_layout == layout) return;
+  if(IsA("GraphicView") && ((GraphicView*)this)->root) {
+    // the whole buffer has to change, not just our part of it
+    ((GraphicView*)this)->root->ChangeLayout(nulayout);
+    return;
+  }
+  pending_layout = nulayout;
+  for(GraphicView* v = views; v; v = v->next_view) v->pending_layout = nulayout;
+  if(nulayout == layout) return;
+  int swizzle = LayoutSwitch(layout, nulayout);
+  if(swizzle < 0)
+    fprintf(stderr, "Warning: Unknown layout switch path: %i -> %i\nLEAVING PIXEL DATA ALONE BUT SETTING THE NEW LAYOUT ANYWAY\n", layout, nulayout);
+  else
+    for(Pixel*restrict* p = rows; p < rows + height; ++p)
+      blit_kernels->swizzle[swizzle](*p, *p, width);
+  layout = nulayout;
+  UpdateShifts();
+  for(GraphicView* v = views; v; v = v->next_view) {
+    v->layout = nulayout;
+    v->UpdateShifts();
+  }
 }
 
-static void SwapEvenComponentPixels(Pixel* p, size_t rem) throw() {
-  UNROLL_MORE(rem,
-	      *p = (*p & 0x00FF00FF) | ((*p >> 16) & 0x0000FF00) | ((*p << 16) & 0xFF000000);
-	      ++p;);
+void Graphic::ChangeLayoutLazily(FBLayout nulayout) throw() {
+  if(IsA("GraphicView") && ((GraphicView*)this)->root)
+    ((GraphicView*)this)->root->ChangeLayoutLazily(nulayout);
+  else {
+    pending_layout = nulayout;
+    for(GraphicView* v = views; v; v = v->next_view) v->pending_layout = nulayout;
+  }
 }
 
-static void SwapOddComponentPixels(Pixel* p, size_t rem) throw() {
-  UNROLL_MORE(rem,
-	      *p = (*p & 0xFF00FF00) | ((*p >> 16) & 0x000000FF) | ((*p << 16) & 0x00FF0000);
-	      ++p;);
+bool SubCritical::MatchLayouts(Drawable* src, Drawable* dst) throw() {
+  if(src->layout == dst->layout) return true;
+  bool src_morphable = src->IsA("Graphic"), dst_morphable = dst->IsA("Graphic");
+  if(dst_morphable && ((Graphic*)dst)->pending_layout == src->layout)
+    ((Graphic*)dst)->ChangeLayout(src->layout);
+  else if(src_morphable)
+    ((Graphic*)src)->ChangeLayout(dst->layout);
+  else if(dst_morphable)
+    ((Graphic*)dst)->ChangeLayout(src->layout);
+  else
+    return false;
+  return true;
 }
 
-void Graphic::ChangeLayout(FBLayout nulayout) throw() {
-  void(*func)(Pixel*, size_t);
+Graphic::~Graphic() {
+  // normally views keep us alive, but they may be collected in the same cycle
+  for(GraphicView* v = views; v; v = v->next_view) v->root = NULL;
+}
+
+void RLEGraphic::ChangeLayout(FBLayout nulayout) throw() {
   if(nulayout == layout) return;
-  if(nulayout == (layout ^ FB_ENDIAN_SWAP_MASK)) func = EndianSwapPixels;
-  else if((nulayout == FB_xRGB && layout == FB_RGBx) ||
-	  (nulayout == FB_xBGR && layout == FB_BGRx)) func = RotateRightPixels;
-  else if((nulayout == FB_RGBx && layout == FB_xRGB) ||
-	  (nulayout == FB_BGRx && layout == FB_xBGR)) func = RotateLeftPixels;
-  else if((nulayout == FB_BGRx && layout == FB_RGBx) ||
-	  (nulayout == FB_RGBx && layout == FB_BGRx)) func = SwapEvenComponentPixels;
-  else if((nulayout == FB_xBGR && layout == FB_xRGB) ||
-	  (nulayout == FB_xRGB && layout == FB_xBGR)) func = SwapOddComponentPixels;
-  else {
+  if(!ConvertPixels(pixels, pixels, pixel_count, layout, nulayout))
     fprintf(stderr, "Warning: Unknown layout switch path: %i -> %i\nLEAVING PIXEL DATA ALONE BUT SETTING THE NEW LAYOUT ANYWAY\n", layout, nulayout);
-    layout = nulayout;
-    return;
-  }
-  for(Pixel*restrict* p = rows; p < rows + height; ++p) func(*p, width);
   layout = nulayout;
-  UpdateShifts();
 }
 
 void Graphic::CheckAlpha() throw() {
@@ -181,7 +220,70 @@ void Graphic::CheckAlpha() throw() {
 	   }
 	   ++q);
   }
-  if(!has_alpha) simple_alpha = false;
+  if(!has_alpha) { simple_alpha = false; premultiplied = false; }
+}
+
+void Graphic::Premultiply() throw() {
+  if(premultiplied || !has_alpha) return;
+  Pixel mask = 255 << ash;
+  for(Pixel*restrict*restrict p = rows; p < rows + height; ++p) {
+    Pixel*restrict q = *p;
+    size_t rem = width;
+    uint32_t a;
+    UNROLL(rem,
+	   a = (*q >> ash) & 255;
+	   if(a == 0) *q = 0;
+	   else if(a != 255) {
+	     a += a & 1;
+	     *q = ((Pixel)LinearToSrgb[((uint32_t)SrgbToLinear[(*q >> rsh) & 255] * a) >> 8] << rsh)
+	       | ((Pixel)LinearToSrgb[((uint32_t)SrgbToLinear[(*q >> gsh) & 255] * a) >> 8] << gsh)
+	       | ((Pixel)LinearToSrgb[((uint32_t)SrgbToLinear[(*q >> bsh) & 255] * a) >> 8] << bsh)
+	       | (*q & mask);
+	   }
+	   ++q);
+  }
+  premultiplied = true;
+}
+
+static inline uint32_t unpremul(uint32_t c, uint32_t a) {
+  uint32_t ret = (((uint32_t)SrgbToLinear[c] << 8) + (a >> 1)) / a;
+  return ret > 65535 ? 65535 : ret;
+}
+
+void Graphic::Unpremultiply() throw() {
+  if(!premultiplied) return;
+  Pixel mask = 255 << ash;
+  for(Pixel*restrict*restrict p = rows; p < rows + height; ++p) {
+    Pixel*restrict q = *p;
+    size_t rem = width;
+    uint32_t a;
+    UNROLL(rem,
+	   a = (*q >> ash) & 255;
+	   if(a != 0 && a != 255) {
+	     a += a & 1;
+	     *q = ((Pixel)LinearToSrgb[unpremul((*q >> rsh) & 255, a)] << rsh)
+	       | ((Pixel)LinearToSrgb[unpremul((*q >> gsh) & 255, a)] << gsh)
+	       | ((Pixel)LinearToSrgb[unpremul((*q >> bsh) & 255, a)] << bsh)
+	       | (*q & mask);
+	   }
+	   ++q);
+  }
+  premultiplied = false;
+}
+
+int Graphic::Lua_Premultiply(lua_State* L) throw() {
+  Premultiply();
+  return 0;
+}
+
+int Graphic::Lua_Unpremultiply(lua_State* L) throw() {
+  Unpremultiply();
+  return 0;
+}
+
+int Graphic::Lua_IsPremultiplied(lua_State* L) const throw() {
+  lua_pushboolean(L, premultiplied);
+  return 1;
 }
 
 int Drawable::Lua_GetSize(lua_State* L) const throw() {
@@ -219,7 +321,8 @@ int Frisket::Lua_GetRawFrixel(lua_State* L) const throw() {
 int Graphic::Lua_OptimizeFor(lua_State* L) restrict throw() {
   Drawable*restrict dev = lua_toobject(L, 1, Drawable);
   if(dev == this) return luaL_error(L, "Source and destination Frisket must differ");
-  ChangeLayout(dev->layout);
+  if(lua_toboolean(L, 2)) ChangeLayoutLazily(dev->layout);
+  else ChangeLayout(dev->layout);
   return 0;
 }
 
@@ -234,6 +337,9 @@ Frisket::~Frisket() {
 
 static const struct ObjectMethod GMethods[] = {
   METHOD("OptimizeFor", &Graphic::Lua_OptimizeFor),
+  METHOD("Premultiply", &Graphic::Lua_Premultiply),
+  METHOD("Unpremultiply", &Graphic::Lua_Unpremultiply),
+  METHOD("IsPremultiplied", &Graphic::Lua_IsPremultiplied),
   NOMOREMETHODS(),
 };
 PROTOCOL_IMP(Graphic, Drawable, GMethods);
@@ -252,9 +358,10 @@ static const struct ObjectMethod FMethods[] = {
 };
 PROTOCOL_IMP(Frisket, Object, FMethods);
 
-void Drawable::SetupDrawable(bool invert_y) throw() {
+void Drawable::SetupDrawable(bool invert_y, bool clear) throw() {
   int pitch = force_align(width);
-  buffer = (Pixel*)calloc(1, pitch * height * sizeof(Pixel) + height * sizeof(Pixel*));
+  buffer_size = pitch * height * sizeof(Pixel) + height * sizeof(Pixel*);
+  buffer = (Pixel*)AllocPixels(buffer_size, clear);
   assert(buffer);
   rows = (Pixel*restrict*)(buffer + pitch * height);
   if(invert_y) for(Pixel*restrict* p = rows + height - 1; p >= rows; --p) {
@@ -304,9 +411,10 @@ void Drawable::UpdateShifts() {
 }
 
 Drawable::~Drawable() {
+  free(damage);
   if(buffer) {
     if(merged_rows)
-      free((void*)buffer);
+      FreePixels((void*)buffer, buffer_size);
     else {
       // buffer was allocated somewhere else
       Pixel** _rows = (Pixel**)rows; // work around restrict qualifier
@@ -597,9 +705,11 @@ CoordArray::~CoordArray() {
   free((void*)coords);
 }
 
-IndexArray::IndexArray(size_t count) : count(count), real_count(count) {
-  indices = (Index*)calloc(sizeof(Index), count);
+IndexArray::IndexArray(size_t count, bool wide) : count(count), indices(NULL), indices32(NULL), real_count(count), real_indices(NULL), real_indices32(NULL) {
+  if(wide) indices32 = (Index32*)calloc(sizeof(Index32), count);
+  else indices = (Index*)calloc(sizeof(Index), count);
   real_indices = indices;
+  real_indices32 = indices32;
 }
 
 int IndexArray::Lua_GetCount(lua_State* L) const throw() {
@@ -624,16 +734,22 @@ int IndexArray::Lua_GetIndex(lua_State* L) const throw() {
   lua_Integer index = luaL_checkinteger(L, 1);
   if(index < 0 || index >= (lua_Integer)count)
     return luaL_error(L, "index out of range");
-  lua_pushnumber(L, indices[index]);
+  lua_pushnumber(L, GetIndex(index));
+  return 1;
+}
+
+int IndexArray::Lua_IsWide(lua_State* L) const throw() {
+  lua_pushboolean(L, IsWide());
   return 1;
 }
 
 IndexArray::~IndexArray() {
-  free((void*)indices);
+  free((void*)real_indices);
+  free((void*)real_indices32);
 }
 
 SUBCRITICAL_UTILITY(CompileCoords)(lua_State* L) {
-  if(!lua_istable(L,1)) return luaL_typerror(L, 1, "table");
+  if(!lua_istable(L,1)) return CoordArray::Lua_CompilePacked(L);
   int count = lua_rawlen(L, 1);
   if(count <= 0) return 0;
   count /= 2;
@@ -652,11 +768,21 @@ SUBCRITICAL_UTILITY(CompileCoords)(lua_State* L) {
   return 1;
 }
 
+/* Indices that all fit in 16 bits make a narrow IndexArray, unless wide is
+   passed; any bigger index makes a wide one. */
 SUBCRITICAL_UTILITY(CompileIndices)(lua_State* L) {
-  if(!lua_istable(L,1)) return luaL_typerror(L, 1, "table");
+  if(!lua_istable(L,1)) return IndexArray::Lua_CompilePacked(L);
   int count = lua_rawlen(L, 1);
   if(count <= 0) return 0;
-  IndexArray* ret = new IndexArray(count);
+  bool wide = lua_toboolean(L, 2);
+  for(int n = 0; n < count && !wide; ++n) {
+    lua_rawgeti(L, 1, n + 1);
+    if(!lua_isnumber(L, -1))
+      return luaL_error(L, "CompileIndices was given a table containing a non-number!");
+    if(lua_tonumber(L, -1) > 65535) wide = true;
+    lua_pop(L,1);
+  }
+  IndexArray* ret = new IndexArray(count, wide);
   for(int n = 0; n < count; ++n) {
     lua_rawgeti(L, 1, n + 1);
     if(!lua_isnumber(L, -1)) {
@@ -664,8 +790,11 @@ SUBCRITICAL_UTILITY(CompileIndices)(lua_State* L) {
       return luaL_error(L, "CompileIndices was given a table containing a non-number!");
     }
     lua_Number num = lua_tonumber(L,-1);
-    if(num < 0 || num > 65535) return luaL_error(L, "Indices must be in the range 0-65535. Consider splitting into multiple CoordArrays.");
-    ret->indices[n] = (int)num;
+    if(num < 0 || num > 4294967295.0) {
+      delete ret;
+      return luaL_error(L, "Indices must be in the range 0-4294967295.");
+    }
+    ret->SetIndex(n, (Index32)num);
     lua_pop(L,1);
   }
   ret->Push(L);
@@ -737,8 +866,13 @@ static const struct ObjectMethod DMethods[] = {
   METHOD("GetSize", &Drawable::Lua_GetSize),
   METHOD("GetClipRect", &Drawable::Lua_GetClipRect),
   METHOD("SetClipRect", &Drawable::Lua_SetClipRect),
+  METHOD("SetDamageTracking", &Drawable::Lua_SetDamageTracking),
+  METHOD("AddDamage", &Drawable::Lua_AddDamage),
+  METHOD("GetDamage", &Drawable::Lua_GetDamage),
+  METHOD("ClearDamage", &Drawable::Lua_ClearDamage),
   METHOD("SetPrimitiveColor", &Drawable::Lua_SetPrimitiveColor),
   METHOD("SetPrimitiveColorPremul", &Drawable::Lua_SetPrimitiveColorPremul),
+  METHOD("SetTriangleCulling", &Drawable::Lua_SetTriangleCulling),
   METHOD("DrawBox", &Drawable::Lua_DrawBox),
   METHOD("DrawRect", &Drawable::Lua_DrawRect),
   METHOD("DrawPoints", &Drawable::Lua_DrawPoints),
@@ -748,9 +882,12 @@ static const struct ObjectMethod DMethods[] = {
   METHOD("DrawTriangles", &Drawable::Lua_DrawTriangles),
   METHOD("DrawTriangleStrip", &Drawable::Lua_DrawTriangleStrip),
   METHOD("DrawTriangleFan", &Drawable::Lua_DrawTriangleFan),
+  METHOD("DrawTrianglesAA", &Drawable::Lua_DrawTrianglesAA),
+  METHOD("DrawPolygonAA", &Drawable::Lua_DrawPolygonAA),
   METHOD("Copy", &Drawable::Lua_Copy),
   METHOD("Modulate", &Drawable::Lua_Modulate),
   METHOD("Blit", &Drawable::Lua_Blit),
+  METHOD("BlitTransformed", &Drawable::Lua_BlitTransformed),
   METHOD("BlitFrisket", &Drawable::Lua_BlitFrisket),
   METHOD("TakeSnapshot", &Drawable::Lua_TakeSnapshot),
   METHOD("GetPixel", &Drawable::Lua_GetPixel),
@@ -764,6 +901,7 @@ PROTOCOL_IMP(Drawable, Object, DMethods);
 
 static const struct ObjectMethod GDMethods[] = {
   METHOD("Update", &GraphicsDevice::Lua_Update),
+  METHOD("UpdateDamaged", &GraphicsDevice::Lua_UpdateDamaged),
   METHOD("GetEvent", &GraphicsDevice::Lua_GetEvent),
   METHOD("GetMousePos", &GraphicsDevice::Lua_GetMousePos),
   METHOD("GetScreenModes", &GraphicsDevice::Lua_GetScreenModes),
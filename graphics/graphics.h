@@ -36,44 +36,79 @@ namespace SubCritical {
   typedef uint8_t Frixel;
   typedef int32_t Fixed;
   typedef uint16_t Index;
+  typedef uint32_t Index32;
+  /* Pixel buffers for Graphics come from here. Freed buffers are kept for
+     reuse, up to the limit set by SetPixelPoolLimit (initially 0, which
+     disables pooling). AllocPixels may round size up. */
+  EXPORT void* AllocPixels(size_t& size, bool clear = true) throw();
+  EXPORT void FreePixels(void* buffer, size_t size) throw();
+  EXPORT size_t SetPixelPoolLimit(size_t bytes) throw();
   class EXPORT CoordArray : public Object {
   public:
     CoordArray(size_t count);
     virtual ~CoordArray();
     int Lua_GetCount(lua_State* L) const throw();
     int Lua_GetCoord(lua_State* L) const throw();
+    int Lua_Update(lua_State* L) throw();
+    // CompileCoords, given packed data instead of a table
+    LOCAL static int Lua_CompilePacked(lua_State* L) throw();
     PROTOCOL_PROTOTYPE();
     size_t count;
     Fixed* coords;
   };
+  /* A wide IndexArray holds 32-bit indices in indices32, and its indices is
+     NULL; otherwise it's the other way around. */
   class EXPORT IndexArray : public Object {
   public:
-    IndexArray(size_t count);
+    IndexArray(size_t count, bool wide = false);
     virtual ~IndexArray();
     int Lua_GetCount(lua_State* L) const throw();
     int Lua_GetIndex(lua_State* L) const throw();
     inline size_t GetRealCount() const throw() { return real_count; }
     int Lua_GetRealCount(lua_State* L) const throw();
+    inline bool IsWide() const throw() { return real_indices32 != NULL; }
+    int Lua_IsWide(lua_State* L) const throw();
+    inline Index32 GetIndex(size_t n) const throw() {
+      return indices32 ? indices32[n] : indices[n];
+    }
+    inline void SetIndex(size_t n, Index32 index) throw() {
+      if(indices32) indices32[n] = index;
+      else indices[n] = (Index)index;
+    }
     inline void SetActiveRange(size_t first, size_t count) throw() {
       if(first >= real_count) first = real_count; // count will be 0
       if(count + first > real_count) count = real_count - first;
       this->count = count;
-      this->indices = real_indices + first;
+      if(real_indices32) this->indices32 = real_indices32 + first;
+      else this->indices = real_indices + first;
     }
     int Lua_SetActiveRange(lua_State* L) throw();
+    int Lua_Update(lua_State* L) throw();
+    // CompileIndices, given packed data instead of a table
+    LOCAL static int Lua_CompilePacked(lua_State* L) throw();
     PROTOCOL_PROTOTYPE();
     size_t count;
     Index* indices;
+    Index32* indices32;
   private:
     size_t real_count;
     Index* real_indices;
+    Index32* real_indices32;
   };
+  /* Reads count numbers of packed data (as CompileCoords takes) from the
+     stack at index, in the format named at format_index. A PackedArray is
+     replaced on the stack by its Dump. Raises a Lua error if there's too
+     little data or the format is unknown. */
+  EXPORT void ReadPackedNumbers(lua_State* L, int index, int format_index, lua_Number* out, size_t count) throw();
   // Drivers are likely to be dependent on the exact order of members of this
   // enumeration.
   enum FBLayout {
     FB_xRGB=0, FB_RGBx=1, FB_BGRx=2, FB_xBGR=3,
     FB_ENDIAN_SWAP_MASK=2,
   };
+  /* Rearranges count pixels from src, in layout from, into dst in layout to.
+     dst may be src. Returns false if there's no way to do that. */
+  EXPORT bool ConvertPixels(Pixel* dst, const Pixel* src, size_t count, enum FBLayout from, enum FBLayout to) throw();
   class EXPORT Frisket : public Object {
   public:
     Frisket(int width, int height);
@@ -109,8 +144,15 @@ namespace SubCritical {
     Frixel*restrict* rows;
     Frixel* buffer;
   };
+  /* An inclusive rect, as used by damage tracking. */
+  struct DamageRect {
+    int l, t, r, b;
+  };
   class Drawable;
   class Graphic;
+  class GraphicView;
+  class LinearGraphic;
+  class RLEGraphic;
   class EXPORT Drawable : public Object {
   public:
     virtual ~Drawable();
@@ -121,8 +163,16 @@ namespace SubCritical {
     void Blit(const Drawable*restrict, int dx, int dy) restrict throw();
     void BlitRectT(const Drawable*restrict, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number a) restrict throw();
     void BlitT(const Drawable*restrict, int dx, int dy, lua_Number a) restrict throw();
+    void CopyRect(const LinearGraphic*restrict, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw();
+    void BlitRectT(const LinearGraphic*restrict, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number a) restrict throw();
+    void BlitRect(const RLEGraphic*restrict, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw();
+    void BlitRectT(const RLEGraphic*restrict, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number a) restrict throw();
     int Lua_Copy(lua_State* L) restrict throw();
     int Lua_Blit(lua_State* L) restrict throw();
+    /* m is {xx, yx, xy, yy, xz, yz}, mapping source (relative to sx, sy) to
+       destination coordinates */
+    void BlitTransformed(const Drawable*restrict, int sx, int sy, int sw, int sh, const lua_Number m[6], bool bilinear, lua_Number a) restrict throw();
+    int Lua_BlitTransformed(lua_State* L) restrict throw();
     void ModulateRect(const Drawable*restrict, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw();
     void Modulate(const Drawable*restrict, int dx, int dy) restrict throw();
     void ModulateRect2(const Drawable*restrict, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw();
@@ -136,14 +186,21 @@ namespace SubCritical {
     void SetPrimitiveColor(lua_Number r, lua_Number g, lua_Number b, lua_Number a) throw();
     void SetPrimitiveColorPremul(lua_Number r, lua_Number g, lua_Number b, lua_Number a) throw();
     void DrawPoints(int size, const Fixed* coords, size_t pointcount) throw();
-    void DrawLines(lua_Number width, lua_Number height, const Fixed* coords, const Index* indices, size_t indexcount) throw();
-    void DrawLineStrip(lua_Number width, lua_Number height, const Fixed* coords, const Index* indices, size_t indexcount) throw();
-    void DrawLineLoop(lua_Number width, lua_Number height, const Fixed* coords, const Index* indices, size_t indexcount) throw();
-    void DrawTriangles(const Fixed* coords, const Index* indices, size_t indexcount) throw();
-    void DrawTriangleStrip(const Fixed* coords, const Index* indices, size_t indexcount) throw();
-    void DrawTriangleFan(const Fixed* coords, const Index* indices, size_t indexcount) throw();
+    /* 1 draws only clockwise triangles, -1 only counter-clockwise ones, 0
+       all of them */
+    void SetTriangleCulling(int winding) throw();
+    // I is Index or Index32
+    template<class I> void DrawLines(lua_Number width, lua_Number height, const Fixed* coords, const I* indices, size_t indexcount) throw();
+    template<class I> void DrawLineStrip(lua_Number width, lua_Number height, const Fixed* coords, const I* indices, size_t indexcount) throw();
+    template<class I> void DrawLineLoop(lua_Number width, lua_Number height, const Fixed* coords, const I* indices, size_t indexcount) throw();
+    template<class I> void DrawTriangles(const Fixed* coords, const I* indices, size_t indexcount) throw();
+    template<class I> void DrawTriangleStrip(const Fixed* coords, const I* indices, size_t indexcount) throw();
+    template<class I> void DrawTriangleFan(const Fixed* coords, const I* indices, size_t indexcount) throw();
+    template<class I> void DrawTrianglesAA(const Fixed* coords, const I* indices, size_t indexcount) throw();
+    template<class I> void DrawPolygonAA(const Fixed* coords, const I* indices, size_t count) throw();
     int Lua_SetPrimitiveColor(lua_State* L) throw();
     int Lua_SetPrimitiveColorPremul(lua_State* L) throw();
+    int Lua_SetTriangleCulling(lua_State* L) throw();
     int Lua_DrawPoints(lua_State* L) throw();
     int Lua_DrawLines(lua_State* L) throw();
     int Lua_DrawLineStrip(lua_State* L) throw();
@@ -151,6 +208,8 @@ namespace SubCritical {
     int Lua_DrawTriangles(lua_State* L) throw();
     int Lua_DrawTriangleStrip(lua_State* L) throw();
     int Lua_DrawTriangleFan(lua_State* L) throw();
+    int Lua_DrawTrianglesAA(lua_State* L) throw();
+    int Lua_DrawPolygonAA(lua_State* L) throw();
     void DrawBox(int l, int t, int r, int b, int sz) throw();
     int Lua_DrawBox(lua_State* L) throw();
     void DrawRect(int l, int t, int r, int b) throw();
@@ -159,8 +218,19 @@ namespace SubCritical {
     int Lua_SetClipRect(lua_State* L) throw();
     void GetClipRect(int& l, int& t, int& r, int& b) throw();
     int Lua_GetClipRect(lua_State* L) throw();
+    /* Damage tracking: while enabled, every blit and primitive adds the
+       area it touched to a short list of rects. */
+    void SetDamageTracking(bool enabled) throw();
+    void AddDamage(int l, int t, int r, int b) throw();
+    void ClearDamage() throw();
+    int Lua_SetDamageTracking(lua_State* L) throw();
+    int Lua_AddDamage(lua_State* L) throw();
+    int Lua_GetDamage(lua_State* L) throw();
+    int Lua_ClearDamage(lua_State* L) throw();
     int width, height;
     bool has_alpha, simple_alpha, fake_alpha;
+    // color channels have already been multiplied by alpha (see Premultiply)
+    bool premultiplied;
     enum FBLayout layout;
     Pixel*restrict* rows;
     Pixel* buffer;
@@ -173,18 +243,31 @@ namespace SubCritical {
     int Lua_GetRawAlpha(lua_State* L) const throw();
     int Lua_GetSRGBPixel(lua_State* L) const throw();
   protected:
-    void SetupDrawable(bool invert_y = false) throw();
+    // if clear is false, the pixels start out undefined
+    void SetupDrawable(bool invert_y = false, bool clear = true) throw();
     void SetupDrawable(void* buffer, int32_t pitch) throw();
     void UpdateShifts();
     Drawable();
+    uint8_t rsh, gsh, bsh, ash;
+    // NULL unless damage tracking is enabled
+    DamageRect* damage;
+    int damage_count;
   private:
+    friend class LinearGraphic;
+    friend class RLEGraphic;
     bool merged_rows;
+    size_t buffer_size;
     int clip_left, clip_top, clip_right, clip_bottom;
     bool primitive_alpha;
     Pixel op_p;
     uint16_t tr_r, tr_g, tr_b; uint32_t tr_a;
     uint16_t trf_r, trf_g, trf_b, trf_a;
-    uint8_t rsh, gsh, bsh, ash;
+    int cull_winding;
+    inline bool Culled(const Fixed* a, const Fixed* b, const Fixed* c, bool flip) const throw() {
+      int64_t area = (int64_t)(b[0] - a[0]) * (c[1] - a[1]) - (int64_t)(b[1] - a[1]) * (c[0] - a[0]);
+      return (flip ? -cull_winding : cull_winding) > 0 ? area <= 0 : area >= 0;
+    }
+    template<class I> LOCAL void DamageCoords(const Fixed* coords, const I* indices, size_t count, Fixed pad) throw();
     //LOCAL void DrawSpan(int y, Fixed l, Fixed r);
     //LOCAL void DrawSpanA(int y, Fixed l, Fixed r);
     LOCAL void NoclipDrawSpan(int y, Fixed l, Fixed r);
@@ -196,24 +279,214 @@ namespace SubCritical {
     //LOCAL void DrawQuadA(const Fixed* top, const Fixed* left, const Fixed* right, const Fixed* bot);
     LOCAL void DrawQuadLine(Fixed width, Fixed height, const Fixed*restrict top, const Fixed*restrict bot);
     LOCAL void ClipNDrawTriangle(const Fixed*restrict a, const Fixed*restrict b, const Fixed*restrict c) throw();
-    LOCAL void DrawTriangle(const Fixed*restrict a, const Fixed*restrict b, const Fixed*restrict c) throw();
-    LOCAL void DrawTriangleL(const Fixed*restrict top, const Fixed*restrict mid, const Fixed*restrict bot) throw();
-    LOCAL void DrawTriangleR(const Fixed*restrict top, const Fixed*restrict mid, const Fixed*restrict bot) throw();
+    // these only draw rows first through last-1
+    LOCAL void ClipNDrawTriangle(const Fixed*restrict a, const Fixed*restrict b, const Fixed*restrict c, int first, int last) throw();
+    LOCAL void DrawTriangle(const Fixed*restrict a, const Fixed*restrict b, const Fixed*restrict c, int first, int last) throw();
+    LOCAL void DrawTriangleL(const Fixed*restrict top, const Fixed*restrict mid, const Fixed*restrict bot, int first, int last) throw();
+    LOCAL void DrawTriangleR(const Fixed*restrict top, const Fixed*restrict mid, const Fixed*restrict bot, int first, int last) throw();
+    template<class I> LOCAL bool DrawTrianglesBinned(const Fixed* coords, const I* indices, size_t indexcount, int mode) throw();
+    template<class I> LOCAL static void TriangleBand(void* ctx, int first, int last);
+    LOCAL void FillCoverage(float* acc, int l, int t, int w, int h) throw();
   };
   class EXPORT Graphic : public Drawable {
   public:
-    Graphic(int width, int height, FBLayout layout);
+    Graphic(int width, int height, FBLayout layout, bool clear = true);
     Graphic(Drawable& other);
     void CheckAlpha() throw();
     void ChangeLayout(enum FBLayout newlayout) throw();
+    /* Like ChangeLayout, but the pixels are left alone until something needs
+       them in a particular layout (see MatchLayouts), which may never
+       happen. */
+    void ChangeLayoutLazily(enum FBLayout newlayout) throw();
     int Lua_OptimizeFor(lua_State* L) restrict throw();
+    void Premultiply() throw();
+    void Unpremultiply() throw();
+    int Lua_Premultiply(lua_State* L) throw();
+    int Lua_Unpremultiply(lua_State* L) throw();
+    int Lua_IsPremultiplied(lua_State* L) const throw();
+    PROTOCOL_PROTOTYPE();
+    virtual ~Graphic();
+    // the layout ChangeLayoutLazily asked for; the same as layout if none
+    enum FBLayout pending_layout;
+  protected:
+    Graphic() : views(NULL) {}
+  private:
+    friend class GraphicView;
+    // views sharing our buffer, which must be kept in our layout
+    GraphicView* views;
+  };
+  /* Gets two Drawables into the same layout before copying pixels from src to
+     dst, by changing whichever is a Graphic (preferring one that was already
+     going to change to the other's layout, then src). Returns false if
+     neither can be changed. */
+  EXPORT bool MatchLayouts(Drawable* src, Drawable* dst) throw();
+  /* True if writing to one of these Drawables could change the other's
+     pixels, i.e. if they're the same or are overlapping views of the same
+     Graphic. The blits assume their source and destination don't overlap. */
+  EXPORT bool DrawablesOverlap(const Drawable* a, const Drawable* b) throw();
+  /* Part of a Graphic's pixels, shared rather than copied. A view of a view
+     refers directly to the original Graphic, and a Graphic and all of its
+     views always have the same layout. */
+  class EXPORT GraphicView : public Graphic {
+  public:
+    GraphicView(Graphic* parent, int x, int y, int width, int height);
+    virtual ~GraphicView();
+    int Lua_GetOffset(lua_State* L) const throw();
+    PROTOCOL_PROTOTYPE();
+  private:
+    friend class Graphic;
+    friend bool DrawablesOverlap(const Drawable* a, const Drawable* b) throw();
+    // NULL if the Graphic went away first (only possible while collecting)
+    Graphic* root;
+    int xoff, yoff;
+    GraphicView* prev_view, *next_view;
+  };
+  /* Creates a view of the Graphic at the given stack index, which must be
+     inside it, and pushes it. As with one made from Lua, the Graphic is kept
+     alive for as long as the view is. */
+  EXPORT GraphicView* NewGraphicView(lua_State* L, int index, int x, int y, int width, int height) throw();
+  /* A surface with 16-bit linear-light channels, for chains of compositing
+     that should only be converted to an FBLayout once, at the end. Pixels are
+     stored as R, G, B, A. */
+  class EXPORT LinearGraphic : public Object {
+  public:
+    LinearGraphic(int width, int height);
+    LinearGraphic(const Drawable& other);
+    virtual ~LinearGraphic();
+    void CopyRect(const Drawable*restrict, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw();
+    void CopyRect(const LinearGraphic*restrict, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw();
+    int Lua_Copy(lua_State* L) restrict throw();
+    void BlitRectT(const Drawable*restrict, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number a) restrict throw();
+    void BlitRectT(const LinearGraphic*restrict, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number a) restrict throw();
+    int Lua_Blit(lua_State* L) restrict throw();
+    void ModulateRectF(const Drawable*restrict, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number f) restrict throw();
+    void ModulateRectF(const LinearGraphic*restrict, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number f) restrict throw();
+    int Lua_Modulate(lua_State* L) restrict throw();
+    int Lua_GetSize(lua_State* L) const throw();
+    void SetClipRect(int l, int t, int r, int b) throw();
+    int Lua_SetClipRect(lua_State* L) throw();
+    void GetClipRect(int& l, int& t, int& r, int& b) throw();
+    int Lua_GetClipRect(lua_State* L) throw();
+    int Lua_GetPixel(lua_State* L) const throw();
     PROTOCOL_PROTOTYPE();
+    int width, height;
+    bool has_alpha;
+    int clip_left, clip_top, clip_right, clip_bottom;
+    uint16_t*restrict* rows;
+    uint16_t* buffer;
+  private:
+    LOCAL void Setup() throw();
+  };
+  /* A stretch of non-transparent pixels within one row of an RLEGraphic. */
+  struct RLERun {
+    int x, count;
+    // some pixels are partly transparent; if false, all are opaque
+    bool partial;
+    Pixel* pixels;
+  };
+  /* A Graphic compiled into runs of opaque and partly transparent pixels,
+     so that blitting it skips fully transparent pixels without looking at
+     them and copies opaque ones straight across. It can only be blitted. */
+  class EXPORT RLEGraphic : public Object {
+  public:
+    RLEGraphic(const Drawable& source);
+    virtual ~RLEGraphic();
+    void ChangeLayout(enum FBLayout newlayout) throw();
+    int Lua_GetSize(lua_State* L) const throw();
+    int Lua_GetRunCount(lua_State* L) const throw();
+    PROTOCOL_PROTOTYPE();
+    int width, height;
+    bool has_alpha, premultiplied;
+    enum FBLayout layout;
+    // the runs in row y are row_runs[y] up to (not including) row_runs[y+1]
+    RLERun** row_runs;
+    RLERun* runs;
+    size_t run_count;
+    Pixel* pixels;
+    size_t pixel_count;
+  };
+  /* One recorded operation in a DrawList. */
+  struct DrawCommand {
+    enum Op {
+      BLIT, BLIT_LINEAR, BLIT_RLE, BLIT_FRISKET,
+      SET_COLOR, SET_COLOR_PREMUL, DRAW_RECT, DRAW_BOX, DRAW_TRIANGLES,
+    } op;
+    // the Drawable, LinearGraphic, RLEGraphic, Frisket or CoordArray
+    Object* source;
+    IndexArray* indices;
+    // source rect and destination position for blits; l, t, w, h (and box
+    // size in sx) for rects and boxes; index count (or -1) in sw for
+    // triangles
+    int sx, sy, sw, sh, dx, dy;
+    // opacity for blits; color for SET_COLOR*
+    lua_Number r, g, b, a;
+  };
+  /* A list of drawing operations, recorded once and replayed onto a
+     Drawable in a single call. */
+  class EXPORT DrawList : public Object {
+  public:
+    DrawList();
+    virtual ~DrawList();
+    DrawCommand* Add(lua_State* L, DrawCommand::Op op);
+    void Clear() throw();
+    int Replay(Drawable* target, bool reorder) throw();
+    int Lua_Blit(lua_State* L) throw();
+    int Lua_BlitFrisket(lua_State* L) throw();
+    int Lua_AddBlits(lua_State* L) throw();
+    int Lua_SetPrimitiveColor(lua_State* L) throw();
+    int Lua_SetPrimitiveColorPremul(lua_State* L) throw();
+    int Lua_DrawRect(lua_State* L) throw();
+    int Lua_DrawBox(lua_State* L) throw();
+    int Lua_DrawTriangles(lua_State* L) throw();
+    int Lua_Clear(lua_State* L) throw();
+    int Lua_GetCount(lua_State* L) const throw();
+    int Lua_Replay(lua_State* L) throw();
+    PROTOCOL_PROTOTYPE();
+    DrawCommand* commands;
+    size_t count, capacity;
+  private:
+    LOCAL void Reference(lua_State* L, int index);
+    // the state in whose registry the sources are kept alive
+    lua_State* referenced_state;
+    // scratch space for Replay's reordering
+    DrawCommand** order;
+  };
+  /* Packs copies of many Drawables into one Graphic, with a skyline
+     allocator. */
+  class EXPORT AtlasBuilder : public Object {
+  public:
+    AtlasBuilder(int max_width, int max_height, int padding);
+    virtual ~AtlasBuilder();
+    void Clear() throw();
+    // returns NULL if everything won't fit within the maximum size
+    Graphic* Build(enum FBLayout layout) throw();
+    int Lua_Add(lua_State* L) throw();
+    int Lua_GetCount(lua_State* L) const throw();
+    int Lua_Build(lua_State* L) throw();
+    int Lua_GetRect(lua_State* L) const throw();
+    int Lua_GetRects(lua_State* L) const throw();
+    int Lua_GetBlits(lua_State* L) const throw();
+    int Lua_Clear(lua_State* L) throw();
+    PROTOCOL_PROTOTYPE();
+    struct Entry {
+      // NULL once Build has copied it into the atlas
+      Graphic* graphic;
+      int x, y, w, h;
+    };
+    Entry* entries;
+    size_t count, capacity;
+  private:
+    int max_width, max_height, padding;
+    bool built;
+    LOCAL bool Pack(int width, int* xs, int* ys, int& used_width, int& used_height) const throw();
   };
   class EXPORT GraphicsDevice : public Drawable {
   public:
     virtual void Update(int x, int y, int w, int h) throw() = 0;
     virtual void UpdateAll() throw() = 0;
     int Lua_Update(lua_State* L) throw();
+    void UpdateDamaged() throw();
+    int Lua_UpdateDamaged(lua_State* L) throw();
     virtual int Lua_GetEvent(lua_State* L) throw() = 0;
     virtual int Lua_GetMousePos(lua_State* L) throw() = 0;
     virtual int Lua_GetScreenModes(lua_State* L) throw();
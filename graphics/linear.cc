@@ -0,0 +1,398 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#include "graphics.h"
+#include "blitkernels.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <math.h>
+
+using namespace SubCritical;
+
+/* Opacities here are 0-65536 inclusive, like the "an" in BlitRectT. 8-bit
+   alpha becomes a + (a & 1) shifted up 8, exactly as the 8-bit blits see it;
+   16-bit alpha becomes a + (a >> 15). */
+
+static inline uint32_t opacity(lua_Number a) {
+  if(a >= 1) return 65536;
+  else if(a <= 0) return 0;
+  else return (uint32_t)floorf(a * 65536.f + 0.5f);
+}
+
+static inline uint32_t clamp16(float x) {
+  if(x >= 65535.0f) return 65535;
+  else return (uint32_t)x;
+}
+
+LinearGraphic::LinearGraphic(int width, int height) : width(width), height(height), has_alpha(false) {
+  Setup();
+}
+
+LinearGraphic::LinearGraphic(const Drawable& other) : width(other.width), height(other.height), has_alpha(false) {
+  Setup();
+  CopyRect(&other, 0, 0, width, height, 0, 0);
+}
+
+void LinearGraphic::Setup() throw() {
+  size_t pitch = width * 4;
+  buffer = (uint16_t*)calloc(1, pitch * height * sizeof(uint16_t) + height * sizeof(uint16_t*));
+  assert(buffer);
+  rows = (uint16_t*restrict*)(buffer + pitch * height);
+  for(int y = 0; y < height; ++y)
+    rows[y] = buffer + pitch * y;
+  clip_left = 0; clip_right = width - 1;
+  clip_top = 0; clip_bottom = height - 1;
+}
+
+LinearGraphic::~LinearGraphic() {
+  free((void*)buffer);
+}
+
+void LinearGraphic::CopyRect(const Drawable*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
+  CLIP_FOR_BLIT();
+  bool alpha = gfk->has_alpha && !gfk->fake_alpha;
+  if(alpha && !has_alpha) has_alpha = true;
+  PARALLEL_BLIT(LinearGraphic::CopyRect);
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
+    const Pixel*restrict src = gfk->rows[sY] + sl;
+    uint16_t*restrict dst = rows[dY] + dx * 4;
+    size_t rem = sr - sl + 1;
+    UNROLL(rem,
+	   dst[0] = SrgbToLinear[(*src >> gfk->rsh) & 255];
+	   dst[1] = SrgbToLinear[(*src >> gfk->gsh) & 255];
+	   dst[2] = SrgbToLinear[(*src >> gfk->bsh) & 255];
+	   dst[3] = alpha ? ((*src >> gfk->ash) & 255) * 257 : 65535;
+	   dst += 4; ++src);
+  }
+}
+
+void LinearGraphic::CopyRect(const LinearGraphic*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
+  CLIP_FOR_BLIT();
+  if(gfk->has_alpha && !has_alpha) has_alpha = true;
+  PARALLEL_BLIT(LinearGraphic::CopyRect);
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY)
+    memcpy(rows[dY] + dx * 4, gfk->rows[sY] + sl * 4, (sr - sl + 1) * 4 * sizeof(uint16_t));
+}
+
+void LinearGraphic::BlitRectT(const Drawable*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number _a) restrict throw() {
+  uint32_t an = opacity(_a);
+  if(an == 0) return;
+  CLIP_FOR_BLIT();
+  PARALLEL_BLIT_T(LinearGraphic::BlitRectT, _a);
+  bool alpha = gfk->has_alpha && !gfk->fake_alpha;
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
+    const Pixel*restrict src = gfk->rows[sY] + sl;
+    uint16_t*restrict dst = rows[dY] + dx * 4;
+    size_t rem = sr - sl + 1;
+    uint32_t a, ra;
+    UNROLL(rem,
+	   a = alpha ? (*src >> gfk->ash) & 255 : 255;
+	   a += a & 1;
+	   a = (a * an) >> 8;
+	   ra = 65536 - a;
+	   dst[0] = ((uint32_t)SrgbToLinear[(*src >> gfk->rsh) & 255] * a + dst[0] * ra) >> 16;
+	   dst[1] = ((uint32_t)SrgbToLinear[(*src >> gfk->gsh) & 255] * a + dst[1] * ra) >> 16;
+	   dst[2] = ((uint32_t)SrgbToLinear[(*src >> gfk->bsh) & 255] * a + dst[2] * ra) >> 16;
+	   dst[3] = 65535;
+	   dst += 4; ++src);
+  }
+}
+
+void LinearGraphic::BlitRectT(const LinearGraphic*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number _a) restrict throw() {
+  uint32_t an = opacity(_a);
+  if(an == 0) return;
+  CLIP_FOR_BLIT();
+  PARALLEL_BLIT_T(LinearGraphic::BlitRectT, _a);
+  if(!gfk->has_alpha && an == 65536) {
+    for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY)
+      memcpy(rows[dY] + dx * 4, gfk->rows[sY] + sl * 4, (sr - sl + 1) * 4 * sizeof(uint16_t));
+    return;
+  }
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
+    const uint16_t*restrict src = gfk->rows[sY] + sl * 4;
+    uint16_t*restrict dst = rows[dY] + dx * 4;
+    size_t rem = sr - sl + 1;
+    uint32_t a, ra;
+    UNROLL(rem,
+	   a = gfk->has_alpha ? src[3] : 65535;
+	   a += a >> 15;
+	   a = ((uint64_t)a * an) >> 16;
+	   ra = 65536 - a;
+	   dst[0] = (src[0] * a + dst[0] * ra) >> 16;
+	   dst[1] = (src[1] * a + dst[1] * ra) >> 16;
+	   dst[2] = (src[2] * a + dst[2] * ra) >> 16;
+	   dst[3] = 65535;
+	   dst += 4; src += 4);
+  }
+}
+
+void LinearGraphic::ModulateRectF(const Drawable*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number f) restrict throw() {
+  float ff = (float)f / 65535.0f;
+  CLIP_FOR_BLIT();
+  PARALLEL_BLIT_T(LinearGraphic::ModulateRectF, f);
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
+    const Pixel*restrict src = gfk->rows[sY] + sl;
+    uint16_t*restrict dst = rows[dY] + dx * 4;
+    size_t rem = sr - sl + 1;
+    UNROLL(rem,
+	   dst[0] = clamp16((uint32_t)SrgbToLinear[(*src >> gfk->rsh) & 255] * dst[0] * ff);
+	   dst[1] = clamp16((uint32_t)SrgbToLinear[(*src >> gfk->gsh) & 255] * dst[1] * ff);
+	   dst[2] = clamp16((uint32_t)SrgbToLinear[(*src >> gfk->bsh) & 255] * dst[2] * ff);
+	   dst += 4; ++src);
+  }
+}
+
+void LinearGraphic::ModulateRectF(const LinearGraphic*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number f) restrict throw() {
+  float ff = (float)f / 65535.0f;
+  CLIP_FOR_BLIT();
+  PARALLEL_BLIT_T(LinearGraphic::ModulateRectF, f);
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
+    const uint16_t*restrict src = gfk->rows[sY] + sl * 4;
+    uint16_t*restrict dst = rows[dY] + dx * 4;
+    size_t rem = sr - sl + 1;
+    UNROLL(rem,
+	   dst[0] = clamp16((uint32_t)src[0] * dst[0] * ff);
+	   dst[1] = clamp16((uint32_t)src[1] * dst[1] * ff);
+	   dst[2] = clamp16((uint32_t)src[2] * dst[2] * ff);
+	   dst += 4; src += 4);
+  }
+}
+
+void Drawable::CopyRect(const LinearGraphic*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
+  CLIP_FOR_BLIT();
+  DAMAGE_FOR_BLIT();
+  if(!fake_alpha && gfk->has_alpha && (!has_alpha || simple_alpha)) {
+    if(!has_alpha) premultiplied = false;
+    has_alpha = true;
+    simple_alpha = false;
+  }
+  PARALLEL_BLIT(Drawable::CopyRect);
+  Pixel mask = 0xFF << ash;
+  if(premultiplied && gfk->has_alpha) {
+    // the rest of the destination stays premultiplied, so these must be too
+    for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
+      const uint16_t*restrict src = gfk->rows[sY] + sl * 4;
+      Pixel*restrict dst = rows[dY] + dx;
+      size_t rem = sr - sl + 1;
+      uint32_t a;
+      UNROLL(rem,
+	     a = src[3] >> 8;
+	     a += a & 1;
+	     *dst++ = ((Pixel)LinearToSrgb[(src[0] * a) >> 8] << rsh) | ((Pixel)LinearToSrgb[(src[1] * a) >> 8] << gsh) | ((Pixel)LinearToSrgb[(src[2] * a) >> 8] << bsh)
+	     | (Pixel)(src[3] >> 8) << ash;
+	     src += 4);
+    }
+    return;
+  }
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
+    const uint16_t*restrict src = gfk->rows[sY] + sl * 4;
+    Pixel*restrict dst = rows[dY] + dx;
+    size_t rem = sr - sl + 1;
+    UNROLL(rem,
+	   *dst++ = ((Pixel)LinearToSrgb[src[0]] << rsh) | ((Pixel)LinearToSrgb[src[1]] << gsh) | ((Pixel)LinearToSrgb[src[2]] << bsh)
+	   | (gfk->has_alpha ? (Pixel)(src[3] >> 8) << ash : mask);
+	   src += 4);
+  }
+}
+
+void Drawable::BlitRectT(const LinearGraphic*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number _a) restrict throw() {
+  uint32_t an = opacity(_a);
+  if(an == 0) return;
+  CLIP_FOR_BLIT();
+  DAMAGE_FOR_BLIT();
+  PARALLEL_BLIT_T(Drawable::BlitRectT, _a);
+  Pixel mask = 0xFF << ash;
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
+    const uint16_t*restrict src = gfk->rows[sY] + sl * 4;
+    Pixel*restrict dst = rows[dY] + dx;
+    size_t rem = sr - sl + 1;
+    uint32_t r, g, b, a, ra;
+    UNROLL(rem,
+	   a = gfk->has_alpha ? src[3] : 65535;
+	   a += a >> 15;
+	   a = ((uint64_t)a * an) >> 16;
+	   ra = 65536 - a;
+	   r = (src[0] * a + (uint32_t)SrgbToLinear[(*dst >> rsh) & 255] * ra) >> 16;
+	   g = (src[1] * a + (uint32_t)SrgbToLinear[(*dst >> gsh) & 255] * ra) >> 16;
+	   b = (src[2] * a + (uint32_t)SrgbToLinear[(*dst >> bsh) & 255] * ra) >> 16;
+	   *dst++ = ((Pixel)LinearToSrgb[r] << rsh) | ((Pixel)LinearToSrgb[g] << gsh) | ((Pixel)LinearToSrgb[b] << bsh) | mask;
+	   src += 4);
+  }
+}
+
+/* Pull the source object and the (optional) source rectangle, position and
+   trailing number out of the standard 3, 4, 7, or 8 parameter forms. */
+static void GetLinearParams(lua_State* L, const char* what, Object*& src, int& sx, int& sy, int& sw, int& sh, int& dx, int& dy, lua_Number& n) {
+  src = Object::To(L, 1);
+  if(src->IsA("LinearGraphic")) {
+    sw = ((LinearGraphic*)src)->width;
+    sh = ((LinearGraphic*)src)->height;
+  }
+  else if(src->IsA("Drawable")) {
+    if(((Drawable*)src)->premultiplied)
+      luaL_error(L, "%s cannot use premultiplied Graphics. Unpremultiply it first.", what);
+    sw = ((Drawable*)src)->width;
+    sh = ((Drawable*)src)->height;
+  }
+  else luaL_error(L, "%s needs a Drawable or LinearGraphic", what);
+  sx = sy = 0;
+  n = 1;
+  switch(lua_gettop(L)) {
+  case 4: n = luaL_checknumber(L, 4);
+  case 3:
+    dx = (int)luaL_checknumber(L, 2);
+    dy = (int)luaL_checknumber(L, 3);
+    break;
+  case 8: n = luaL_checknumber(L, 8);
+  case 7:
+    sx = (int)luaL_checknumber(L, 2);
+    sy = (int)luaL_checknumber(L, 3);
+    sw = (int)luaL_checknumber(L, 4);
+    sh = (int)luaL_checknumber(L, 5);
+    dx = (int)luaL_checknumber(L, 6);
+    dy = (int)luaL_checknumber(L, 7);
+    break;
+  default:
+    luaL_error(L, "%s takes 3, 4, 7, or 8 parameters", what);
+  }
+}
+
+int LinearGraphic::Lua_Copy(lua_State* L) restrict throw() {
+  Object* src;
+  int sx, sy, sw, sh, dx, dy;
+  lua_Number n;
+  GetLinearParams(L, "Copy", src, sx, sy, sw, sh, dx, dy, n);
+  if(src == this) return luaL_error(L, "Source and destination must differ");
+  if(lua_gettop(L) == 4 || lua_gettop(L) == 8) return luaL_error(L, "Copy takes 3 or 7 parameters");
+  if(src->IsA("LinearGraphic")) CopyRect((LinearGraphic*)src, sx, sy, sw, sh, dx, dy);
+  else CopyRect((Drawable*)src, sx, sy, sw, sh, dx, dy);
+  return 0;
+}
+
+int LinearGraphic::Lua_Blit(lua_State* L) restrict throw() {
+  if(has_alpha) return luaL_error(L, "LinearGraphics with alpha channels cannot be modified with this function. Try :Copy.");
+  Object* src;
+  int sx, sy, sw, sh, dx, dy;
+  lua_Number n;
+  GetLinearParams(L, "Blit", src, sx, sy, sw, sh, dx, dy, n);
+  if(src == this) return luaL_error(L, "Source and destination must differ");
+  if(src->IsA("LinearGraphic")) BlitRectT((LinearGraphic*)src, sx, sy, sw, sh, dx, dy, n);
+  else BlitRectT((Drawable*)src, sx, sy, sw, sh, dx, dy, n);
+  return 0;
+}
+
+int LinearGraphic::Lua_Modulate(lua_State* L) restrict throw() {
+  Object* src;
+  int sx, sy, sw, sh, dx, dy;
+  lua_Number n;
+  GetLinearParams(L, "Modulate", src, sx, sy, sw, sh, dx, dy, n);
+  if(src == this) return luaL_error(L, "Source and destination must differ");
+  if(src->IsA("LinearGraphic")) ModulateRectF((LinearGraphic*)src, sx, sy, sw, sh, dx, dy, n);
+  else ModulateRectF((Drawable*)src, sx, sy, sw, sh, dx, dy, n);
+  return 0;
+}
+
+int LinearGraphic::Lua_GetSize(lua_State* L) const throw() {
+  lua_pushnumber(L, width);
+  lua_pushnumber(L, height);
+  return 2;
+}
+
+void LinearGraphic::SetClipRect(int l, int t, int r, int b) throw() {
+  clip_left = l;
+  clip_top = t;
+  clip_right = r;
+  clip_bottom = b;
+}
+
+int LinearGraphic::Lua_SetClipRect(lua_State* L) throw() {
+  int x, y, w, h;
+  x = (int)luaL_checknumber(L, 1);
+  y = (int)luaL_checknumber(L, 2);
+  w = (int)luaL_checknumber(L, 3);
+  h = (int)luaL_checknumber(L, 4);
+  int l, t, r, b;
+  l = x;
+  t = y;
+  r = x + w - 1;
+  b = y + h - 1;
+  if(l < 0) l = 0;
+  if(t < 0) t = 0;
+  if(r >= width) r = width - 1;
+  if(b >= height) b = height - 1;
+  if(r - l < 0 || b - t < 0) return luaL_error(L, "Invalid clip rect");
+  SetClipRect(l, t, r, b);
+  return 0;
+}
+
+void LinearGraphic::GetClipRect(int& l, int& t, int& r, int& b) throw() {
+  l = clip_left;
+  t = clip_top;
+  r = clip_right;
+  b = clip_bottom;
+}
+
+int LinearGraphic::Lua_GetClipRect(lua_State* L) throw() {
+  lua_pushinteger(L, clip_left);
+  lua_pushinteger(L, clip_top);
+  lua_pushinteger(L, clip_right - clip_left + 1);
+  lua_pushinteger(L, clip_bottom - clip_top + 1);
+  return 4;
+}
+
+int LinearGraphic::Lua_GetPixel(lua_State* L) const throw() {
+  lua_Integer x, y;
+  x = luaL_checkinteger(L, 1);
+  y = luaL_checkinteger(L, 2);
+  if(x < 0 || x >= width || y < 0 || y >= height)
+    return luaL_error(L, "coordinate out of range");
+  const uint16_t* p = rows[y] + x * 4;
+  lua_pushnumber(L, p[0]/65535.0);
+  lua_pushnumber(L, p[1]/65535.0);
+  lua_pushnumber(L, p[2]/65535.0);
+  lua_pushnumber(L, has_alpha ? p[3]/65535.0 : 1.0);
+  return 4;
+}
+
+static const struct ObjectMethod LGMethods[] = {
+  METHOD("GetSize", &LinearGraphic::Lua_GetSize),
+  METHOD("GetClipRect", &LinearGraphic::Lua_GetClipRect),
+  METHOD("SetClipRect", &LinearGraphic::Lua_SetClipRect),
+  METHOD("Copy", &LinearGraphic::Lua_Copy),
+  METHOD("Blit", &LinearGraphic::Lua_Blit),
+  METHOD("Modulate", &LinearGraphic::Lua_Modulate),
+  METHOD("GetPixel", &LinearGraphic::Lua_GetPixel),
+  NOMOREMETHODS(),
+};
+PROTOCOL_IMP(LinearGraphic, Object, LGMethods);
+
+SUBCRITICAL_CONSTRUCTOR(LinearGraphic)(lua_State* L) {
+  LinearGraphic* p;
+  if(lua_gettop(L) == 1) {
+    Drawable* d = lua_toobject(L, 1, Drawable);
+    if(d->premultiplied) return luaL_error(L, "LinearGraphic cannot use premultiplied Graphics. Unpremultiply it first.");
+    p = new LinearGraphic(*d);
+  }
+  else p = new LinearGraphic(luaL_checkinteger(L, 1), luaL_checkinteger(L, 2));
+  p->Push(L);
+  return 1;
+}
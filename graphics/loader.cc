@@ -24,7 +24,34 @@ using namespace SubCritical;
 
 int GraphicLoader::Lua_Load(lua_State* L) throw() {
   int top = lua_gettop(L);
-  if(top > 1) {
+  if(top > 1 && lua_type(L, 2) == LUA_TUSERDATA) {
+    // Load(path, destination): load into the top left of an existing Drawable
+    Drawable* dest = lua_toobject(L, 2, Drawable);
+    const char* path = GetPath(L, 1);
+    Graphic* loaded = Load(path);
+    if(!loaded) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "Unable to load graphic: %s", path);
+      return 2;
+    }
+    if(loaded->width > dest->width || loaded->height > dest->height) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s is %dx%d, too big for the destination", path, loaded->width, loaded->height);
+      delete loaded;
+      return 2;
+    }
+    loaded->ChangeLayout(dest->layout);
+    // Copy won't mix straight and premultiplied pixels, so match dest's
+    if(dest->has_alpha && !dest->fake_alpha && dest->premultiplied)
+      loaded->Premultiply();
+    dest->Copy(loaded, 0, 0);
+    lua_pushvalue(L, 2);
+    lua_pushinteger(L, loaded->width);
+    lua_pushinteger(L, loaded->height);
+    delete loaded;
+    return 3;
+  }
+  else if(top > 1) {
     static bool warned = false;
     if(!warned) {
       fprintf(stderr, "This game loads multiple graphics with the same Load call. This feature is deprecated and will be removed in a future version.\n");
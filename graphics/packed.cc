@@ -0,0 +1,342 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#include "graphics.h"
+#include "subcritical/data.h"
+#include <string.h>
+
+using namespace SubCritical;
+
+/* Packed data is a string (such as a PackedArray's Dump returns), a
+   PackedArray itself, or the unread part of a DataBuffer. Like those, it's
+   big-endian unless the format ends in "le". */
+
+enum PackedType { P_S16, P_U16, P_S32, P_U32, P_F32, P_F64, P_FIXED };
+
+struct LOCAL PackedFormat {
+  PackedType type;
+  size_t size;
+  bool swap;
+};
+
+static const struct { const char* name; PackedType type; size_t size; } formats[] = {
+  {"s16", P_S16, 2}, {"u16", P_U16, 2}, {"s32", P_S32, 4}, {"u32", P_U32, 4},
+  {"f32", P_F32, 4}, {"f64", P_F64, 8}, {"fixed", P_FIXED, 4}, {NULL, P_S16, 0}
+};
+
+static void GetFormat(lua_State* L, int index, PackedFormat& f) {
+  size_t len;
+  const char* name = luaL_checklstring(L, index, &len);
+  bool little = len > 2 && !strcmp(name + len - 2, "le");
+  if(little) len -= 2;
+  for(int n = 0; formats[n].name; ++n) {
+    if(strlen(formats[n].name) == len && !memcmp(formats[n].name, name, len)) {
+      f.type = formats[n].type;
+      f.size = formats[n].size;
+      f.swap = little != little_endian;
+      return;
+    }
+  }
+  luaL_error(L, "unknown packed format: %s", name);
+}
+
+struct LOCAL PackedSource {
+  const uint8_t* p;
+  size_t bytes;
+  DataBuffer* buffer;
+};
+
+/* A PackedArray is replaced on the stack by its Dump. */
+static void GetSource(lua_State* L, int index, PackedSource& src) {
+  src.buffer = NULL;
+  if(lua_type(L, index) == LUA_TUSERDATA) {
+    Object* o = Object::To(L, index);
+    if(o->IsA("DataBuffer")) {
+      src.buffer = (DataBuffer*)o;
+      src.p = (const uint8_t*)src.buffer->GetCurPtr();
+      src.bytes = src.buffer->GetRemSpace();
+      return;
+    }
+    lua_getfield(L, index, "Dump");
+    if(!lua_isfunction(L, -1))
+      luaL_typerror(L, index, "string, DataBuffer, or PackedArray");
+    lua_pushvalue(L, index);
+    lua_call(L, 1, 1);
+    lua_replace(L, index);
+  }
+  if(lua_type(L, index) != LUA_TSTRING)
+    luaL_typerror(L, index, "string, DataBuffer, or PackedArray");
+  src.p = (const uint8_t*)lua_tolstring(L, index, &src.bytes);
+}
+
+/* DataBuffer reads advance its position, like its own Read methods do. */
+static inline void Consume(PackedSource& src, size_t bytes) {
+  if(src.buffer) src.buffer->UnsafeSeekCur(bytes);
+}
+
+static inline uint16_t Load16(const uint8_t* p, bool swap) {
+  uint16_t u; memcpy(&u, p, 2); return swap ? Swap16(u) : u;
+}
+static inline uint32_t Load32(const uint8_t* p, bool swap) {
+  uint32_t u; memcpy(&u, p, 4); return swap ? Swap32(u) : u;
+}
+static inline uint64_t Load64(const uint8_t* p, bool swap) {
+  uint64_t u; memcpy(&u, p, 8); return swap ? Swap64(u) : u;
+}
+
+static void ConvertCoords(Fixed*restrict out, const uint8_t*restrict p, size_t count, const PackedFormat& f) {
+  const bool swap = f.swap;
+  size_t rem = count;
+  if(!count) return;
+  switch(f.type) {
+  case P_S16:
+    UNROLL(rem, *out++ = I_TO_Q((int16_t)Load16(p, swap)); p += 2;);
+    break;
+  case P_U16:
+    UNROLL(rem, *out++ = I_TO_Q(Load16(p, swap)); p += 2;);
+    break;
+  case P_S32:
+    UNROLL(rem, *out++ = I_TO_Q((int32_t)Load32(p, swap)); p += 4;);
+    break;
+  case P_U32:
+    UNROLL(rem, *out++ = I_TO_Q(Load32(p, swap)); p += 4;);
+    break;
+  case P_F32:
+    UNROLL(rem, {
+	uint32_t u = Load32(p, swap); float v; memcpy(&v, &u, 4);
+	*out++ = F_TO_Q(v); p += 4;
+      });
+    break;
+  case P_F64:
+    UNROLL(rem, {
+	uint64_t u = Load64(p, swap); double v; memcpy(&v, &u, 8);
+	*out++ = F_TO_Q(v); p += 8;
+      });
+    break;
+  case P_FIXED:
+    if(!swap) memcpy(out, p, count * sizeof(Fixed));
+    else UNROLL(rem, *out++ = (Fixed)Load32(p, swap); p += 4;);
+    break;
+  }
+}
+
+static void ConvertNumbers(lua_Number*restrict out, const uint8_t*restrict p, size_t count, const PackedFormat& f) {
+  const bool swap = f.swap;
+  size_t rem = count;
+  if(!count) return;
+  switch(f.type) {
+  case P_S16:
+    UNROLL(rem, *out++ = (int16_t)Load16(p, swap); p += 2;);
+    break;
+  case P_U16:
+    UNROLL(rem, *out++ = Load16(p, swap); p += 2;);
+    break;
+  case P_S32:
+    UNROLL(rem, *out++ = (int32_t)Load32(p, swap); p += 4;);
+    break;
+  case P_U32:
+    UNROLL(rem, *out++ = Load32(p, swap); p += 4;);
+    break;
+  case P_F32:
+    UNROLL(rem, {
+	uint32_t u = Load32(p, swap); float v; memcpy(&v, &u, 4);
+	*out++ = v; p += 4;
+      });
+    break;
+  case P_F64:
+    UNROLL(rem, {
+	uint64_t u = Load64(p, swap); double v; memcpy(&v, &u, 8);
+	*out++ = v; p += 8;
+      });
+    break;
+  case P_FIXED:
+    UNROLL(rem, *out++ = Q_TO_F((Fixed)Load32(p, swap)); p += 4;);
+    break;
+  }
+}
+
+/* Returns false if an index was out of range (in which case out may have
+   been partly filled). */
+template<class I> static bool ConvertIndices(I*restrict out, const uint8_t*restrict p, size_t count, const PackedFormat& f) {
+  const bool swap = f.swap;
+  const uint32_t max = (I)~(I)0;
+  uint32_t bad = 0;
+  size_t rem = count;
+  if(!count) return true;
+  switch(f.type) {
+  case P_U16:
+  case P_S16:
+    if(sizeof(I) == 2 && !swap) {
+      memcpy(out, p, count * 2);
+      if(f.type == P_U16) return true;
+      for(size_t n = 0; n < count; ++n) bad |= out[n] & 0x8000;
+      return !bad;
+    }
+    if(f.type == P_U16)
+      UNROLL(rem, *out++ = Load16(p, swap); p += 2;);
+    else
+      UNROLL(rem, { uint16_t u = Load16(p, swap); bad |= u & 0x8000; *out++ = u; p += 2; });
+    return !bad;
+  case P_U32:
+  case P_S32:
+    if(sizeof(I) == 4 && !swap && f.type == P_U32) {
+      memcpy(out, p, count * 4);
+      return true;
+    }
+    if(f.type == P_S32)
+      UNROLL(rem, { uint32_t u = Load32(p, swap); bad |= (u > 0x7FFFFFFF) | (u > max); *out++ = (I)u; p += 4; });
+    else
+      UNROLL(rem, { uint32_t u = Load32(p, swap); bad |= u > max; *out++ = (I)u; p += 4; });
+    return !bad;
+  default:
+    return false;
+  }
+}
+
+static inline bool IsIntegerFormat(const PackedFormat& f) {
+  return f.type == P_S16 || f.type == P_U16 || f.type == P_S32 || f.type == P_U32;
+}
+
+/* How many elements to take, starting at stack index index: count if given
+   (an error if there isn't that much), otherwise as many as there are. */
+static size_t GetCount(lua_State* L, int index, const PackedSource& src, size_t element_size) {
+  size_t avail = src.bytes / element_size;
+  if(lua_isnoneornil(L, index)) return avail;
+  lua_Integer count = luaL_checkinteger(L, index);
+  if(count < 0 || (size_t)count > avail) luaL_error(L, "not enough packed data");
+  return count;
+}
+
+int CoordArray::Lua_CompilePacked(lua_State* L) throw() {
+  PackedSource src;
+  PackedFormat f;
+  GetSource(L, 1, src);
+  GetFormat(L, 2, f);
+  size_t count = GetCount(L, 3, src, f.size * 2);
+  if(count == 0) return 0;
+  CoordArray* ret = new CoordArray(count);
+  ConvertCoords(ret->coords, src.p, count * 2, f);
+  Consume(src, count * 2 * f.size);
+  ret->Push(L);
+  return 1;
+}
+
+/* array:Update(table[, first]) or array:Update(data, format[, first[, count]]) */
+int CoordArray::Lua_Update(lua_State* L) throw() {
+  bool table = lua_istable(L, 1);
+  lua_Integer first = luaL_optinteger(L, table ? 2 : 3, 0);
+  if(first < 0 || (size_t)first > count) return luaL_error(L, "first coordinate out of range");
+  if(table) {
+    size_t n = lua_rawlen(L, 1) / 2;
+    if(n > count - first) return luaL_error(L, "too many coordinates for this CoordArray");
+    Fixed* p = coords + first * 2;
+    for(size_t i = 0; i < n * 2; ++i) {
+      lua_rawgeti(L, 1, i + 1);
+      if(!lua_isnumber(L, -1))
+	return luaL_error(L, "Update was given a table containing a non-number!");
+      p[i] = F_TO_Q(lua_tonumber(L, -1));
+      lua_pop(L, 1);
+    }
+    return 0;
+  }
+  PackedSource src;
+  PackedFormat f;
+  GetSource(L, 1, src);
+  GetFormat(L, 2, f);
+  size_t n = GetCount(L, 4, src, f.size * 2);
+  if(n > count - first) {
+    if(lua_isnoneornil(L, 4)) n = count - first;
+    else return luaL_error(L, "too many coordinates for this CoordArray");
+  }
+  ConvertCoords(coords + first * 2, src.p, n * 2, f);
+  Consume(src, n * 2 * f.size);
+  return 0;
+}
+
+int IndexArray::Lua_CompilePacked(lua_State* L) throw() {
+  PackedSource src;
+  PackedFormat f;
+  GetSource(L, 1, src);
+  GetFormat(L, 2, f);
+  if(!IsIntegerFormat(f)) return luaL_error(L, "indices must be in an integer format");
+  size_t count = GetCount(L, 3, src, f.size);
+  if(count == 0) return 0;
+  IndexArray* ret = new IndexArray(count, f.size > 2);
+  bool ok = ret->indices32 ? ConvertIndices(ret->indices32, src.p, count, f)
+    : ConvertIndices(ret->indices, src.p, count, f);
+  if(!ok) {
+    delete ret;
+    return luaL_error(L, "Indices must be in the range 0-4294967295.");
+  }
+  Consume(src, count * f.size);
+  ret->Push(L);
+  return 1;
+}
+
+/* As CoordArray::Lua_Update. first counts from the start of the real
+   indices, not the active range. */
+int IndexArray::Lua_Update(lua_State* L) throw() {
+  bool table = lua_istable(L, 1);
+  lua_Integer first = luaL_optinteger(L, table ? 2 : 3, 0);
+  if(first < 0 || (size_t)first > real_count) return luaL_error(L, "first index out of range");
+  const Index32 max = IsWide() ? 0xFFFFFFFF : 0xFFFF;
+  if(table) {
+    size_t n = lua_rawlen(L, 1);
+    if(n > real_count - first) return luaL_error(L, "too many indices for this IndexArray");
+    for(size_t i = 0; i < n; ++i) {
+      lua_rawgeti(L, 1, i + 1);
+      if(!lua_isnumber(L, -1))
+	return luaL_error(L, "Update was given a table containing a non-number!");
+      lua_Number num = lua_tonumber(L, -1);
+      if(num < 0 || num > max) return luaL_error(L, "index out of range for this IndexArray");
+      if(real_indices32) real_indices32[first + i] = (Index32)num;
+      else real_indices[first + i] = (Index)num;
+      lua_pop(L, 1);
+    }
+    return 0;
+  }
+  PackedSource src;
+  PackedFormat f;
+  GetSource(L, 1, src);
+  GetFormat(L, 2, f);
+  if(!IsIntegerFormat(f)) return luaL_error(L, "indices must be in an integer format");
+  size_t n = GetCount(L, 4, src, f.size);
+  if(n > real_count - first) {
+    if(lua_isnoneornil(L, 4)) n = real_count - first;
+    else return luaL_error(L, "too many indices for this IndexArray");
+  }
+  bool ok = real_indices32 ? ConvertIndices(real_indices32 + first, src.p, n, f)
+    : ConvertIndices(real_indices + first, src.p, n, f);
+  if(!ok) return luaL_error(L, "index out of range for this IndexArray");
+  Consume(src, n * f.size);
+  return 0;
+}
+
+void SubCritical::ReadPackedNumbers(lua_State* L, int index, int format_index, lua_Number* out, size_t count) throw() {
+  // GetSource pushes things
+  if(index < 0) index = lua_gettop(L) + 1 + index;
+  PackedSource src;
+  PackedFormat f;
+  GetSource(L, index, src);
+  GetFormat(L, format_index, f);
+  if(src.bytes / f.size < count) luaL_error(L, "not enough packed data");
+  ConvertNumbers(out, src.p, count, f);
+  Consume(src, count * f.size);
+}
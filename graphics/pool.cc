@@ -0,0 +1,154 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#include "graphics.h"
+#include <stdlib.h>
+#include <string.h>
+
+using namespace SubCritical;
+
+#if defined(WIN32) || defined(_WIN32) || defined(HAVE_WINDOWS)
+typedef CRITICAL_SECTION pool_mutex;
+static void mutex_init(pool_mutex* m) { InitializeCriticalSection(m); }
+static void mutex_lock(pool_mutex* m) { EnterCriticalSection(m); }
+static void mutex_unlock(pool_mutex* m) { LeaveCriticalSection(m); }
+#else
+typedef pthread_mutex_t pool_mutex;
+static void mutex_init(pool_mutex* m) { pthread_mutex_init(m, NULL); }
+static void mutex_lock(pool_mutex* m) { pthread_mutex_lock(m); }
+static void mutex_unlock(pool_mutex* m) { pthread_mutex_unlock(m); }
+#endif
+
+/* Buffers are sorted into size classes, four per power of two, so a reused
+   buffer is never more than 25% bigger than what was asked for. A freed
+   buffer goes in the biggest class it can satisfy every request for, and a
+   request takes from the smallest class that's big enough. Buffers are
+   only rounded up to their class size while the pool is in use. */
+#define CLASS_STEPS 4
+#define NUM_CLASSES (sizeof(size_t) * 8 * CLASS_STEPS)
+
+struct FreeBuffer {
+  FreeBuffer* next;
+  size_t size;
+};
+
+static pool_mutex lock;
+static bool inited = false;
+static size_t limit = 0, pooled = 0;
+static FreeBuffer* classes[NUM_CLASSES];
+
+static inline int HighBit(size_t n) {
+  int ret = 0;
+  while(n >>= 1) ++ret;
+  return ret;
+}
+
+static inline size_t ClassSize(int c) {
+  int bit = c / CLASS_STEPS, step = c % CLASS_STEPS;
+  if(bit < 2) return (size_t)(CLASS_STEPS + step) >> (2 - bit);
+  return (size_t)(CLASS_STEPS + step) << (bit - 2);
+}
+
+// smallest class whose size is at least n
+static inline int CeilClass(size_t n) {
+  int bit = HighBit(n);
+  int c = bit * CLASS_STEPS + (bit >= 2 ? (int)((n >> (bit - 2)) & (CLASS_STEPS - 1)) : 0);
+  while(ClassSize(c) < n) ++c;
+  return c;
+}
+
+// biggest class whose size is at most n
+static inline int FloorClass(size_t n) {
+  int c = CeilClass(n);
+  if(ClassSize(c) > n) --c;
+  return c;
+}
+
+static void Trim() {
+  // drop the biggest buffers first; they're the least likely to be reused
+  for(int c = NUM_CLASSES - 1; c >= 0 && pooled > limit; --c) {
+    while(classes[c] && pooled > limit) {
+      FreeBuffer* p = classes[c];
+      classes[c] = p->next;
+      pooled -= p->size;
+      free(p);
+    }
+  }
+}
+
+void* SubCritical::AllocPixels(size_t& size, bool clear) throw() {
+  if(limit && size >= sizeof(FreeBuffer)) {
+    int c = CeilClass(size);
+    mutex_lock(&lock);
+    FreeBuffer* p = classes[c];
+    if(p) {
+      classes[c] = p->next;
+      pooled -= p->size;
+    }
+    mutex_unlock(&lock);
+    if(p) {
+      size = p->size;
+      if(clear) memset((void*)p, 0, size);
+      return p;
+    }
+    size = ClassSize(c);
+  }
+  return clear ? calloc(1, size) : malloc(size);
+}
+
+void SubCritical::FreePixels(void* buffer, size_t size) throw() {
+  if(!buffer) return;
+  if(limit && size >= sizeof(FreeBuffer) && size <= limit) {
+    mutex_lock(&lock);
+    if(pooled + size <= limit) {
+      FreeBuffer* p = (FreeBuffer*)buffer;
+      int c = FloorClass(size);
+      p->size = size;
+      p->next = classes[c];
+      classes[c] = p;
+      pooled += size;
+      buffer = NULL;
+    }
+    mutex_unlock(&lock);
+  }
+  free(buffer);
+}
+
+/* The pool isn't used until this is called, so this is the only place the
+   lock needs setting up. */
+size_t SubCritical::SetPixelPoolLimit(size_t bytes) throw() {
+  if(!inited) {
+    mutex_init(&lock);
+    inited = true;
+  }
+  mutex_lock(&lock);
+  limit = bytes;
+  Trim();
+  size_t ret = pooled;
+  mutex_unlock(&lock);
+  return ret;
+}
+
+SUBCRITICAL_UTILITY(SetGraphicPoolLimit)(lua_State* L) {
+  lua_Number bytes = luaL_checknumber(L, 1);
+  if(bytes < 0) return luaL_error(L, "pool limit must not be negative");
+  lua_pushnumber(L, SetPixelPoolLimit((size_t)bytes));
+  return 1;
+}
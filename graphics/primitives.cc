@@ -19,9 +19,11 @@
   Please see doc/license.html for clarifications.
  */
 #include "graphics.h"
+#include "blitkernels.h"
 
 #include <math.h>
 #include <string.h>
+#include <stdlib.h>
 
 using namespace SubCritical;
 
@@ -56,6 +58,7 @@ void Drawable::DrawRect(int l, int t, int r, int b) throw() {
   if(t < clip_top) t = clip_top;
   if(b > clip_bottom) b = clip_bottom;
   if(r < l || b < t) return;
+  if(damage) AddDamage(l, t, r, b);
   if(primitive_alpha) {
     for(int y = t; y <= b; ++y) {
       int rem = r - l + 1;
@@ -104,6 +107,7 @@ int Drawable::Lua_DrawBox(lua_State* L) throw() {
 void Drawable::DrawPoints(int size, const Fixed* coords, size_t pointcount) throw() {
   const Fixed* fp = coords;
   if(primitive_alpha && tr_a == 0) return;
+  if(damage) DamageCoords(coords, (const Index*)NULL, pointcount, I_TO_Q(size / 2 + 1));
   if(size <= 1) {
     if(primitive_alpha) {
       uint32_t r, g, b;
@@ -214,6 +218,21 @@ void Drawable::SetPrimitiveColorPremul(lua_Number r, lua_Number g, lua_Number b,
   }
 }
 
+void Drawable::SetTriangleCulling(int winding) throw() {
+  cull_winding = winding > 0 ? 1 : winding < 0 ? -1 : 0;
+}
+
+int Drawable::Lua_SetTriangleCulling(lua_State* L) throw() {
+  if(!lua_toboolean(L, 1)) SetTriangleCulling(0);
+  else {
+    const char* mode = luaL_checkstring(L, 1);
+    if(!strcmp(mode, "CW")) SetTriangleCulling(1);
+    else if(!strcmp(mode, "CCW")) SetTriangleCulling(-1);
+    else return luaL_error(L, "triangle culling must be \"CW\", \"CCW\", or nil");
+  }
+  return 0;
+}
+
 int Drawable::Lua_SetPrimitiveColor(lua_State* L) throw() {
   if(has_alpha) return luaL_error(L, "Graphics with alpha channels cannot be modified with this function.");
   lua_Number r, g, b, a;
@@ -241,20 +260,9 @@ void Drawable::BlitFrisket(const Frisket* frisket, int dx, int dy) throw() {
 }
 
 void Drawable::BlitFrisketRect(const Frisket* gfk, int sx, int sy, int sw, int sh, int dx, int dy) throw() {
-  int sl, st, sr, sb;
-  sl = sx;
-  st = sy;
-  sr = sx + sw - 1;
-  sb = sy + sh - 1;
-  if(dx < clip_left) { sl += clip_left - dx; dx = clip_left; }
-  if(dy < clip_top) { st += clip_top - dy; dy = clip_top; }
-  if(dx + (sr - sl) > clip_right) { sr += clip_right - (dx + (sr - sl)); }
-  if(dy + (sb - st) > clip_bottom) { sb += clip_bottom - (dy + (sb - st)); }
-  if(sl < 0) { dx -= sl; sl = 0; }
-  if(sr >= gfk->width) sr = gfk->width - 1;
-  if(st < 0) { dy -= st; st = 0; }
-  if(sb >= gfk->height) sb = gfk->height - 1;
-  if(sr < sl || sb < st) return;
+  CLIP_FOR_BLIT();
+  DAMAGE_FOR_BLIT();
+  PARALLEL_BLIT(Drawable::BlitFrisketRect);
   if(primitive_alpha) {
     if(tr_a == 0) return;
     for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
@@ -388,8 +396,26 @@ if(side##e >= side##d) { \
   side##e -= side##d; \
   side += side##i; \
 }
+/* The same as k Tri_DDA_Steps. */
+#define Tri_DDA_Skip(side, k) do { \
+  int64_t side##_e = (int64_t)side##e + (int64_t)side##n * (k); \
+  side += side##s * (k) + side##i * (Fixed)(side##_e / side##d); \
+  side##e = (Fixed)(side##_e % side##d); \
+} while(0)
+/* Only rows first through last-1 are drawn. Rows above first are skipped
+   (but the edges a and b are stepped past them, so the rows that are drawn
+   come out exactly as they would have), and rem is cut short at last. */
+#define Tri_Band(rem, a, b) \
+if(y < first) { \
+  int skip = first - y < rem ? first - y : rem; \
+  Tri_DDA_Skip(a, skip); \
+  Tri_DDA_Skip(b, skip); \
+  y += skip; \
+  rem -= skip; \
+} \
+if(y + rem > last) rem = last - y;
 
-inline void Drawable::DrawTriangleR(const Fixed*restrict top, const Fixed*restrict mid, const Fixed*restrict bot) throw() {
+inline void Drawable::DrawTriangleR(const Fixed*restrict top, const Fixed*restrict mid, const Fixed*restrict bot, int first, int last) throw() {
   int remt = Q_TO_I(mid[1]) - Q_TO_I(top[1]);
   int remb = Q_TO_I(bot[1]) - Q_TO_I(mid[1]);
   if(!remt && !remb) return;
@@ -399,6 +425,7 @@ inline void Drawable::DrawTriangleR(const Fixed*restrict top, const Fixed*restri
   if(remt) {
     Tri_DDA_Vars(t);
     Tri_DDA_Init(t, top, mid, 1);
+    Tri_Band(remt, l, t);
     if(primitive_alpha) while(remt-- > 0) {
       NoclipDrawSpanA(y++, l, t);
       Tri_DDA_Step(l);
@@ -413,6 +440,7 @@ inline void Drawable::DrawTriangleR(const Fixed*restrict top, const Fixed*restri
   if(remb) {
     Tri_DDA_Vars(b);
     Tri_DDA_Init(b, mid, bot, 1);
+    Tri_Band(remb, l, b);
     if(primitive_alpha) while(remb-- > 0) {
       NoclipDrawSpanA(y++, l, b);
       Tri_DDA_Step(l);
@@ -426,7 +454,7 @@ inline void Drawable::DrawTriangleR(const Fixed*restrict top, const Fixed*restri
   }
 }
 
-inline void Drawable::DrawTriangleL(const Fixed*restrict top, const Fixed*restrict mid, const Fixed*restrict bot) throw() {
+inline void Drawable::DrawTriangleL(const Fixed*restrict top, const Fixed*restrict mid, const Fixed*restrict bot, int first, int last) throw() {
   int remt = Q_TO_I(mid[1]) - Q_TO_I(top[1]);
   int remb = Q_TO_I(bot[1]) - Q_TO_I(mid[1]);
   if(!remt && !remb) return;
@@ -436,6 +464,7 @@ inline void Drawable::DrawTriangleL(const Fixed*restrict top, const Fixed*restri
   if(remt) {
     Tri_DDA_Vars(t);
     Tri_DDA_Init(t, top, mid, 1);
+    Tri_Band(remt, r, t);
     if(primitive_alpha) while(remt-- > 0) {
       NoclipDrawSpanA(y++, t, r);
       Tri_DDA_Step(r);
@@ -450,6 +479,7 @@ inline void Drawable::DrawTriangleL(const Fixed*restrict top, const Fixed*restri
   if(remb) {
     Tri_DDA_Vars(b);
     Tri_DDA_Init(b, mid, bot, 1);
+    Tri_Band(remb, r, b);
     if(primitive_alpha) while(remb-- > 0) {
       NoclipDrawSpanA(y++, b, r);
       Tri_DDA_Step(r);
@@ -463,7 +493,7 @@ inline void Drawable::DrawTriangleL(const Fixed*restrict top, const Fixed*restri
   }
 }
 
-inline void Drawable::DrawTriangle(const Fixed*restrict a, const Fixed*restrict b, const Fixed*restrict c) throw() {
+inline void Drawable::DrawTriangle(const Fixed*restrict a, const Fixed*restrict b, const Fixed*restrict c, int first, int last) throw() {
   const Fixed*restrict top, *restrict mid, *restrict bot;
   // We need to sort the triangle from top to bottom.
   if(a[1] > b[1]) {
@@ -508,8 +538,8 @@ inline void Drawable::DrawTriangle(const Fixed*restrict a, const Fixed*restrict
   if(max == 0) return;
   fact = mid[1] - top[1];
   Fixed mx = (top[0] * (max - fact) + bot[0] * fact) / max;
-  if(mid[0] < mx) DrawTriangleL(top, mid, bot);
-  else if(mid[0] > mx) DrawTriangleR(top, mid, bot);
+  if(mid[0] < mx) DrawTriangleL(top, mid, bot, first, last);
+  else if(mid[0] > mx) DrawTriangleR(top, mid, bot, first, last);
   // else, infinitely thin triangle
 }
 
@@ -592,6 +622,13 @@ Clipf(Up, 1, <);
 Clipf(Down, 1, >);
 
 inline void Drawable::ClipNDrawTriangle(const Fixed*restrict a, const Fixed*restrict b, const Fixed*restrict c) throw() {
+  ClipNDrawTriangle(a, b, c, clip_top, clip_bottom + 1);
+}
+
+/* Clipping is always done against the whole clip rect, so that a triangle
+   drawn one band at a time has exactly the same edges as one drawn all at
+   once. first and last only choose which of its rows are drawn. */
+inline void Drawable::ClipNDrawTriangle(const Fixed*restrict a, const Fixed*restrict b, const Fixed*restrict c, int first, int last) throw() {
 #define MAXCLIPVERTICES (3+(MAXCLIPTRIANGLES*2))
 #define MAXCLIPTRIANGLES 16
   Fixed*restrict vertices[MAXCLIPVERTICES] = {const_cast<Fixed*restrict>(a), const_cast<Fixed*restrict>(b), const_cast<Fixed*restrict>(c)};
@@ -677,7 +714,7 @@ inline void Drawable::ClipNDrawTriangle(const Fixed*restrict a, const Fixed*rest
     }
   }
   for(int n = 0; n < numtriangles; ++n) {
-    DrawTriangle(vertices[triangles[n][0]],vertices[triangles[n][1]],vertices[triangles[n][2]]);
+    DrawTriangle(vertices[triangles[n][0]],vertices[triangles[n][1]],vertices[triangles[n][2]], first, last);
   }
 }
 
@@ -963,8 +1000,9 @@ inline void Drawable::DrawQuadLine(Fixed width, Fixed height, const Fixed*restri
   ClipNDrawTriangle(b, c, d);
 }
 
-void Drawable::DrawLines(lua_Number width, lua_Number height, const Fixed* coords, const Index* indices, size_t indexcount) throw() {
+template<class I> void Drawable::DrawLines(lua_Number width, lua_Number height, const Fixed* coords, const I* indices, size_t indexcount) throw() {
   size_t n;
+  if(damage) DamageCoords(coords, indices, indexcount, F_TO_Q((width > height ? width : height) / 2 + 1));
   if(width <= 1.0 && height <= 1.0) {
     for(n = 0; n < indexcount - 1; n += 2) {
       DrawBresenline(coords + indices[n] * 2, coords + indices[n+1] * 2);
@@ -979,8 +1017,9 @@ void Drawable::DrawLines(lua_Number width, lua_Number height, const Fixed* coord
   } 
 }
 
-void Drawable::DrawLineStrip(lua_Number width, lua_Number height, const Fixed* coords, const Index* indices, size_t indexcount) throw() {
+template<class I> void Drawable::DrawLineStrip(lua_Number width, lua_Number height, const Fixed* coords, const I* indices, size_t indexcount) throw() {
   size_t n;
+  if(damage) DamageCoords(coords, indices, indexcount, F_TO_Q((width > height ? width : height) / 2 + 1));
   if(width <= 1.0 && height <= 1.0) {
     for(n = 0; n < indexcount - 1; ++n) {
       DrawBresenline(coords + indices[n] * 2, coords + indices[n+1] * 2);
@@ -995,8 +1034,9 @@ void Drawable::DrawLineStrip(lua_Number width, lua_Number height, const Fixed* c
   } 
 }
 
-void Drawable::DrawLineLoop(lua_Number width, lua_Number height, const Fixed* coords, const Index* indices, size_t indexcount) throw() {
+template<class I> void Drawable::DrawLineLoop(lua_Number width, lua_Number height, const Fixed* coords, const I* indices, size_t indexcount) throw() {
   size_t n;
+  if(damage) DamageCoords(coords, indices, indexcount, F_TO_Q((width > height ? width : height) / 2 + 1));
   if(width <= 1.0 && height <= 1.0) {
     for(n = 0; n < indexcount - 1; ++n) {
       DrawBresenline(coords + indices[n] * 2, coords + indices[n+1] * 2);
@@ -1015,25 +1055,165 @@ void Drawable::DrawLineLoop(lua_Number width, lua_Number height, const Fixed* co
   } 
 }
 
-void Drawable::DrawTriangles(const Fixed* coords, const Index* indices, size_t indexcount) throw() {
+/* Big batches of triangles are sorted into horizontal bins, and the bins
+   are drawn on the worker pool. Each bin draws every triangle that touches
+   it, in the original order, but only the rows inside the bin; so every
+   pixel sees the same triangles in the same order as it would have with
+   the serial loop, and comes out exactly the same. */
+enum { BIN_TRIANGLES, BIN_STRIP, BIN_FAN };
+// fewer triangles than this aren't worth binning
+#define MIN_BINNED_TRIANGLES 256
+#define MIN_BIN_HEIGHT 8
+
+template<class I> struct LOCAL TriangleBins {
+  Drawable* dst;
+  const Fixed* coords;
+  const I* indices;
+  int mode;
+  int top, bottom, bin_height;
+  // triangles in bin n are bin_tris[bin_start[n]] up to bin_start[n+1]
+  size_t* bin_start;
+  size_t* bin_tris;
+};
+
+template<class I> static inline void TriangleVertices(const TriangleBins<I>* b, size_t n, const Fixed*& p, const Fixed*& q, const Fixed*& r) {
+  switch(b->mode) {
+  case BIN_TRIANGLES:
+    p = b->coords + b->indices[n*3] * 2;
+    q = b->coords + b->indices[n*3+1] * 2;
+    r = b->coords + b->indices[n*3+2] * 2;
+    break;
+  case BIN_STRIP:
+    p = b->coords + b->indices[n] * 2;
+    q = b->coords + b->indices[n+1] * 2;
+    r = b->coords + b->indices[n+2] * 2;
+    break;
+  default:
+    p = b->coords + b->indices[0] * 2;
+    q = b->coords + b->indices[n+1] * 2;
+    r = b->coords + b->indices[n+2] * 2;
+    break;
+  }
+}
+
+template<class I> void Drawable::TriangleBand(void* ctx, int first, int last) {
+  const TriangleBins<I>* b = (const TriangleBins<I>*)ctx;
+  for(int bin = first; bin < last; ++bin) {
+    int row_first = b->top + bin * b->bin_height;
+    int row_last = row_first + b->bin_height;
+    if(row_last > b->bottom + 1) row_last = b->bottom + 1;
+    for(size_t n = b->bin_start[bin]; n < b->bin_start[bin+1]; ++n) {
+      const Fixed* p, *q, *r;
+      TriangleVertices(b, b->bin_tris[n], p, q, r);
+      b->dst->ClipNDrawTriangle(p, q, r, row_first, row_last);
+    }
+  }
+}
+
+/* Returns false, without drawing anything, if the batch isn't worth
+   binning (or memory is short), in which case the caller should draw it
+   serially. */
+template<class I> bool Drawable::DrawTrianglesBinned(const Fixed* coords, const I* indices, size_t indexcount, int mode) throw() {
+  size_t count;
+  if(mode == BIN_TRIANGLES) count = indexcount / 3;
+  else count = indexcount >= 3 ? indexcount - 2 : 0;
+  if(count < MIN_BINNED_TRIANGLES) return false;
+  int workers = GetWorkerCount();
+  int height = clip_bottom - clip_top + 1;
+  if(workers <= 1 || height < MIN_BIN_HEIGHT * 2 || clip_right < clip_left) return false;
+  int bins = workers * 4;
+  if(bins > height / MIN_BIN_HEIGHT) bins = height / MIN_BIN_HEIGHT;
+  TriangleBins<I> b;
+  b.dst = this;
+  b.coords = coords;
+  b.indices = indices;
+  b.mode = mode;
+  b.top = clip_top;
+  b.bottom = clip_bottom;
+  b.bin_height = (height + bins - 1) / bins;
+  bins = (height + b.bin_height - 1) / b.bin_height;
+  b.bin_start = (size_t*)calloc(bins + 1, sizeof(size_t));
+  if(!b.bin_start) return false;
+  /* The first pass counts how many triangles land in each bin, the second
+     fills them in. A triangle draws rows Q_TO_I(top) up to Q_TO_I(bot). */
+  size_t total = 0;
+  b.bin_tris = NULL;
+  for(int pass = 0; pass < 2; ++pass) {
+    for(size_t n = 0; n < count; ++n) {
+      const Fixed* p, *q, *r;
+      TriangleVertices(&b, n, p, q, r);
+      if(cull_winding && Culled(p, q, r, mode == BIN_STRIP && (n & 1))) continue;
+      Fixed ymin = p[1], ymax = p[1];
+      if(q[1] < ymin) ymin = q[1]; else if(q[1] > ymax) ymax = q[1];
+      if(r[1] < ymin) ymin = r[1]; else if(r[1] > ymax) ymax = r[1];
+      int first = Q_TO_I(ymin), last = Q_TO_I(ymax) - 1;
+      if(first < clip_top) first = clip_top;
+      if(last > clip_bottom) last = clip_bottom;
+      if(last < first) continue;
+      int bin_first = (first - clip_top) / b.bin_height;
+      int bin_last = (last - clip_top) / b.bin_height;
+      for(int bin = bin_first; bin <= bin_last; ++bin) {
+	if(pass) b.bin_tris[b.bin_start[bin]++] = n;
+	else ++b.bin_start[bin];
+      }
+    }
+    if(!pass) {
+      for(int bin = 0; bin < bins; ++bin) {
+	size_t here = b.bin_start[bin];
+	b.bin_start[bin] = total;
+	total += here;
+      }
+      b.bin_start[bins] = total;
+      if(total == 0) { free(b.bin_start); return true; }
+      b.bin_tris = (size_t*)malloc(total * sizeof(size_t));
+      if(!b.bin_tris) { free(b.bin_start); return false; }
+    }
+  }
+  // the fill pass left each bin_start pointing at the next bin's start
+  for(int bin = bins; bin > 0; --bin)
+    b.bin_start[bin] = b.bin_start[bin-1];
+  b.bin_start[0] = 0;
+  ParallelBands(TriangleBand<I>, &b, 0, bins);
+  free(b.bin_tris);
+  free(b.bin_start);
+  return true;
+}
+
+template<class I> void Drawable::DrawTriangles(const Fixed* coords, const I* indices, size_t indexcount) throw() {
   size_t n;
+  if(indexcount < 3) return;
+  if(damage) DamageCoords(coords, indices, indexcount, I_TO_Q(1));
+  if(DrawTrianglesBinned(coords, indices, indexcount, BIN_TRIANGLES)) return;
   for(n = 0; n < indexcount - 2; n += 3) {
-    ClipNDrawTriangle(coords + indices[n] * 2, coords + indices[n+1] * 2, coords + indices[n+2] * 2);
+    const Fixed* a = coords + indices[n] * 2, *b = coords + indices[n+1] * 2, *c = coords + indices[n+2] * 2;
+    if(cull_winding && Culled(a, b, c, false)) continue;
+    ClipNDrawTriangle(a, b, c);
   }
 }
 
-void Drawable::DrawTriangleStrip(const Fixed* coords, const Index* indices, size_t indexcount) throw() {
+template<class I> void Drawable::DrawTriangleStrip(const Fixed* coords, const I* indices, size_t indexcount) throw() {
   size_t n;
+  if(indexcount < 3) return;
+  if(damage) DamageCoords(coords, indices, indexcount, I_TO_Q(1));
+  if(DrawTrianglesBinned(coords, indices, indexcount, BIN_STRIP)) return;
   for(n = 0; n < indexcount - 2; ++n) {
-    ClipNDrawTriangle(coords + indices[n] * 2, coords + indices[n+1] * 2, coords + indices[n+2] * 2);
+    const Fixed* a = coords + indices[n] * 2, *b = coords + indices[n+1] * 2, *c = coords + indices[n+2] * 2;
+    // every other triangle of a strip is wound backwards
+    if(cull_winding && Culled(a, b, c, n & 1)) continue;
+    ClipNDrawTriangle(a, b, c);
   }
 }
 
-void Drawable::DrawTriangleFan(const Fixed* coords, const Index* indices, size_t indexcount) throw() {
+template<class I> void Drawable::DrawTriangleFan(const Fixed* coords, const I* indices, size_t indexcount) throw() {
   size_t n;
+  if(indexcount < 3) return;
+  if(damage) DamageCoords(coords, indices, indexcount, I_TO_Q(1));
+  if(DrawTrianglesBinned(coords, indices, indexcount, BIN_FAN)) return;
   const Fixed* base = coords + indices[0] * 2;
   for(n = 1; n < indexcount - 1; ++n) {
-    ClipNDrawTriangle(base, coords + indices[n] * 2, coords + indices[n+1] * 2);
+    const Fixed* b = coords + indices[n] * 2, *c = coords + indices[n+1] * 2;
+    if(cull_winding && Culled(base, b, c, false)) continue;
+    ClipNDrawTriangle(base, b, c);
   }
 }
 
@@ -1043,7 +1223,8 @@ int Drawable::Lua_DrawLines(lua_State* L) throw() {
   IndexArray* i = lua_toobject(L, 2, IndexArray);
   lua_Number width = luaL_checknumber(L, 3);
   lua_Number height = luaL_optnumber(L, 4, width);
-  DrawLines(width, height, r->coords, i->indices, i->count);
+  if(i->indices32) DrawLines(width, height, r->coords, i->indices32, i->count);
+  else DrawLines(width, height, r->coords, i->indices, i->count);
   return 0;
 }
 
@@ -1053,7 +1234,8 @@ int Drawable::Lua_DrawLineStrip(lua_State* L) throw() {
   IndexArray* i = lua_toobject(L, 2, IndexArray);
   lua_Number width = luaL_checknumber(L, 3);
   lua_Number height = luaL_optnumber(L, 4, width);
-  DrawLineStrip(width, height, r->coords, i->indices, i->count);
+  if(i->indices32) DrawLineStrip(width, height, r->coords, i->indices32, i->count);
+  else DrawLineStrip(width, height, r->coords, i->indices, i->count);
   return 0;
 }
 
@@ -1063,7 +1245,8 @@ int Drawable::Lua_DrawLineLoop(lua_State* L) throw() {
   IndexArray* i = lua_toobject(L, 2, IndexArray);
   lua_Number width = luaL_checknumber(L, 3);
   lua_Number height = luaL_optnumber(L, 4, width);
-  DrawLineLoop(width, height, r->coords, i->indices, i->count);
+  if(i->indices32) DrawLineLoop(width, height, r->coords, i->indices32, i->count);
+  else DrawLineLoop(width, height, r->coords, i->indices, i->count);
   return 0;
 }
 
@@ -1072,7 +1255,8 @@ int Drawable::Lua_DrawTriangles(lua_State* L) throw() {
   CoordArray* r = lua_toobject(L, 1, CoordArray);
   IndexArray* i = lua_toobject(L, 2, IndexArray);
   size_t count = luaL_optinteger(L, 3, i->count);
-  DrawTriangles(r->coords, i->indices, count);
+  if(i->indices32) DrawTriangles(r->coords, i->indices32, count);
+  else DrawTriangles(r->coords, i->indices, count);
   return 0;
 }
 
@@ -1081,7 +1265,8 @@ int Drawable::Lua_DrawTriangleStrip(lua_State* L) throw() {
   CoordArray* r = lua_toobject(L, 1, CoordArray);
   IndexArray* i = lua_toobject(L, 2, IndexArray);
   size_t count = luaL_optinteger(L, 3, i->count);
-  DrawTriangleStrip(r->coords, i->indices, count);
+  if(i->indices32) DrawTriangleStrip(r->coords, i->indices32, count);
+  else DrawTriangleStrip(r->coords, i->indices, count);
   return 0;
 }
 
@@ -1090,7 +1275,17 @@ int Drawable::Lua_DrawTriangleFan(lua_State* L) throw() {
   CoordArray* r = lua_toobject(L, 1, CoordArray);
   IndexArray* i = lua_toobject(L, 2, IndexArray);
   size_t count = luaL_optinteger(L, 3, i->count);
-  DrawTriangleFan(r->coords, i->indices, count);
+  if(i->indices32) DrawTriangleFan(r->coords, i->indices32, count);
+  else DrawTriangleFan(r->coords, i->indices, count);
   return 0;
 }
 
+#define INSTANTIATE(I) \
+  template void Drawable::DrawLines<I>(lua_Number, lua_Number, const Fixed*, const I*, size_t) throw(); \
+  template void Drawable::DrawLineStrip<I>(lua_Number, lua_Number, const Fixed*, const I*, size_t) throw(); \
+  template void Drawable::DrawLineLoop<I>(lua_Number, lua_Number, const Fixed*, const I*, size_t) throw(); \
+  template void Drawable::DrawTriangles<I>(const Fixed*, const I*, size_t) throw(); \
+  template void Drawable::DrawTriangleStrip<I>(const Fixed*, const I*, size_t) throw(); \
+  template void Drawable::DrawTriangleFan<I>(const Fixed*, const I*, size_t) throw();
+INSTANTIATE(Index)
+INSTANTIATE(Index32)
@@ -0,0 +1,192 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#include "graphics.h"
+#include "blitkernels.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <math.h>
+
+using namespace SubCritical;
+
+/* Every pixel is classified exactly the way BlitRect would treat it, so that
+   blitting the runs gives the same colors as blitting the source. The only
+   difference is that pixels under fully transparent source pixels keep
+   whatever is in their (unused) alpha bits, just as simple alpha blits
+   already leave them. */
+
+enum { TRANSPARENT, OPAQUE, PARTIAL };
+
+/* Blending an opaque pixel gives the same result as copying it, so short
+   stretches of opaque pixels are folded into the partial runs around them
+   rather than costing a run of their own. */
+#define MIN_OPAQUE_RUN 8
+
+RLEGraphic::RLEGraphic(const Drawable& source)
+  : width(source.width), height(source.height),
+    has_alpha(source.has_alpha && !source.fake_alpha),
+    premultiplied(has_alpha && source.premultiplied),
+    layout(source.layout) {
+  Pixel mask = 0xFF << source.ash;
+  Pixel or_mask = source.fake_alpha && !source.has_alpha ? mask : 0;
+  bool simple = has_alpha && source.simple_alpha;
+#define CLASSIFY(p) \
+  (!has_alpha ? OPAQUE \
+   : simple ? ((p) & mask ? OPAQUE : TRANSPARENT) \
+   : ((p) & mask) == mask ? OPAQUE : ((p) & mask) ? PARTIAL : TRANSPARENT)
+  /* The first pass only counts, the second fills in. */
+  run_count = 0;
+  pixel_count = 0;
+  row_runs = NULL;
+  runs = NULL;
+  pixels = NULL;
+  for(int pass = 0; pass < 2; ++pass) {
+    RLERun* run = runs;
+    Pixel* out = pixels;
+    for(int y = 0; y < height; ++y) {
+      const Pixel* row = source.rows[y];
+      if(pass) row_runs[y] = run;
+      int x = 0;
+      while(x < width) {
+	if(CLASSIFY(row[x]) == TRANSPARENT) { ++x; continue; }
+	int end = x;
+	while(end < width && CLASSIFY(row[end]) != TRANSPARENT) ++end;
+	while(x < end) {
+	  int next = x;
+	  while(next < end && CLASSIFY(row[next]) == OPAQUE) ++next;
+	  bool partial = !(next > x && (next - x >= MIN_OPAQUE_RUN || next == end));
+	  if(partial) {
+	    next = x;
+	    while(next < end) {
+	      if(CLASSIFY(row[next]) == OPAQUE) {
+		int o = next;
+		while(o < end && CLASSIFY(row[o]) == OPAQUE) ++o;
+		if(o - next >= MIN_OPAQUE_RUN) break;
+		next = o;
+	      }
+	      else ++next;
+	    }
+	  }
+	  if(pass) {
+	    run->x = x;
+	    run->count = next - x;
+	    run->partial = partial;
+	    run->pixels = out;
+	    for(int n = x; n < next; ++n)
+	      *out++ = row[n] | or_mask;
+	    ++run;
+	  }
+	  else {
+	    ++run_count;
+	    pixel_count += next - x;
+	  }
+	  x = next;
+	}
+      }
+    }
+    if(pass) row_runs[height] = run;
+    else {
+      row_runs = (RLERun**)malloc((height + 1) * sizeof(RLERun*));
+      runs = (RLERun*)malloc((run_count ? run_count : 1) * sizeof(RLERun));
+      pixels = (Pixel*)malloc((pixel_count ? pixel_count : 1) * sizeof(Pixel));
+      assert(row_runs && runs && pixels);
+    }
+  }
+#undef CLASSIFY
+}
+
+RLEGraphic::~RLEGraphic() {
+  free(row_runs);
+  free(runs);
+  free(pixels);
+}
+
+int RLEGraphic::Lua_GetSize(lua_State* L) const throw() {
+  lua_pushnumber(L, width);
+  lua_pushnumber(L, height);
+  return 2;
+}
+
+int RLEGraphic::Lua_GetRunCount(lua_State* L) const throw() {
+  lua_pushnumber(L, run_count);
+  lua_pushnumber(L, pixel_count);
+  return 2;
+}
+
+void Drawable::BlitRect(const RLEGraphic*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy) restrict throw() {
+  CLIP_FOR_BLIT();
+  DAMAGE_FOR_BLIT();
+  PARALLEL_BLIT(Drawable::BlitRect);
+  PixelShifts shifts = {rsh, gsh, bsh, ash};
+  BlendRowKernel kernel = gfk->premultiplied ? blit_kernels->blend_premul : blit_kernels->blend_alpha;
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
+    Pixel*restrict dst = rows[dY] + dx;
+    for(const RLERun* run = gfk->row_runs[sY]; run < gfk->row_runs[sY+1]; ++run) {
+      int l = run->x, r = run->x + run->count - 1;
+      if(r < sl) continue;
+      else if(l > sr) break;
+      if(l < sl) l = sl;
+      if(r > sr) r = sr;
+      if(run->partial)
+	kernel(dst + (l - sl), run->pixels + (l - run->x), r - l + 1, shifts);
+      else
+	memcpy(dst + (l - sl), run->pixels + (l - run->x), (r - l + 1) * sizeof(Pixel));
+    }
+  }
+}
+
+void Drawable::BlitRectT(const RLEGraphic*restrict gfk, int sx, int sy, int sw, int sh, int dx, int dy, lua_Number a) restrict throw() {
+  uint32_t an = (uint32_t)floorf(a * 65536.f + 0.5f);
+  if(an >= 65536) return BlitRect(gfk, sx, sy, sw, sh, dx, dy);
+  else if(an == 0) return;
+  CLIP_FOR_BLIT();
+  DAMAGE_FOR_BLIT();
+  PARALLEL_BLIT_T(Drawable::BlitRectT, a);
+  PixelShifts shifts = {rsh, gsh, bsh, ash};
+  BlendRowKernelT opaque = gfk->has_alpha ? blit_kernels->blend_simple_t : blit_kernels->blend_opaque_t;
+  BlendRowKernelT partial = gfk->premultiplied ? blit_kernels->blend_premul_t : blit_kernels->blend_alpha_t;
+  for(int sY = st, dY = dy; sY <= sb; ++sY, ++dY) {
+    Pixel*restrict dst = rows[dY] + dx;
+    for(const RLERun* run = gfk->row_runs[sY]; run < gfk->row_runs[sY+1]; ++run) {
+      int l = run->x, r = run->x + run->count - 1;
+      if(r < sl) continue;
+      else if(l > sr) break;
+      if(l < sl) l = sl;
+      if(r > sr) r = sr;
+      (run->partial ? partial : opaque)(dst + (l - sl), run->pixels + (l - run->x), r - l + 1, shifts, an);
+    }
+  }
+}
+
+static const struct ObjectMethod RGMethods[] = {
+  METHOD("GetSize", &RLEGraphic::Lua_GetSize),
+  METHOD("GetRunCount", &RLEGraphic::Lua_GetRunCount),
+  NOMOREMETHODS(),
+};
+PROTOCOL_IMP(RLEGraphic, Object, RGMethods);
+
+SUBCRITICAL_CONSTRUCTOR(RLEGraphic)(lua_State* L) {
+  Drawable* d = lua_toobject(L, 1, Drawable);
+  RLEGraphic* p = new RLEGraphic(*d);
+  p->Push(L);
+  return 1;
+}
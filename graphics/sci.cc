@@ -20,6 +20,7 @@
  */
 #include "graphics.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 using namespace SubCritical;
@@ -71,10 +72,22 @@ bool SCIDumper::Dump(Graphic* graphic, DumpOut& out, const char*& err) throw() {
   sizes[0] = Swap16_BE(graphic->width);
   sizes[1] = Swap16_BE(graphic->height);
   if(!out.Write(sizes, 4)) { err = "I/O error"; return false; }
-  graphic->ChangeLayout(little_endian ? FB_BGRx : FB_xRGB);
+  FBLayout sci_layout = little_endian ? FB_BGRx : FB_xRGB;
+  if(graphic->layout == sci_layout) {
+    for(int y = 0; y < graphic->height; ++y) {
+      if(!out.Write(graphic->rows[y], graphic->width * 4)) { err = "I/O error"; return false; }
+    }
+    return true;
+  }
+  /* convert a row at a time, rather than changing the whole Graphic's layout
+     only for it to be changed back the next time it's blitted */
+  Pixel* row = (Pixel*)malloc(graphic->width * sizeof(Pixel));
+  if(!row) { err = "Out of memory"; return false; }
   for(int y = 0; y < graphic->height; ++y) {
-    if(!out.Write(graphic->rows[y], graphic->width * 4)) { err = "I/O error"; return false; }
+    ConvertPixels(row, graphic->rows[y], graphic->width, graphic->layout, sci_layout);
+    if(!out.Write(row, graphic->width * 4)) { free(row); err = "I/O error"; return false; }
   }
+  free(row);
   return true;
 }
 
@@ -0,0 +1,308 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#include "graphics.h"
+#include "blitkernels.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include <math.h>
+
+using namespace SubCritical;
+
+/* Each destination row is sampled, a chunk at a time, into a row of source
+   pixels, which then goes through the same row kernels BlitRect and
+   BlitRectT use. So a transformed blit treats alpha exactly the way a plain
+   one does, and an identity transform with nearest sampling gives exactly
+   the same result as BlitRect. */
+#define CHUNK 256
+
+/* Positions are stepped across a row in 32.32 fixed point. */
+#define FIX_ONE 4294967296.0
+
+enum BlendMode { COPY, COPY_MASKED, COPY_SIMPLE, KERNEL, KERNEL_T };
+
+struct LOCAL TransformedBlit {
+  Drawable* dst;
+  const Drawable* src;
+  Pixel*restrict const* dst_rows;
+  int sx, sy, sw, sh;
+  int clip_left, clip_right;
+  // inverse transform: source position (relative to sx, sy) of a
+  // destination position
+  double u0, dudx, dudy, v0, dvdx, dvdy;
+  bool bilinear;
+  BlendMode mode;
+  BlendRowKernel kernel;
+  BlendRowKernelT kernel_t;
+  uint32_t an;
+  Pixel mask;
+  PixelShifts dsh, ssh;
+  bool src_alpha, src_premul;
+};
+
+/* Find the part of [left, right] where lo <= a + b * x < hi. */
+static void Restrict(double a, double b, double lo, double hi, int& left, int& right) {
+  if(b == 0) {
+    if(a < lo || a >= hi) right = left - 1;
+    return;
+  }
+  double p = (lo - a) / b, q = (hi - a) / b;
+  if(p > q) { double t = p; p = q; q = t; }
+  double l = ceil(p - 0.5), r = floor(q - 0.5);
+  if(l > left) left = l > right + 1 ? right + 1 : (int)l;
+  if(r < right) right = r < left - 1 ? left - 1 : (int)r;
+}
+
+// false for infinities and NaNs
+static inline bool Finite(double x) {
+  return x - x == 0;
+}
+
+static inline int clampi(int x, int lo, int hi) {
+  return x < lo ? lo : x > hi ? hi : x;
+}
+
+static void SampleNearest(const TransformedBlit* b, Pixel*restrict out, size_t count, int64_t u, int64_t v, int64_t du, int64_t dv) {
+  Pixel*restrict const* rows = b->src->rows;
+  while(count-- > 0) {
+    int x = clampi((int)(u >> 32), 0, b->sw - 1) + b->sx;
+    int y = clampi((int)(v >> 32), 0, b->sh - 1) + b->sy;
+    *out++ = rows[y][x];
+    u += du; v += dv;
+  }
+}
+
+/* Bilinear filtering happens in linear light. Colors of non-premultiplied
+   pixels are weighted by their alpha, so that transparent pixels' colors
+   don't bleed into the result. */
+static void SampleBilinear(const TransformedBlit* b, Pixel*restrict out, size_t count, int64_t u, int64_t v, int64_t du, int64_t dv) {
+  Pixel*restrict const* rows = b->src->rows;
+  const PixelShifts& sh = b->ssh;
+  const float inv = 1.f / 4294967296.f;
+  while(count-- > 0) {
+    // sample centers are at half-pixels
+    int64_t uu = u - ((int64_t)1 << 31), vv = v - ((int64_t)1 << 31);
+    int x0 = (int)(uu >> 32), y0 = (int)(vv >> 32);
+    float fx = (uint32_t)uu * inv, fy = (uint32_t)vv * inv;
+    int x1 = clampi(x0 + 1, 0, b->sw - 1) + b->sx;
+    int y1 = clampi(y0 + 1, 0, b->sh - 1) + b->sy;
+    x0 = clampi(x0, 0, b->sw - 1) + b->sx;
+    y0 = clampi(y0, 0, b->sh - 1) + b->sy;
+    Pixel p[4] = {rows[y0][x0], rows[y0][x1], rows[y1][x0], rows[y1][x1]};
+    float w[4] = {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy};
+    float r = 0, g = 0, bl = 0, a = 0;
+    for(int n = 0; n < 4; ++n) {
+      float pa = b->src_alpha ? ((p[n] >> sh.ash) & 255) * (1.f / 255.f) : 1.f;
+      float wc = b->src_alpha && !b->src_premul ? w[n] * pa : w[n];
+      r += wc * SrgbToLinear[(p[n] >> sh.rsh) & 255];
+      g += wc * SrgbToLinear[(p[n] >> sh.gsh) & 255];
+      bl += wc * SrgbToLinear[(p[n] >> sh.bsh) & 255];
+      a += w[n] * pa;
+    }
+    if(b->src_alpha && !b->src_premul) {
+      if(a > 0) { r /= a; g /= a; bl /= a; }
+      else r = g = bl = 0;
+    }
+    uint32_t ri = r >= 65535.f ? 65535 : (uint32_t)(r + 0.5f);
+    uint32_t gi = g >= 65535.f ? 65535 : (uint32_t)(g + 0.5f);
+    uint32_t bi = bl >= 65535.f ? 65535 : (uint32_t)(bl + 0.5f);
+    uint32_t ai = a >= 1.f ? 255 : (uint32_t)(a * 255.f + 0.5f);
+    *out++ = ((Pixel)LinearToSrgb[ri] << sh.rsh) | ((Pixel)LinearToSrgb[gi] << sh.gsh) | ((Pixel)LinearToSrgb[bi] << sh.bsh) | ((Pixel)ai << sh.ash);
+    u += du; v += dv;
+  }
+}
+
+static void TransformBand(void* ctx, int first, int last) {
+  const TransformedBlit* b = (const TransformedBlit*)ctx;
+  Pixel buf[CHUNK];
+  for(int y = first; y < last; ++y) {
+    double cy = y + 0.5;
+    int left = b->clip_left, right = b->clip_right;
+    // keep only the destination pixels whose centers land in the source rect
+    Restrict(b->u0 + b->dudy * cy, b->dudx, 0, b->sw, left, right);
+    Restrict(b->v0 + b->dvdy * cy, b->dvdx, 0, b->sh, left, right);
+    if(right < left) continue;
+    double cx = left + 0.5;
+    int64_t u = (int64_t)floor((b->u0 + b->dudx * cx + b->dudy * cy) * FIX_ONE);
+    int64_t v = (int64_t)floor((b->v0 + b->dvdx * cx + b->dvdy * cy) * FIX_ONE);
+    int64_t du = (int64_t)floor(b->dudx * FIX_ONE + 0.5);
+    int64_t dv = (int64_t)floor(b->dvdx * FIX_ONE + 0.5);
+    Pixel*restrict dst = b->dst_rows[y] + left;
+    for(int x = left; x <= right; x += CHUNK) {
+      size_t count = right - x + 1 > CHUNK ? CHUNK : right - x + 1;
+      if(b->bilinear) SampleBilinear(b, buf, count, u, v, du, dv);
+      else SampleNearest(b, buf, count, u, v, du, dv);
+      u += du * (int64_t)count;
+      v += dv * (int64_t)count;
+      switch(b->mode) {
+      case COPY:
+	memcpy(dst, buf, count * sizeof(Pixel));
+	break;
+      case COPY_MASKED:
+	for(size_t n = 0; n < count; ++n) dst[n] = buf[n] | b->mask;
+	break;
+      case COPY_SIMPLE:
+	for(size_t n = 0; n < count; ++n) if(buf[n] & b->mask) dst[n] = buf[n];
+	break;
+      case KERNEL:
+	b->kernel(dst, buf, count, b->dsh);
+	break;
+      case KERNEL_T:
+	b->kernel_t(dst, buf, count, b->dsh, b->an);
+	break;
+      }
+      dst += count;
+    }
+  }
+}
+
+void Drawable::BlitTransformed(const Drawable*restrict gfk, int sx, int sy, int sw, int sh, const lua_Number m[6], bool bilinear, lua_Number a) restrict throw() {
+  uint32_t an = (uint32_t)floorf(a * 65536.f + 0.5f);
+  if(an == 0) return;
+  // only sample from inside the source
+  if(sx < 0) { sw += sx; sx = 0; }
+  if(sy < 0) { sh += sy; sy = 0; }
+  if(sx + sw > gfk->width) sw = gfk->width - sx;
+  if(sy + sh > gfk->height) sh = gfk->height - sy;
+  if(sw <= 0 || sh <= 0) return;
+  // m is column-major: x' = m[0]*u + m[2]*v + m[4], y' = m[1]*u + m[3]*v + m[5]
+  double det = m[0] * m[3] - m[2] * m[1];
+  if(fabs(det) < 1e-12) return;
+  TransformedBlit b;
+  b.dst = this;
+  b.src = gfk;
+  b.dst_rows = rows;
+  b.sx = sx; b.sy = sy; b.sw = sw; b.sh = sh;
+  b.clip_left = clip_left; b.clip_right = clip_right;
+  b.dudx = m[3] / det;
+  b.dudy = -m[2] / det;
+  b.u0 = -(b.dudx * m[4] + b.dudy * m[5]);
+  b.dvdx = -m[1] / det;
+  b.dvdy = m[0] / det;
+  b.v0 = -(b.dvdx * m[4] + b.dvdy * m[5]);
+  /* The inverse has to be finite, and stepping one destination pixel
+     mustn't overflow the 32.32 source coordinates. (A source shrunk that
+     far covers less than a pixel anyway.) */
+  if(!(Finite(b.u0) && Finite(b.v0) && Finite(b.dudy) && Finite(b.dvdy)
+       && fabs(b.dudx) < 1e9 && fabs(b.dvdx) < 1e9)) return;
+  b.bilinear = bilinear;
+  b.an = an;
+  b.mask = 0xFF << ash;
+  PixelShifts dsh = {rsh, gsh, bsh, ash};
+  PixelShifts ssh = {gfk->rsh, gfk->gsh, gfk->bsh, gfk->ash};
+  b.dsh = dsh;
+  b.ssh = ssh;
+  b.src_alpha = gfk->has_alpha && !gfk->fake_alpha;
+  b.src_premul = b.src_alpha && gfk->premultiplied;
+  // the same choices BlitRect and BlitRectT make
+  bool simple = b.src_alpha && gfk->simple_alpha && !bilinear;
+  if(an >= 65536) {
+    if(!b.src_alpha) b.mode = gfk->fake_alpha ? COPY_MASKED : COPY;
+    else if(simple) b.mode = COPY_SIMPLE;
+    else {
+      b.mode = KERNEL;
+      b.kernel = b.src_premul ? blit_kernels->blend_premul : blit_kernels->blend_alpha;
+    }
+  }
+  else {
+    b.mode = KERNEL_T;
+    if(!b.src_alpha) b.kernel_t = blit_kernels->blend_opaque_t;
+    else if(simple) b.kernel_t = blit_kernels->blend_simple_t;
+    else if(b.src_premul) b.kernel_t = blit_kernels->blend_premul_t;
+    else b.kernel_t = blit_kernels->blend_alpha_t;
+  }
+  // extent of the transformed source rect
+  double left = m[4], right = m[4], top = m[5], bot = m[5];
+  double xs[3] = {m[0] * sw + m[4], m[2] * sh + m[4], m[0] * sw + m[2] * sh + m[4]};
+  double ys[3] = {m[1] * sw + m[5], m[3] * sh + m[5], m[1] * sw + m[3] * sh + m[5]};
+  for(int n = 0; n < 3; ++n) {
+    if(xs[n] < left) left = xs[n];
+    if(xs[n] > right) right = xs[n];
+    if(ys[n] < top) top = ys[n];
+    if(ys[n] > bot) bot = ys[n];
+  }
+  /* Nothing is drawn unless the extent overlaps the clip rect, which also
+     catches NaNs and infinities; after that, clamping keeps every
+     conversion to int in range. */
+  if(!(top < clip_bottom + 1 && bot > clip_top && left < clip_right + 1 && right > clip_left)) return;
+  int first = top < clip_top ? clip_top : (int)floor(top);
+  int last = bot > clip_bottom + 1 ? clip_bottom + 1 : (int)ceil(bot);
+  if(last <= first || clip_right < clip_left) return;
+  if(damage) {
+    int l = left < clip_left ? clip_left : (int)floor(left);
+    int r = right > clip_right ? clip_right : (int)ceil(right) - 1;
+    AddDamage(l, first, r, last - 1);
+  }
+  int width = clip_right - clip_left + 1;
+  if((double)width * (last - first) >= PARALLEL_BLIT_AREA)
+    ParallelBands(TransformBand, &b, first, last, BlitGrain(width));
+  else
+    TransformBand(&b, first, last);
+}
+
+/* The matrix may be given as a table of six numbers, in column-major order
+   (as returned by calling a Mat2x3), or as anything that returns them when
+   called (such as the Mat2x3 itself). */
+static void GetMatrix(lua_State* L, int n, lua_Number m[6]) {
+  if(lua_istable(L, n)) {
+    for(int i = 0; i < 6; ++i) {
+      lua_rawgeti(L, n, i + 1);
+      if(!lua_isnumber(L, -1)) luaL_error(L, "BlitTransformed's matrix needs six numbers");
+      m[i] = lua_tonumber(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  else if(lua_isuserdata(L, n)) {
+    int top = lua_gettop(L);
+    lua_pushvalue(L, n);
+    lua_call(L, 0, LUA_MULTRET);
+    if(lua_gettop(L) - top != 6) luaL_error(L, "BlitTransformed's matrix must be a Mat2x3");
+    for(int i = 0; i < 6; ++i) m[i] = lua_tonumber(L, top + 1 + i);
+    lua_settop(L, top);
+  }
+  else luaL_typerror(L, n, "Mat2x3 or table");
+}
+
+int Drawable::Lua_BlitTransformed(lua_State* L) restrict throw() {
+  if(has_alpha) return luaL_error(L, "Graphics with alpha channels cannot be modified with this function. Try :Copy.");
+  Drawable*restrict gfk = lua_toobject(L,1,Drawable);
+  if(DrawablesOverlap(gfk, this)) return luaL_error(L, "Source and destination Drawable must not overlap");
+  if(!MatchLayouts(gfk, this))
+    return luaL_error(L, "Attempt to blit between two non-morphable Drawables!");
+  lua_Number m[6];
+  GetMatrix(L, 2, m);
+  bool bilinear = false;
+  if(!lua_isnoneornil(L, 3)) {
+    const char* filter = luaL_checkstring(L, 3);
+    if(!strcmp(filter, "bilinear")) bilinear = true;
+    else if(strcmp(filter, "nearest")) return luaL_error(L, "Unknown filter \"%s\" (expected \"nearest\" or \"bilinear\")", filter);
+  }
+  lua_Number a = luaL_optnumber(L, 4, 1);
+  int sx = 0, sy = 0, sw = gfk->width, sh = gfk->height;
+  if(!lua_isnoneornil(L, 5)) {
+    sx = (int)luaL_checknumber(L, 5);
+    sy = (int)luaL_checknumber(L, 6);
+    sw = (int)luaL_checknumber(L, 7);
+    sh = (int)luaL_checknumber(L, 8);
+  }
+  BlitTransformed(gfk, sx, sy, sw, sh, m, bilinear, a);
+  return 0;
+}
@@ -0,0 +1,139 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+#include "graphics.h"
+
+using namespace SubCritical;
+
+GraphicView::GraphicView(Graphic* parent, int x, int y, int w, int h) : xoff(x), yoff(y), prev_view(NULL) {
+  if(parent->IsA("GraphicView")) {
+    GraphicView* pv = (GraphicView*)parent;
+    root = pv->root;
+    xoff += pv->xoff;
+    yoff += pv->yoff;
+  }
+  else root = parent;
+  this->width = w;
+  this->height = h;
+  this->layout = parent->layout;
+  this->pending_layout = parent->pending_layout;
+  this->has_alpha = parent->has_alpha;
+  this->simple_alpha = parent->simple_alpha;
+  this->premultiplied = parent->premultiplied;
+  int32_t pitch = parent->height > 1 ? parent->rows[1] - parent->rows[0] : PadWidth(parent->width);
+  if(pitch < 0)
+    SetupDrawable(parent->rows[y + h - 1] + x, pitch);
+  else
+    SetupDrawable(parent->rows[y] + x, pitch);
+  if(root) {
+    next_view = root->views;
+    if(next_view) next_view->prev_view = this;
+    root->views = this;
+  }
+  else next_view = NULL;
+}
+
+GraphicView::~GraphicView() {
+  if(!root) return;
+  if(prev_view) prev_view->next_view = next_view;
+  else root->views = next_view;
+  if(next_view) next_view->prev_view = prev_view;
+}
+
+int GraphicView::Lua_GetOffset(lua_State* L) const throw() {
+  lua_pushinteger(L, xoff);
+  lua_pushinteger(L, yoff);
+  return 2;
+}
+
+bool SubCritical::DrawablesOverlap(const Drawable* a, const Drawable* b) throw() {
+  if(a == b) return true;
+  const Drawable* ra = a, *rb = b;
+  int ax = 0, ay = 0, bx = 0, by = 0;
+  if(a->IsA("GraphicView") && ((const GraphicView*)a)->root) {
+    const GraphicView* v = (const GraphicView*)a;
+    ra = v->root; ax = v->xoff; ay = v->yoff;
+  }
+  if(b->IsA("GraphicView") && ((const GraphicView*)b)->root) {
+    const GraphicView* v = (const GraphicView*)b;
+    rb = v->root; bx = v->xoff; by = v->yoff;
+  }
+  if(ra != rb) return false;
+  return ax < bx + b->width && bx < ax + a->width && ay < by + b->height && by < ay + a->height;
+}
+
+static const struct ObjectMethod GVMethods[] = {
+  METHOD("GetOffset", &GraphicView::Lua_GetOffset),
+  NOMOREMETHODS(),
+};
+PROTOCOL_IMP(GraphicView, Graphic, GVMethods);
+
+#define COOKIE ((void*)(Construct_GraphicView))
+
+SUBCRITICAL_CONSTRUCTOR(GraphicView)(lua_State* L) {
+  Graphic* parent = lua_toobject(L, 1, Graphic);
+  int x, y, w, h;
+  x = luaL_optinteger(L, 2, 0);
+  y = luaL_optinteger(L, 3, 0);
+  w = luaL_optinteger(L, 4, parent->width - x);
+  h = luaL_optinteger(L, 5, parent->height - y);
+  if(x < 0 || x >= parent->width) return luaL_error(L, "x coordinate outside the parent Graphic");
+  if(y < 0 || y >= parent->height) return luaL_error(L, "y coordinate outside the parent Graphic");
+  if(w <= 0 || x + w > parent->width) return luaL_error(L, "bad width given parent Graphic");
+  if(h <= 0 || y + h > parent->height) return luaL_error(L, "bad height given parent Graphic");
+  NewGraphicView(L, 1, x, y, w, h);
+  return 1;
+}
+
+/* Each view is a weak key whose value is the Graphic it ultimately views, so
+   the Graphic lives at least as long as any of its views. */
+GraphicView* SubCritical::NewGraphicView(lua_State* L, int index, int x, int y, int w, int h) throw() {
+  if(index < 0) index = lua_gettop(L) + index + 1;
+  Graphic* parent = lua_toobject(L, index, Graphic);
+  lua_pushlightuserdata(L, COOKIE);
+  lua_gettable(L, LUA_REGISTRYINDEX);
+  if(lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, COOKIE);
+    lua_pushvalue(L, -2);
+    lua_settable(L, LUA_REGISTRYINDEX);
+  }
+  // the registry table, then the Graphic to keep alive
+  int registry = lua_gettop(L);
+  if(parent->IsA("GraphicView")) {
+    lua_pushvalue(L, index);
+    lua_gettable(L, registry);
+  }
+  else lua_pushvalue(L, index);
+  GraphicView* ret = new GraphicView(parent, x, y, w, h);
+  ret->Push(L);
+  lua_pushvalue(L, -1);
+  lua_pushvalue(L, registry + 1);
+  lua_settable(L, registry);
+  // leave just the view
+  lua_replace(L, registry);
+  lua_pop(L, 1);
+  return ret;
+}
@@ -18,7 +18,7 @@
 
   Please see doc/license.html for clarifications.
 */
-#include "subcritical/core.h"
+#include "perlin.h"
 
 #include <math.h>
 
@@ -40,7 +40,7 @@ static double grad(int hash, double x, double y, double z) {
     v = h<4 ? y : h==12||h==14 ? x : z;
   return ((h&1) == 0 ? u : -u) + ((h&2) == 0 ? v : -v);
 }
-static double noise(double x, double y, double z) {
+double SubCritical::PerlinNoise(double x, double y, double z) throw() {
   /* Find the unit cube that contains the point. */
   int X = (int)floor(x) & 255;
   int Y = (int)floor(y) & 255;
@@ -70,6 +70,6 @@ SUBCRITICAL_UTILITY(PerlinNoise)(lua_State* L) {
   x = luaL_checknumber(L, 1);
   y = luaL_checknumber(L, 2);
   z = luaL_optnumber(L, 3, 0.5);
-  lua_pushnumber(L, noise(x,y,z));
+  lua_pushnumber(L, SubCritical::PerlinNoise(x,y,z));
   return 1;
 }
@@ -1,62 +1,147 @@
 #include "subcritical/graphics.h"
 #include "vector.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace SubCritical;
 
-static uint16_t c16(Scalar in) {
-  if(in > 65535) return 65535;
-  else if(in < 0) return 0;
-  else return (uint16_t)in;
-}
+/* Channels are 16-bit linear values. The matrix is converted once per call
+   into one column of floats per input channel (each holding that channel's
+   contribution to the red, green, blue, and alpha outputs) plus a bias, so
+   each pixel is a few four-wide multiply-adds. Rows are split into bands on
+   the worker pool. Each pixel is read before it's written, so the source
+   can be its own destination. */
+
+// fewer pixels than this per band aren't worth handing off
+#define COLOR_MATRIX_BAND_AREA 16384
+
+struct LOCAL ColorMatrixJob {
+  const Drawable* in;
+  Drawable* out;
+  // [input][output]
+  float cols[4][4];
+  float bias[4];
+  float linear[256];
+  int rsh, gsh, bsh, ash;
+};
 
-#define in4 0
-#include "effect_subA.hpp"
-#undef in4
-#define in4 1
-#include "effect_subA.hpp"
-#undef in4
+template<bool IN_A, bool OUT_A> static void ColorMatrixBand(void* _job, int first, int last) {
+  const ColorMatrixJob* job = (const ColorMatrixJob*)_job;
+  const int rsh = job->rsh, gsh = job->gsh, bsh = job->bsh, ash = job->ash;
+  const float* linear = job->linear;
+#ifdef __SSE2__
+  const __m128 cr = _mm_loadu_ps(job->cols[0]), cg = _mm_loadu_ps(job->cols[1]);
+  const __m128 cb = _mm_loadu_ps(job->cols[2]), ca = _mm_loadu_ps(job->cols[3]);
+  const __m128 bias = _mm_loadu_ps(job->bias);
+  const __m128 zero = _mm_setzero_ps(), max = _mm_set1_ps(65535.f);
+#endif
+  for(int y = first; y < last; ++y) {
+    const Pixel* inp = job->in->rows[y];
+    Pixel* outp = job->out->rows[y];
+    for(int x = 0; x < job->in->width; ++x) {
+      Pixel p = inp[x];
+      int32_t o[4];
+#ifdef __SSE2__
+      __m128 v = _mm_add_ps(bias, _mm_mul_ps(cr, _mm_set1_ps(linear[(p >> rsh) & 255])));
+      v = _mm_add_ps(v, _mm_mul_ps(cg, _mm_set1_ps(linear[(p >> gsh) & 255])));
+      v = _mm_add_ps(v, _mm_mul_ps(cb, _mm_set1_ps(linear[(p >> bsh) & 255])));
+      if(IN_A) v = _mm_add_ps(v, _mm_mul_ps(ca, _mm_set1_ps((float)(((p >> ash) & 255) * 257))));
+      v = _mm_min_ps(_mm_max_ps(v, zero), max);
+      _mm_storeu_si128((__m128i*)o, _mm_cvttps_epi32(v));
+#else
+      float ri = linear[(p >> rsh) & 255], gi = linear[(p >> gsh) & 255], bi = linear[(p >> bsh) & 255];
+      float ai = IN_A ? (float)(((p >> ash) & 255) * 257) : 0.f;
+      for(int c = 0; c < (OUT_A ? 4 : 3); ++c) {
+	float v = job->bias[c] + job->cols[0][c] * ri + job->cols[1][c] * gi + job->cols[2][c] * bi;
+	if(IN_A) v += job->cols[3][c] * ai;
+	o[c] = v > 65535.f ? 65535 : v > 0.f ? (int32_t)v : 0;
+      }
+#endif
+      Pixel q = ((Pixel)LinearToSrgb[o[0]] << rsh) | ((Pixel)LinearToSrgb[o[1]] << gsh) | ((Pixel)LinearToSrgb[o[2]] << bsh);
+      if(OUT_A) q |= (Pixel)(o[3] >> 8) << ash;
+      outp[x] = q;
+    }
+  }
+}
 
+/* SCUtil.ApplyColorMatrix(in, matrix[, bias[, destination]]) */
 SUBCRITICAL_UTILITY(ApplyColorMatrix)(lua_State* L) {
   Drawable* in = lua_toobject(L, 1, Drawable);
   Matrix* mat = lua_toobject(L, 2, Matrix);
   if(mat->r < 3 || mat->c < 3) return luaL_error(L, "Must be a Mat3x3 or larger");
-  Scalar plusr = 0.0, plusg = 0.0, plusb = 0.0, plusa = 0.0;
+  // the matrix is meant for straight colors, and the result is marked straight
+  if(in->has_alpha && in->premultiplied)
+    return luaL_error(L, "ApplyColorMatrix can't take a premultiplied Drawable; Unpremultiply it first");
+  ColorMatrixJob job;
+  for(int c = 0; c < 4; ++c) job.bias[c] = 0.f;
   if(lua_gettop(L) >= 3 && !lua_isnil(L, 3)) {
     Vector* vec = lua_toobject(L, 3, Vector);
-    plusr = ((Vec2*)vec)->x * 65535;
-    plusg = ((Vec2*)vec)->y * 65535;
+    job.bias[0] = ((Vec2*)vec)->x * 65535;
+    job.bias[1] = ((Vec2*)vec)->y * 65535;
     if(vec->n >= 3) {
-      plusb = ((Vec3*)vec)->z * 65535;
+      job.bias[2] = ((Vec3*)vec)->z * 65535;
       if(vec->n >= 4)
-	plusa = ((Vec4*)vec)->w * 65535;
+	job.bias[3] = ((Vec4*)vec)->w * 65535;
     }
   }
-  if(in->has_alpha) {
-    if(mat->r == 4) {
-      if(mat->c == 4)
-	return doit44T(L, in, mat, plusr, plusg, plusb, plusa);
-      else
-	return doit34T(L, in, mat, plusr, plusg, plusb, plusa);
-    }
-    else {
-      if(mat->c == 4)
-	return doit43T(L, in, mat, plusr, plusg, plusb, plusa);
-      else
-	return doit33T(L, in, mat, plusr, plusg, plusb, plusa);
-    }
+  Drawable* out;
+  if(lua_gettop(L) >= 4 && !lua_isnil(L, 4)) {
+    out = lua_toobject(L, 4, Drawable);
+    if(out->width != in->width || out->height != in->height)
+      return luaL_error(L, "ApplyColorMatrix needs a %dx%d destination", in->width, in->height);
+    // rows are done in parallel, so a partly overlapping view would be read
+    // after another band had written it
+    if(out != in && DrawablesOverlap(in, out))
+      return luaL_error(L, "source and destination must be the same or not overlap");
+    if(out != in && !MatchLayouts(in, out))
+      return luaL_error(L, "Attempt to ApplyColorMatrix between two non-morphable Drawables!");
+    lua_pushvalue(L, 4);
+    out->AddDamage(0, 0, out->width - 1, out->height - 1);
   }
   else {
-    if(mat->r == 4) {
-      if(mat->c == 4)
-	return doit44F(L, in, mat, plusr, plusg, plusb, plusa);
-      else
-	return doit34F(L, in, mat, plusr, plusg, plusb, plusa);
-    }
+    // every pixel gets written, so don't bother clearing
+    out = new Graphic(in->width, in->height, in->layout, false);
+    out->Push(L); // will now be garbage collected
+  }
+  // matrices are stored a column at a time
+  const Scalar* m;
+  if(mat->r == 4) m = mat->c == 4 ? &((Mat4x4*)mat)->xx : &((Mat4x3*)mat)->xx;
+  else m = mat->c == 4 ? &((Mat3x4*)mat)->xx : &((Mat3x3*)mat)->xx;
+  for(int c = 0; c < 4; ++c)
+    for(int r = 0; r < 4; ++r)
+      job.cols[c][r] = c < mat->c && r < mat->r ? m[c * mat->r + r] : 0.f;
+  const bool in_a = mat->c == 4 && in->has_alpha, out_a = mat->r == 4;
+  if(mat->c == 4 && !in->has_alpha) {
+    // the alpha input is always 1, so its column is just more bias
+    for(int r = 0; r < 4; ++r) job.bias[r] += job.cols[3][r];
+  }
+  for(int n = 0; n < 256; ++n) job.linear[n] = SrgbToLinear[n];
+  switch(in->layout) {
+  case FB_RGBx: job.rsh = 24; job.gsh = 16; job.bsh = 8; job.ash = 0; break;
+  default:
+  case FB_xRGB: job.ash = 24; job.rsh = 16; job.gsh = 8; job.bsh = 0; break;
+  case FB_BGRx: job.bsh = 24; job.gsh = 16; job.rsh = 8; job.ash = 0; break;
+  case FB_xBGR: job.ash = 24; job.bsh = 16; job.gsh = 8; job.rsh = 0; break;
+  }
+  job.in = in;
+  job.out = out;
+  BandFunc func;
+  if(in_a) func = out_a ? ColorMatrixBand<true, true> : ColorMatrixBand<true, false>;
+  else func = out_a ? ColorMatrixBand<false, true> : ColorMatrixBand<false, false>;
+  ParallelBands(func, &job, 0, in->height, COLOR_MATRIX_BAND_AREA / (in->width > 0 ? in->width : 1) + 1);
+  out->premultiplied = false;
+  if(out_a) {
+    if(out->IsA("Graphic")) ((Graphic*)out)->CheckAlpha();
     else {
-      if(mat->c == 4)
-	return doit43F(L, in, mat, plusr, plusg, plusb, plusa);
-      else
-	return doit33F(L, in, mat, plusr, plusg, plusb, plusa);
+      out->has_alpha = true;
+      out->simple_alpha = false;
     }
   }
+  else {
+    out->has_alpha = false;
+    out->fake_alpha = true;
+  }
+  return 1;
 }
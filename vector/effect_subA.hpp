@@ -1,6 +0,0 @@
-#define out4 0
-#include "effect_subB.hpp"
-#undef out4
-#define out4 1
-#include "effect_subB.hpp"
-#undef out4
@@ -1,6 +0,0 @@
-#define in_A 0
-#include "effect_doit.hpp"
-#undef in_A
-#define in_A 1
-#include "effect_doit.hpp"
-#undef in_A
@@ -0,0 +1,190 @@
+/*
+  This source file is part of the SubCritical core package set.
+  Copyright (C) 2008-2014 Solra Bizna.
+
+  SubCritical is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 2 of the
+  License, or (at your option) any later version.
+
+  SubCritical is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of both the GNU General Public
+  License and the GNU Lesser General Public License along with
+  SubCritical.  If not, see <http://www.gnu.org/licenses/>.
+
+  Please see doc/license.html for clarifications.
+ */
+
+#include "core.h"
+
+#include <stdlib.h>
+
+using namespace SubCritical;
+
+#if defined(WIN32) || defined(_WIN32) || defined(HAVE_WINDOWS)
+/* needs Vista or later, for condition variables */
+typedef CRITICAL_SECTION pool_mutex;
+typedef CONDITION_VARIABLE pool_cond;
+static void mutex_init(pool_mutex* m) { InitializeCriticalSection(m); }
+static void mutex_lock(pool_mutex* m) { EnterCriticalSection(m); }
+static void mutex_unlock(pool_mutex* m) { LeaveCriticalSection(m); }
+static void cond_init(pool_cond* c) { InitializeConditionVariable(c); }
+static void cond_wait(pool_cond* c, pool_mutex* m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void cond_signal(pool_cond* c) { WakeConditionVariable(c); }
+static void cond_broadcast(pool_cond* c) { WakeAllConditionVariable(c); }
+static DWORD WINAPI WorkerMain(LPVOID);
+static bool start_thread() {
+  HANDLE thread = CreateThread(NULL, 0, WorkerMain, NULL, 0, NULL);
+  if(!thread) return false;
+  CloseHandle(thread);
+  return true;
+}
+static int cpu_count() {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+}
+#else
+#include <unistd.h>
+typedef pthread_mutex_t pool_mutex;
+typedef pthread_cond_t pool_cond;
+static void mutex_init(pool_mutex* m) { pthread_mutex_init(m, NULL); }
+static void mutex_lock(pool_mutex* m) { pthread_mutex_lock(m); }
+static void mutex_unlock(pool_mutex* m) { pthread_mutex_unlock(m); }
+static void cond_init(pool_cond* c) { pthread_cond_init(c, NULL); }
+static void cond_wait(pool_cond* c, pool_mutex* m) { pthread_cond_wait(c, m); }
+static void cond_signal(pool_cond* c) { pthread_cond_signal(c); }
+static void cond_broadcast(pool_cond* c) { pthread_cond_broadcast(c); }
+static void* WorkerMain(void*);
+static bool start_thread() {
+  pthread_t thread;
+  if(pthread_create(&thread, NULL, WorkerMain, NULL)) return false;
+  pthread_detach(thread);
+  return true;
+}
+static int cpu_count() {
+#ifdef _SC_NPROCESSORS_ONLN
+  return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+  return 1;
+#endif
+}
+#endif
+
+/* more than this and the bands get too thin to be worth it */
+#define MAX_WORKERS 32
+
+/* The workers are started by Init_core and then live as long as the process
+   does; core is never unloaded. */
+static int worker_count = 0;
+/* protects everything below */
+static pool_mutex lock;
+static pool_cond work_ready, work_done;
+/* true from when a job is submitted until its last band is done */
+static bool job_active = false;
+static unsigned job_serial = 0;
+static BandFunc job_func;
+static void* job_ctx;
+static int job_next, job_last, job_band, job_running;
+
+/* Grab and run bands of the current job until there are none left. Called
+   (and returns) with lock held. */
+static void RunBands() {
+  while(job_next < job_last) {
+    int first = job_next;
+    int last = job_last - first > job_band ? first + job_band : job_last;
+    BandFunc func = job_func;
+    void* ctx = job_ctx;
+    job_next = last;
+    ++job_running;
+    mutex_unlock(&lock);
+    func(ctx, first, last);
+    mutex_lock(&lock);
+    if(--job_running == 0 && job_next >= job_last)
+      cond_signal(&work_done);
+  }
+}
+
+#if defined(WIN32) || defined(_WIN32) || defined(HAVE_WINDOWS)
+static DWORD WINAPI WorkerMain(LPVOID) {
+#else
+static void* WorkerMain(void*) {
+#endif
+#if defined(i386) || defined(__i386) || defined(__i386__)
+  // The same x87 setup Init_core does, so bands done here come out the same
+  // as ones done on the main thread.
+  unsigned int mode = 0x27F;
+  asm("fldcw %0" : : "m" (*&mode));
+#endif
+  mutex_lock(&lock);
+  unsigned seen = job_serial;
+  while(1) {
+    while(job_serial == seen)
+      cond_wait(&work_ready, &lock);
+    seen = job_serial;
+    RunBands();
+  }
+  /* NOTREACHED */
+  mutex_unlock(&lock);
+  return 0;
+}
+
+static void StartPool() {
+  int count;
+  const char* env = getenv("SUBCRITICAL_THREADS");
+  if(env && *env) count = atoi(env);
+  else count = cpu_count();
+  if(count < 1) count = 1;
+  else if(count > MAX_WORKERS) count = MAX_WORKERS;
+  mutex_init(&lock);
+  cond_init(&work_ready);
+  cond_init(&work_done);
+  int started = 1;
+  while(started < count && start_thread())
+    ++started;
+  worker_count = started;
+}
+
+int SubCritical::GetWorkerCount() throw() {
+  /* Init_core makes the first call, before anything else could be using the
+     pool. */
+  if(!worker_count) StartPool();
+  return worker_count;
+}
+
+bool SubCritical::TryParallelBands(BandFunc func, void* ctx, int first, int last, int grain) throw() {
+  if(grain < 1) grain = 1;
+  if(last - first <= grain || GetWorkerCount() <= 1) return false;
+  mutex_lock(&lock);
+  if(job_active) {
+    mutex_unlock(&lock);
+    return false;
+  }
+  /* A few bands per thread, so that one slow band doesn't hold up the rest
+     of the job. */
+  int band = (last - first + worker_count * 4 - 1) / (worker_count * 4);
+  if(band < grain) band = grain;
+  job_active = true;
+  job_func = func;
+  job_ctx = ctx;
+  job_next = first;
+  job_last = last;
+  job_band = band;
+  ++job_serial;
+  cond_broadcast(&work_ready);
+  RunBands();
+  while(job_running > 0)
+    cond_wait(&work_done, &lock);
+  job_active = false;
+  mutex_unlock(&lock);
+  return true;
+}
+
+void SubCritical::ParallelBands(BandFunc func, void* ctx, int first, int last, int grain) throw() {
+  if(last > first && !TryParallelBands(func, ctx, first, last, grain))
+    func(ctx, first, last);
+}